@@ -0,0 +1,292 @@
+/**
+ * @file Benchmark.cpp
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Set of microbenchmarks which are run by --bench CLI argument.
+ * They don't need connected VFD.
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#include "main.h"
+#include "CRC16.h"	// for CRC benchmark
+#include <chrono>	// for high resolution time measure
+#include "Clock.h"	// for latency benchmark
+#include <cmath>	// for transitions benchmark
+
+// Setpoint rate of setpoints benchmark without --setpoints CLI argument (Hz)
+const double benchSetpointRate = 5;
+
+/**
+ * @brief Compare bitwise, table-driven and slicing-by-8 CRC16 on typical frame sizes
+ *
+ * @return true		- if all implementations gave the same results
+ * @return false	- if results mismatch
+ */
+static bool BenchmarkCRC16();
+
+/**
+ * @brief Measure lateness of wake ups at periodic 1 ms absolute deadlines,
+ * the same way diagram loop sleeps (in real-time mode if --realtime is given)
+ *
+ * @return true		- always
+ */
+static bool BenchmarkLatency();
+
+/**
+ * @brief Count request frames of frequency changes over diagram (--file or coords.txt)
+ * as the diagram loop makes them (through zero frequency on direction change):
+ * separate write of every parameter, model of ChangeFrequency() before transition
+ * compiler (shadowed ramp times) and VFD::PlanTransition(). Frames saved against
+ * the model are printed, they may be none
+ *
+ * @return true		- if diagram is loaded
+ * @return false	- if diagram file has errors
+ */
+static bool BenchmarkTransitions();
+
+/**
+ * @brief Run the same diagram (--file or coords.txt) on simulated VFD in ramp mode
+ * and in --setpoints mode (benchSetpointRate without it) and print their tracking
+ * error and bus load side by side. Other mode arguments apply to both runs
+ *
+ * @return true		- if both runs finished
+ * @return false	- if diagram has errors or a run failed
+ */
+static bool BenchmarkSetpoints();
+
+bool RunBenchmark(const char* name)
+{
+	if (!strcmp(name, "crc")) return BenchmarkCRC16();
+	if (!strcmp(name, "latency")) return BenchmarkLatency();
+	if (!strcmp(name, "transitions")) return BenchmarkTransitions();
+	if (!strcmp(name, "setpoints")) return BenchmarkSetpoints();
+	printf("Unknown benchmark: %s\n", name);
+	return false;
+}
+
+static bool BenchmarkCRC16()
+{
+	// Request ADU, 12 registers response and the biggest possible frame
+	const unsigned int frameSizes[] = { 6, 27, 254 };
+	const unsigned int iterations = 200000;
+	unsigned char frame[256];
+	for (unsigned int i = 0; i < sizeof(frame); i++) frame[i] = (unsigned char)(i * 37 + 11);
+
+	printf("Frame\tBitwise(ns)\tTable(ns)\tSlice8(ns)\tSpeedup\n");
+	for (unsigned int s = 0; s < sizeof(frameSizes) / sizeof(frameSizes[0]); s++)
+	{
+		unsigned int length = frameSizes[s];
+		volatile unsigned short sink = 0; // prevents optimizing out the calculation
+		double ns[3];
+		unsigned short results[3];
+		for (int impl = 0; impl < 3; impl++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			unsigned short crc = 0;
+			for (unsigned int i = 0; i < iterations; i++)
+			{
+				frame[0] = (unsigned char)i; // different data on every iteration
+				if (impl == 0) crc = CRC16Bitwise(frame, length);
+				else if (impl == 1) crc = CRC16Update(CRC16_INIT, frame, length);
+				else crc = CRC16UpdateSlice8(CRC16_INIT, frame, length);
+				sink = sink ^ crc;
+			}
+			auto stop = std::chrono::steady_clock::now();
+			ns[impl] = std::chrono::duration<double, std::nano>(stop - start).count() / iterations;
+			results[impl] = crc;
+		}
+		printf("%u\t%.1f\t\t%.1f\t\t%.1f\t\t%.1fx\n", length, ns[0], ns[1], ns[2],
+			ns[0] / ((ns[1] < ns[2]) ? ns[1] : ns[2]));
+		if ((results[0] != results[1]) || (results[0] != results[2]))
+		{
+			printf("CRC mismatch: %04X %04X %04X\n", results[0], results[1], results[2]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool BenchmarkLatency()
+{
+	const unsigned int iterations = 5000;
+	const double period = 0.001;
+	bool realtime = (realtimeCPU >= 0) && EnterRealTime(realtimeCPU);
+	static DeadlineStats_t stats;
+	memset(&stats, 0, sizeof(stats));
+	MonotonicClock clock;
+	double start = clock.Now();
+	for (unsigned int i = 1; i <= iterations; i++)
+	{
+		double deadline = start + i * period;
+		clock.SleepUntil(deadline);
+		RecordDeadline(&stats, clock.Now() - deadline);
+	}
+	printf("Scheduling latency, %u deadlines every %gms (%s mode):\n",
+		iterations, period * 1000, realtime ? "real-time" : ((realtimeCPU >= 0) ? "partial real-time" : "normal"));
+	PrintDeadlineStats(&stats);
+	return true;
+}
+
+/**
+ * @brief Model of frames of frequency change with the branches of ChangeFrequency()
+ * before transition compiler (counted here, the old code is not run): ramp time (one 0x10 request for both on direction
+ * change, skipped only when all its registers hold the value), then run command
+ * with frequency or frequency alone
+ *
+ * @param state[in,out]		- register values the drive holds
+ * @param maxFreq[in]		- maximum output frequency (01-00)
+ * @param curFreq[in]		- current motor frequency
+ * @param newFreq[in]		- new motor frequency
+ * @param changeTime[in]	- time for which the new frequency will be reached
+ * @return unsigned int		- number of request frames
+ */
+static unsigned int LegacyTransitionFrames(VFD_drive_state_t* state, double maxFreq,
+	double curFreq, double newFreq, double changeTime)
+{
+	if (fabs(newFreq - curFreq) < 0.1) return 0;
+	double rampTime = maxFreq * changeTime / fabs(newFreq - curFreq);
+	if (rampTime < 0.1) rampTime = 0.1;
+	if (rampTime > 3600) rampTime = 3600;
+	unsigned short value = (unsigned short)round(rampTime * 10.0);
+	unsigned int frames = 1; // frequency with or without run command
+	if ((curFreq * newFreq) < 0)
+	{
+		if (!(state->accKnown && (state->acc == value) && state->decKnown && (state->dec == value))) frames++;
+		state->accKnown = state->decKnown = true;
+		state->acc = state->dec = value;
+	}
+	else if (fabs(newFreq) > fabs(curFreq))
+	{
+		if (!(state->accKnown && (state->acc == value))) frames++;
+		state->accKnown = true;
+		state->acc = value;
+	}
+	else
+	{
+		if (!(state->decKnown && (state->dec == value))) frames++;
+		state->decKnown = true;
+		state->dec = value;
+	}
+	return frames;
+}
+
+static bool BenchmarkTransitions()
+{
+	const char* fileName = (diagramFileName != nullptr) ? diagramFileName : "coords.txt";
+	const double maxFreq = 50;
+	Diagram_t diagram;
+	if (!LoadDiagram(fileName, maxFreq, &diagram)) return false;
+	// Frames of every parameter written alone: ramp times, run command, frequency
+	unsigned long separateFrames = 0;
+	unsigned long legacyFrames = 0;
+	unsigned long plannedFrames = 0;
+	unsigned long transitions = 0;
+	unsigned long histogram[VFD_MAX_TRANSITION_WRITES + 1] = { 0 }; // transitions by planned frames
+	VFD_drive_state_t legacy;
+	VFD_drive_state_t planned;
+	memset(&legacy, 0, sizeof(legacy));
+	memset(&planned, 0, sizeof(planned));
+	double curTime = 0;
+	double curFreq = 0;
+	for (unsigned long i = 0; i < diagram.count; i++)
+	{
+		// Direction change is two transitions through zero frequency (as the diagram loop does)
+		DiagramPoint_t targets[2];
+		unsigned int nTargets = 0;
+		const DiagramPoint_t* point = &diagram.points[i];
+		if ((curFreq * point->frequency) < 0)
+		{
+			targets[nTargets].frequency = 0;
+			targets[nTargets++].time = curTime - curFreq * (point->time - curTime) / (point->frequency - curFreq);
+		}
+		targets[nTargets++] = *point;
+		for (unsigned int t = 0; t < nTargets; t++)
+		{
+			double newFreq = targets[t].frequency;
+			double changeTime = targets[t].time - curTime;
+			unsigned char ramp = VFD<COMPortFake>::RampParameters(curFreq, newFreq);
+			if (ramp != VFD_RAMP_NONE)
+			{
+				transitions++;
+				if (ramp & VFD_RAMP_ACCELERATION) separateFrames++;
+				if (ramp & VFD_RAMP_DECELERATION) separateFrames++;
+				if ((ramp == (VFD_RAMP_ACCELERATION | VFD_RAMP_DECELERATION)) || (fabs(curFreq) < 0.1)) separateFrames++;
+				separateFrames++;
+				legacyFrames += LegacyTransitionFrames(&legacy, maxFreq, curFreq, newFreq, changeTime);
+				VFD_write_t writes[VFD_MAX_TRANSITION_WRITES];
+				unsigned char nWrites = VFD<COMPortFake>::PlanTransition(&planned, maxFreq, curFreq, newFreq, changeTime, writes);
+				histogram[nWrites]++;
+				plannedFrames += nWrites;
+				// The drive holds what is written
+				for (unsigned char w = 0; w < nWrites; w++)
+					for (unsigned char r = 0; r < writes[w].count; r++)
+						switch (writes[w].address + r)
+						{
+						case 0x0109:
+							planned.accKnown = true;
+							planned.acc = writes[w].values[r];
+							break;
+						case 0x010A:
+							planned.decKnown = true;
+							planned.dec = writes[w].values[r];
+							break;
+						}
+			}
+			curTime = targets[t].time;
+			curFreq = newFreq;
+		}
+	}
+	FreeDiagram(&diagram);
+	if (transitions == 0)
+	{
+		printf("Diagram %s has no frequency changes\n", fileName);
+		return true;
+	}
+	printf("Frequency changes of %s: %lu (01-00 %gHz, motor starts from 0Hz)\n", fileName, transitions, maxFreq);
+	printf("Writes\t\t\tFrames\tPer change\n");
+	printf("Every parameter alone\t%lu\t%.2f\n", separateFrames, (double)separateFrames / transitions);
+	printf("ChangeFrequency() before (model)\t%lu\t%.2f\n", legacyFrames, (double)legacyFrames / transitions);
+	printf("PlanTransition()\t%lu\t%.2f\n", plannedFrames, (double)plannedFrames / transitions);
+	long saved = (long)legacyFrames - (long)plannedFrames;
+	printf("PlanTransition() saves %ld frames (%.0f%%) against ChangeFrequency() before%s\n", saved,
+		(legacyFrames > 0) ? saved * 100.0 / legacyFrames : 0.0, (saved <= 0) ? ": no gain on this diagram" : "");
+	printf("Changes by planned frames:");
+	for (unsigned int n = 1; n <= VFD_MAX_TRANSITION_WRITES; n++) printf(" %u - %lu%s", n, histogram[n],
+		(n < VFD_MAX_TRANSITION_WRITES) ? "," : "\n");
+	return true;
+}
+
+static bool BenchmarkSetpoints()
+{
+	char defaultFile[] = "coords.txt";
+	char* fileName = diagramFileName;
+	double givenRate = setpointRate;
+	double rate = (setpointRate > 0) ? setpointRate : benchSetpointRate;
+	if (diagramFileName == nullptr) diagramFileName = defaultFile;
+	const char* modes[2] = { "Ramps", "Setpoints" };
+	RunStats_t stats[2];
+	bool success = true;
+	for (int mode = 0; (mode < 2) && success; mode++)
+	{
+		printf("%s mode:\n", modes[mode]);
+		setpointRate = mode ? rate : 0;
+		VFD<COMPortFake> motor({ 1, { "COM3", 9600, 8, 'E', 1 } }); // every run starts with stopped motor
+		memset(&runStats, 0, sizeof(runStats));
+		success = RunDiagramFromFile(motor);
+		stats[mode] = runStats;
+	}
+	// Arguments are left as they were given
+	setpointRate = givenRate;
+	diagramFileName = fileName;
+	if (!success) return false;
+	printf("Diagram %s on simulated VFD, setpoints %gHz:\n", (fileName != nullptr) ? fileName : defaultFile, rate);
+	printf("Mode\t\tRMS(Hz)\tMax(Hz)\tSamples\tBus\tWrites\tReads\n");
+	for (int mode = 0; mode < 2; mode++)
+		printf("%s\t%s%.2f\t%.2f\t%lu\t%.0f%%\t%.0f%%\t%.0f%%\n", modes[mode], mode ? "" : "\t",
+			stats[mode].trackingRms, stats[mode].trackingMax, stats[mode].samples,
+			(stats[mode].writeLoad + stats[mode].readLoad) * 100, stats[mode].writeLoad * 100, stats[mode].readLoad * 100);
+	return true;
+}
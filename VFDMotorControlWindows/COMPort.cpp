@@ -1,11 +1,11 @@
 #include "COMPort.h"
+#ifdef _WIN32 // POSIX implementation is in COMPortPosix.cpp
 #include <cstring>	// for string data operations
 
 //#define NDEBUG
 #include <cassert>
 #ifndef NDEBUG
 #include <cstdio>	// for debug printing
-#include <ctime>	// for measuring transfer operations time
 #endif // NDEBUG
 
 bool COMPort::WriteDCB()
@@ -159,7 +159,8 @@ COMPort::COMPort(
 	error(0),
 	tInterval(0),
 	tMultiplier(0),
-	tConstant(1)
+	tConstant(1),
+	clock(&SystemClock())
 {
 	// Check name argument
 	if (name == NULL || *name == 0)
@@ -194,7 +195,8 @@ COMPort::COMPort(COMPort& other) :
 	stopBit(other.stopBit),
 	tInterval(other.tInterval),
 	tMultiplier(other.tMultiplier),
-	tConstant(other.tConstant)
+	tConstant(other.tConstant),
+	clock(other.clock)
 {
 	memcpy(name, other.name, 9);
 	// release handle from other instance to prevent multiple access
@@ -215,6 +217,7 @@ COMPort& COMPort::operator =(COMPort& other)
 		tInterval = other.tInterval;
 		tMultiplier = other.tMultiplier;
 		tConstant = other.tConstant;
+		clock = other.clock;
 		// release handle from other instance to prevent multiple access
 		other.hCOM = INVALID_HANDLE_VALUE;
 	}
@@ -230,7 +233,8 @@ COMPort::COMPort(COMPort&& other) noexcept :
 	stopBit(other.stopBit),
 	tInterval(other.tInterval),
 	tMultiplier(other.tMultiplier),
-	tConstant(other.tConstant)
+	tConstant(other.tConstant),
+	clock(other.clock)
 {
 	// copy port parameters from other instance into this
 	memcpy(name, other.name, 9);
@@ -253,6 +257,7 @@ COMPort& COMPort::operator =(COMPort&& other) noexcept
 		tInterval = other.tInterval;
 		tMultiplier = other.tMultiplier;
 		tConstant = other.tConstant;
+		clock = other.clock;
 		// release handle from other instance
 		other.hCOM = INVALID_HANDLE_VALUE;
 	}
@@ -325,6 +330,21 @@ bool COMPort::isOpen()
 	return GetCommModemStatus(hCOM, &portStat);
 }
 
+unsigned long COMPort::GetBaudrate()
+{
+	return baud;
+}
+
+void COMPort::SetClock(Clock& clock)
+{
+	this->clock = &clock;
+}
+
+Clock& COMPort::GetClock()
+{
+	return *clock;
+}
+
 bool COMPort::Close()
 {
 	bool closeState = 0;
@@ -434,7 +454,7 @@ long COMPort::Write(unsigned char* buf, unsigned char length)
 	for (unsigned int i = 0; i < length; i++)
 		printf(" %02X", buf[i]);
 	printf("\n");
-	clock_t start_time = clock();
+	double start_time = clock->Now();
 #endif // NDEBUG
 	DWORD n_bytes = 0;
 	bool writeStatus = WriteFile(hCOM, buf, length, &n_bytes, NULL);
@@ -448,7 +468,8 @@ long COMPort::Write(unsigned char* buf, unsigned char length)
 	if (writeStatus)
 	{
 #ifndef NDEBUG
-		printf("COMPort::Write() %d bytes written in %ldms\n", n_bytes, (clock() - start_time));
+		printf("COMPort::Write() %d bytes written in %gms\n", n_bytes,
+			(clock->Now() - start_time) * 1000);
 #endif // NDEBUG
 		return (long)n_bytes;
 	}
@@ -465,7 +486,7 @@ long COMPort::Read(unsigned char* buf, unsigned char length)
 {
 	if (isOpen() == false) Open();
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = clock->Now();
 	printf("COMPort::Read() Reading %d bytes from port: 0x", length);
 #endif // NDEBUG
 	DWORD n_bytes = 0;
@@ -482,7 +503,8 @@ long COMPort::Read(unsigned char* buf, unsigned char length)
 #ifndef NDEBUG
 		for (unsigned int i = 0; i < n_bytes; i++)
 			printf(" %02X", buf[i]);
-		printf("\nCOMPort::Read() %d bytes have read in %ldms\n", n_bytes, (clock() - start_time));
+		printf("\nCOMPort::Read() %d bytes have read in %gms\n", n_bytes,
+			(clock->Now() - start_time) * 1000);
 #endif // NDEBUG
 		return (long)n_bytes;
 	}
@@ -494,3 +516,5 @@ long COMPort::Read(unsigned char* buf, unsigned char length)
 		return -1;
 	}
 }
+
+#endif // _WIN32
@@ -2,6 +2,7 @@
  * @file COMPort.h
  * @author TAN4UK (tan4ukmak7@gmail.com)
  * @brief Class for communication with COM port through WinAPI
+ * (or through termios and epoll on POSIX hosts, see COMPortPosix.cpp)
  * @version 0.1
  * @date 2023-02-13
  *
@@ -12,16 +13,36 @@
 #ifndef COMPORT_H
 #define COMPORT_H
 
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <termios.h>
+// Parity constants are the same as in WinAPI to keep SetConfig() arguments portable
+#define NOPARITY    0
+#define ODDPARITY   1
+#define EVENPARITY  2
+#define ONESTOPBIT  0
+#define TWOSTOPBITS 2
+#endif // _WIN32
+
+#include "Clock.h"	// time source for transfer time measure
 
 class COMPort
 {
 private:
+#ifdef _WIN32
 	HANDLE          hCOM;           // COM port handler structure
 	// variable that receives a mask indicating the type of port error
 	DWORD           error;
 
 	char            name[9];	    // COM port name ("COM3" by default)
+#else
+	int             fd;             // serial device file descriptor (-1 if closed)
+	int             epfd;           // epoll instance which waits for received bytes
+	int             error;          // errno of the last failed operation
+
+	char            name[32];       // device path ("/dev/ttyS0" or "/dev/pts/N")
+#endif // _WIN32
 	unsigned long   baud;			// baudrate of communication (9600 by default)
 	unsigned char   dataBit;        // number of bits of data (8 by default)
 	char            parity;         // parity parameter ('N' by default)
@@ -31,6 +52,9 @@ private:
 	unsigned long	tMultiplier;	// multiplier timeout for read operation
 	unsigned long	tConstant;      // constant timeout for read operation
 
+	Clock*          clock;          // time source of users of this port (SystemClock() by default)
+
+#ifdef _WIN32
 	/**
 	 * @brief Write parameters into DCB internal structure
 	 *
@@ -46,11 +70,30 @@ private:
      * @return false    - if fails
      */
 	bool TimeoutsSetup();
+#else
+	/**
+	 * @brief Write parameters into termios structure of the device.
+	 * Port is switched into raw mode, VMIN and VTIME are set to 0 because
+	 * all read timeouts are handled by epoll in WaitReadable()
+	 *
+	 * @return true     - if success
+	 * @return false    - if fails
+	 */
+	bool WriteTermios();
+
+	/**
+	 * @brief Wait until there are bytes in the input buffer of the device
+	 *
+	 * @param timeout[in]   - maximum wait time in milliseconds (-1 means infinite)
+	 * @return int          - 1 if bytes are available, 0 on timeout, -1 if error
+	 */
+	int WaitReadable(long timeout);
+#endif // _WIN32
 public:
 	/**
 	 * @brief Construct a new COMPort object
 	 *
-	 * @param name[in]      - COM port name ("COM3" by default)
+	 * @param name[in]      - COM port name ("COM3" by default, device path like "/dev/ttyUSB0" on POSIX)
 	 * @param baud[in]      - baudrate of communication (9600 by default)
 	 * @param dataBit[in]   - number of bits of data (8 by default)
 	 * @param parity[in]    - parity parameter ('N' or NOPARITY by default)
@@ -121,6 +164,29 @@ public:
 	 */
 	bool isOpen();
 
+	/**
+	 * @brief Get the Baudrate of communication
+	 *
+	 * @return unsigned long	- current baudrate
+	 */
+	unsigned long GetBaudrate();
+
+	/**
+	 * @brief Set the clock which users of this port (ModbusRTUClient,
+	 * diagram runner) measure time and sleep with.
+	 * Read timeouts of the device always go in real time.
+	 *
+	 * @param clock[in]	- time source (must live longer than the port)
+	 */
+	void SetClock(Clock& clock);
+
+	/**
+	 * @brief Get the clock of this port
+	 *
+	 * @return Clock&	- time source (SystemClock() if no other clock is set)
+	 */
+	Clock& GetClock();
+
 	/**
 	 * @brief Close COM port communication
 	 *
@@ -159,6 +225,8 @@ public:
 	 * ReadFile waits until a byte arrives and then returns immediately.
 	 * If no bytes arrive within the time specified by ReadTotalTimeoutConstant,
 	 * ReadFile times out.
+	 * On POSIX hosts the interval is never shorter than 1.5 character times
+	 * at the current baudrate (Modbus_over_serial_line_V1_02.pdf (chapter 2.5.1.1))
 	 * 
 	 * @param interval[in]      - The maximum time allowed to elapse before the arrival of the next byte on the communications line, in milliseconds
 	 * @param multiplier[in]    - The multiplier used to calculate the total time-out period for read operations, in milliseconds.
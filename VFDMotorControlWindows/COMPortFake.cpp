@@ -1,59 +1,22 @@
 #include "COMPortFake.h"
+#include "CRC16.h" // for requests check and responses
 #include <cstring> // for string data operations
 
 //#define NDEBUG
 #include <cassert>
 #ifndef NDEBUG
 #include <cstdio> // for debug printing
-#include <ctime> // for measuring transfer operations time
 #endif // NDEBUG
 
-// Test requests and responses (ADU with server address but without CRC) //////
-unsigned char Write_req[] = { 0x01, 0x06 };
-
-unsigned char ReadParameterRegisters_req[] = { 0x01, 0x03, 0x21, 0x01, 0x00, 0x0C };
-unsigned char ReadParameterRegisters_rsp[] = 
-{ 0x01, 0x03, 0x18, 0x00, 0x00, 0x13, 0x88, 0x13, 0x7E, 0x00, 0x4B, 0x0C, 0x27, 0x08, 0x58, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x53, 0x00, 0x0C, 0x03, 0xA4 };
-
-// 1 kW
-unsigned char GetOutPower_req[] = { 0x01, 0x03, 0x21, 0x0F, 0x00, 0x01 };
-unsigned char GetOutPower_rsp[] = { 0x01, 0x03, 0x02, 0x00, 0x0A };
-
-// 45.6 deg response
-unsigned char GetVFDTemperature_req[] = { 0x01, 0x03, 0x22, 0x06, 0x00, 0x01 };
-unsigned char GetVFDTemperature_rsp[] = { 0x01, 0x03, 0x02, 0x00, 0x19 };
-
-// 50 Hz response
-unsigned char ReadMaxFrequency_req[] = { 0x01, 0x03, 0x01, 0x00, 0x00, 0x01 };
-unsigned char ReadMaxFrequency_rsp[] = { 0x01, 0x03, 0x02, 0x13, 0x88 };
+// Time from the end of request to the start of response of simulated VFD (s)
+const double turnaroundTime = 0.005;
 
 // Testing buffers ////////////////////////////////////////////////////////////
 unsigned char write_buffer[256] = { 0 };
 unsigned char wLength = 0;
-
-unsigned int COMPortFake::CRC16(unsigned char* data, unsigned char length)
-{
-	int j;
-	unsigned int reg_crc = 0xFFFF;
-	while (length--)
-	{
-		unsigned char tmp = *data;
-		data++;
-		reg_crc ^= tmp;
-		for (j = 0; j < 8; j++)
-		{
-			if (reg_crc & 0x01) /* LSB(b0) = 1 */
-			{
-				reg_crc = (reg_crc >> 1) ^ 0xA001;
-			}
-			else
-			{
-				reg_crc = reg_crc >> 1;
-			}
-		}
-	}
-	return reg_crc;
-}
+unsigned char read_buffer[256] = { 0 };	// response to the last request
+unsigned char rLength = 0;				// response length
+unsigned char rPos = 0;					// number of response bytes already read
 
 COMPortFake::COMPortFake(
 	const char* name /* = "COM3" */,
@@ -64,6 +27,9 @@ COMPortFake::COMPortFake(
 {
 	// Init class members
 	opened = false;
+	readConstant = 1;
+	clock = nullptr;
+	syncTime = -1;
 
 	// Check name argument
 	if (name == NULL || *name == 0)
@@ -72,14 +38,15 @@ COMPortFake::COMPortFake(
 		throw("Incorrect device name");
 	}
 	// Copy port name
-	strcpy_s(this->name, 9, name);
+	strncpy(this->name, name, sizeof(this->name) - 1);
+	this->name[sizeof(this->name) - 1] = 0;
 
 	SetConfig(baud, dataBit, parity, stopBit);
 
 #ifndef NDEBUG
 	printf("COMPortFake::Constructor() Created instance 0x%p with params:\n", this);
 	printf("- name: %s\n", name);
-	printf("- baud: %u\n", baud);
+	printf("- baud: %lu\n", baud);
 	printf("- dataBit: %u\n", dataBit);
 	printf("- parity: %c\n", parity);
 	printf("- stopBit: %u\n", stopBit);
@@ -99,7 +66,7 @@ bool COMPortFake::Open()
 {
 	// Create windows device name
 	char portFullName[16] = "\\\\.\\";
-	strcpy_s(&portFullName[4], 12, name);
+	strncpy(&portFullName[4], name, sizeof(portFullName) - 5);
 #ifndef NDEBUG
 	printf("COMPortFake::Open() Full port name: %s\n", portFullName);
 #endif // NDEBUG
@@ -119,6 +86,11 @@ bool COMPortFake::isOpen()
 	return opened;
 }
 
+unsigned long COMPortFake::GetBaudrate()
+{
+	return baud;
+}
+
 bool COMPortFake::Close()
 {
 	opened = false;
@@ -136,24 +108,24 @@ bool COMPortFake::SetConfig(
 {
 	// Check baud argument
 	switch (baud) {
-	case CBR_110:
-	case CBR_300:
-	case CBR_600:
-	case CBR_1200:
-	case CBR_2400:
-	case CBR_4800:
-	case CBR_9600:
-	case CBR_14400:
-	case CBR_19200:
-	case CBR_38400:
-	case CBR_57600:
-	case CBR_115200:
-	case CBR_128000:
-	case CBR_256000:
+	case 110:
+	case 300:
+	case 600:
+	case 1200:
+	case 2400:
+	case 4800:
+	case 9600:
+	case 14400:
+	case 19200:
+	case 38400:
+	case 57600:
+	case 115200:
+	case 128000:
+	case 256000:
 		this->baud = baud;
 		break;
 	default:
-		this->baud = CBR_9600;
+		this->baud = 9600;
 		break;
 	}
 	// Check data bits
@@ -173,12 +145,12 @@ bool COMPortFake::SetConfig(
 		break;
 	}
 	// Check parity argument
-	if (parity == 'E' || parity == 'e' || parity == EVENPARITY) this->parity = EVENPARITY;
-	else if (parity == 'O' || parity == 'o' || parity == ODDPARITY) this->parity = ODDPARITY;
-	else this->parity = NOPARITY;
+	if (parity == 'E' || parity == 'e') this->parity = 'E';
+	else if (parity == 'O' || parity == 'o') this->parity = 'O';
+	else this->parity = 'N';
 	// Check stop bits
-	if (stopBit == 1) this->stopBit = ONESTOPBIT;
-	else this->stopBit = TWOSTOPBITS;
+	if (stopBit == 2) this->stopBit = 2;
+	else this->stopBit = 1;
 	// if not opened then return here
 	if (isOpen() == false) return true;
 #ifndef NDEBUG
@@ -188,10 +160,12 @@ bool COMPortFake::SetConfig(
 }
 
 bool COMPortFake::SetReadTimeouts(
-	unsigned long interval /* = 0 */,
-	unsigned long multiplier /* = 0 */,
+	unsigned long /* interval = 0 */,
+	unsigned long /* multiplier = 0 */,
 	unsigned long constant /* = 1 */)
 {
+	// Simulator answers with whole frames: only the total timeout of silence is used
+	readConstant = constant;
 	if (isOpen() == false) return true;
 #ifndef NDEBUG
 	printf("COMPortFake::SetReadTimeouts() Timeouts is set\n");
@@ -216,7 +190,7 @@ long COMPortFake::Write(unsigned char* buf, unsigned char length)
 	for (int i = 0; i < length; i++)
 		printf(" %02X", buf[i]);
 	printf("\n");
-	clock_t start_time = clock();
+	double start_time = GetClock().Now();
 #endif // NDEBUG
 
 	// Fake writing ///////////////////////////////////////////////////////////
@@ -228,12 +202,12 @@ long COMPortFake::Write(unsigned char* buf, unsigned char length)
 	wCRC = write_buffer[length - 1];				// CRC Hi
 	wCRC = (wCRC << 8) | write_buffer[length - 2];	// CRC Lo
 	unsigned short rCalcCRC = CRC16(write_buffer, (length - 2));
-	Sleep(1); // Write delay
-
 	if (wCRC == rCalcCRC)
 	{
+		PrepareResponse();
 #ifndef NDEBUG
-		printf("COMPortFake::Write() %d bytes written in %ldms\n", length, (clock() - start_time));
+		printf("COMPortFake::Write() %d bytes written in %gms\n", length,
+			(GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
 		return length;
 	}
@@ -250,51 +224,72 @@ long COMPortFake::Read(unsigned char* buf, unsigned char length)
 {
 	if (isOpen() == false) Open();
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = GetClock().Now();
 	printf("COMPortFake::Read() Reading %d bytes from port:", length);
 #endif // NDEBUG
 
 	// Fake read //////////////////////////////////////////////////////////////
-	Sleep(10); // Read delay
-
-	if ((wLength < 3) || (length < 3)) // not a modbus message
-		return -1;
-	// Response to any write request
-	if (!memcmp(write_buffer, Write_req, 2))
-	{
-		memcpy(buf, write_buffer, length);
-		return length;
-	}
-	// Read parameters registers
-	else if (!memcmp(write_buffer, ReadParameterRegisters_req, (wLength - 2)))
-		memcpy(buf, ReadParameterRegisters_rsp, (length - 2));
-	// Read temperature register
-	else if (!memcmp(write_buffer, GetVFDTemperature_req, (wLength - 2)))
-		memcpy(buf, GetVFDTemperature_rsp, (length - 2));
-	// Read OutPower register
-	else if (!memcmp(write_buffer, GetOutPower_req, (wLength - 2)))
-		memcpy(buf, GetOutPower_rsp, (length - 2));
-	// Read max frequency register
-	else if (!memcmp(write_buffer, ReadMaxFrequency_req, (wLength - 2)))
-		memcpy(buf, ReadMaxFrequency_rsp, (length - 2));
-	else
+	if (rPos >= rLength)
 	{
-		// return exception ILLEGAL DATA ADDRESS
-		buf[0] = write_buffer[0];
-		buf[1] = write_buffer[1] + 0x80;
-		buf[2] = 0x02;
-		length = 5;
+		// Nothing to read: time goes on while the client waits
+		GetClock().Sleep(readConstant / 1000.0);
+		Synchronise();
+		return 0; // timeout
 	}
-	// Calculate response CRC
-	unsigned short rCRC = CRC16(buf, (length - 2));
-	buf[length - 2] = rCRC & 0xFF;	// CRC Lo
-	buf[length - 1] = rCRC >> 8;	// CRC Hi
+	// Give the response by parts as a real port does
+	if (length > (rLength - rPos)) length = rLength - rPos;
+	memcpy(buf, &read_buffer[rPos], length);
+	rPos += length;
 
 #ifndef NDEBUG
 	printf(" 0x");
 	for (int i = 0; i < length; i++)
 		printf(" %02X", buf[i]);
-	printf("\nCOMPortFake::Read() %d bytes have read in %ldms\n", length, (clock() - start_time));
+	printf("\nCOMPortFake::Read() %d bytes have read in %gms\n", length,
+		(GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
 	return length;
 }
+
+void COMPortFake::PrepareResponse()
+{
+	rPos = 0;
+	rLength = 0;
+	if (wLength < 4) return; // not a modbus message
+	// Request goes through the line, then VFD answers after its turnaround
+	GetClock().Sleep(wLength * 11.0 / baud);
+	Synchronise();
+	rLength = simulator.Process(write_buffer, (wLength - 2), read_buffer);
+	if (rLength == 0) return; // request to other server or broadcast
+	rLength += 2;
+	// Calculate response CRC
+	unsigned short rCRC = CRC16(read_buffer, (rLength - 2));
+	read_buffer[rLength - 2] = rCRC & 0xFF;	// CRC Lo
+	read_buffer[rLength - 1] = rCRC >> 8;	// CRC Hi
+	// Whole response is on the line when the client reads it
+	GetClock().Sleep(turnaroundTime + rLength * 11.0 / baud);
+	Synchronise();
+}
+
+void COMPortFake::Synchronise()
+{
+	double now = GetClock().Now();
+	if (syncTime >= 0) simulator.Advance(now - syncTime);
+	syncTime = now;
+}
+
+void COMPortFake::SetClock(Clock& clock)
+{
+	this->clock = &clock;
+	syncTime = -1; // time of the new clock has nothing to do with the old one
+}
+
+Clock& COMPortFake::GetClock()
+{
+	return (clock != nullptr) ? *clock : virtualClock;
+}
+
+VFDSimulator& COMPortFake::Simulator()
+{
+	return simulator;
+}
@@ -1,7 +1,10 @@
 /**
  * @file COMPortFake.h
  * @author TAN4UK (tan4ukmak7@gmail.com)
- * @brief Fake class for testing Modbus (returns predefined data instead of reading the port itself)
+ * @brief Fake class for testing Modbus (requests are served by VFDSimulator instead of a real VFD).
+ * It does not depend on OS, so it is available in every build (--fake CLI argument).
+ * Line and response times go by the port clock: virtual ManualClock by default
+ * (nothing sleeps), or any other clock set by SetClock() (e.g. real time)
  * All methods which are marked as not used in their description are not necessary to use.
  * Only 
  * @version 0.1
@@ -14,7 +17,8 @@
 #ifndef COMPORTFAKE_H
 #define COMPORTFAKE_H
 
-#include <Windows.h>
+#include "VFDSimulator.h" // VFD behind the fake port
+#include "Clock.h"        // time source of the simulator and port users
 
 class COMPortFake
 {
@@ -26,28 +30,24 @@ private:
     unsigned char   stopBit;    // number of stop bits (1 by default)
 
     bool            opened;     // current status of COM port
+    unsigned long   readConstant;   // read timeout in ms (virtual time spent on timeout)
+    VFDSimulator    simulator;  // simulated VFD which answers requests
+    ManualClock     virtualClock;   // default clock of the port
+    Clock*          clock;      // clock set by SetClock() (nullptr - virtualClock)
+    double          syncTime;   // clock time the simulator has reached (negative - never synchronised)
 
     /**
-     * @brief Calculates CRC16
-     *    1 :  16-bit  ( CRC )  FFFFH;
-     *    2:    8-bit       
-     *     16-bit  CRC,    CRC .
-     *    3:     CRC   MSB  .  
-     *    LSB.
-     *    4:  LSB CRC   0,   3,     
-     *   CRC     A001H.
-     *    5:   3  4,   ,      . , 
-     *   8-bit   .
-     *    6:    2  5   8-bit    .
-     *         .   CRC  CRC
-     *   .    CRC  ,      CRC 
-     *   ,       .
+     * @brief Advance simulator up to the current time of the port clock
      *
-     * @param data[in]          - a pointer to the message buffer
-     * @param length[in]        - the message buffer length
-     * @return unsigned int     - calculated CRC
      */
-    unsigned int CRC16(unsigned char* data, unsigned char length);
+    void Synchronise();
+
+    /**
+     * @brief Prepare response to the last written request by simulator.
+     * Response is given by parts in Read() like a real port does
+     *
+     */
+    void PrepareResponse();
 public:
     /**
      * @brief (It will work with any configuration in COMPortFake) Construct a new COMPortFake object
@@ -55,8 +55,8 @@ public:
      * @param name[in]      - COM port name ("COM3" by default)
      * @param baud[in]      - baudrate of communication (9600 by default)
      * @param dataBit[in]   - number of bits of data (8 by default)
-     * @param parity[in]    - parity parameter ('N' or NOPARITY by default)
-     * @param stopBit[in]   - number of stop bits (1 or ONESTOPBIT by default)
+     * @param parity[in]    - parity parameter ('N' by default)
+     * @param stopBit[in]   - number of stop bits (1 by default)
      */
     COMPortFake(
         const char* name = "COM3",
@@ -87,6 +87,13 @@ public:
      */
     bool isOpen();
 
+    /**
+     * @brief Get the Baudrate of communication
+     *
+     * @return unsigned long    - current baudrate
+     */
+    unsigned long GetBaudrate();
+
     /**
      * @brief Close COM port communication
      * 
@@ -100,8 +107,8 @@ public:
      * 
      * @param baud[in]      - baudrate of communication (9600 by default)
      * @param dataBit[in]   - number of bits of data (8 by default)
-     * @param parity[in]    - parity parameter ('N' or NOPARITY by default)
-     * @param stopBit[in]   - number of stop bits (1 or ONESTOPBIT by default)
+     * @param parity[in]    - parity parameter ('N' by default)
+     * @param stopBit[in]   - number of stop bits (1 by default)
      * @return true[in]     - if port parameters changed
      * @return false        - if change fails
      */
@@ -161,6 +168,29 @@ public:
      * @return long         - number of read bytes or -1 if error
      */
     long Read(unsigned char* buf, unsigned char length);
+
+    /**
+     * @brief Set the clock which the simulated VFD follows (and users of this port
+     * measure time and sleep with). Virtual clock of the port is used by default,
+     * so diagrams are run faster than real time.
+     *
+     * @param clock[in]     - time source (must live longer than the port)
+     */
+    void SetClock(Clock& clock);
+
+    /**
+     * @brief Get the clock of this port
+     *
+     * @return Clock&       - time source (virtual clock if no other clock is set)
+     */
+    Clock& GetClock();
+
+    /**
+     * @brief Get simulated VFD (to check its state)
+     *
+     * @return VFDSimulator&    - simulator behind this port
+     */
+    VFDSimulator& Simulator();
 };
 
 #endif // COMPORTFAKE_H
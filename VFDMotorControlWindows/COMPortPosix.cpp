@@ -0,0 +1,536 @@
+#include "COMPort.h"
+#ifndef _WIN32 // WinAPI implementation is in COMPort.cpp
+#include <cstring>		// for string data operations
+#include <cerrno>		// for error codes
+#include <cmath>		// for character time calculation
+#include <fcntl.h>		// for 'open'
+#include <unistd.h>		// for 'read', 'write' and 'close'
+#include <poll.h>		// for waiting the output buffer
+#include <sys/epoll.h>	// for waiting received bytes
+#include <time.h>		// for monotonic time in read timeouts
+
+//#define NDEBUG
+#include <cassert>
+#ifndef NDEBUG
+#include <cstdio>	// for debug printing
+#endif // NDEBUG
+
+/**
+ * @brief Get monotonic time (is not affected by system time changes)
+ *
+ * @return long long	- time in milliseconds
+ */
+static long long MonotonicMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Convert baudrate into termios speed constant
+ *
+ * @param baud[in]		- baudrate of communication
+ * @return speed_t		- termios speed constant (B0 if baudrate is not supported)
+ */
+static speed_t BaudToSpeed(unsigned long baud)
+{
+	switch (baud) {
+	case 110:		return B110;
+	case 300:		return B300;
+	case 600:		return B600;
+	case 1200:		return B1200;
+	case 2400:		return B2400;
+	case 4800:		return B4800;
+	case 9600:		return B9600;
+	case 19200:		return B19200;
+	case 38400:		return B38400;
+	case 57600:		return B57600;
+	case 115200:	return B115200;
+#ifdef B230400
+	case 230400:	return B230400;
+#endif
+	default:		return B0;
+	}
+}
+
+bool COMPort::WriteTermios()
+{
+	struct termios tty;
+	if (tcgetattr(fd, &tty) != 0)
+	{
+		error = errno;
+		assert(("COMPort::WriteTermios() Read termios error", 0));
+		return false;
+	}
+	// Raw mode: no line editing, no echo, no signals and no character translation
+	cfmakeraw(&tty);
+	// Set data bits
+	tty.c_cflag &= ~CSIZE;
+	if (dataBit == 5) tty.c_cflag |= CS5;
+	else if (dataBit == 6) tty.c_cflag |= CS6;
+	else if (dataBit == 7) tty.c_cflag |= CS7;
+	else tty.c_cflag |= CS8;
+	// Set parity
+	tty.c_cflag &= ~(PARENB | PARODD);
+	if (parity == EVENPARITY) tty.c_cflag |= PARENB;
+	else if (parity == ODDPARITY) tty.c_cflag |= PARENB | PARODD;
+	// Set stop bits
+	if (stopBit == TWOSTOPBITS) tty.c_cflag |= CSTOPB;
+	else tty.c_cflag &= ~CSTOPB;
+	// Ignore modem control lines and enable receiver
+	tty.c_cflag |= CLOCAL | CREAD;
+#ifdef CRTSCTS
+	tty.c_cflag &= ~CRTSCTS;	// No hardware handshaking
+#endif
+	tty.c_iflag &= ~(IXON | IXOFF | IXANY); // No software handshaking
+	// read() returns immediately, timeouts are handled by epoll
+	tty.c_cc[VMIN] = 0;
+	tty.c_cc[VTIME] = 0;
+	speed_t speed = BaudToSpeed(baud);
+	cfsetispeed(&tty, speed);
+	cfsetospeed(&tty, speed);
+	if (tcsetattr(fd, TCSANOW, &tty) != 0)
+	{
+		error = errno;
+		assert(("COMPort::WriteTermios() Write termios error", 0));
+		return false;
+	}
+#ifndef NDEBUG
+	printf("COMPort::WriteTermios() Write termios success (baud: %lu, dataBit: %u, parity: %d, stopBit: %u)\n",
+		baud, dataBit, parity, stopBit);
+#endif // NDEBUG
+	return true;
+}
+
+int COMPort::WaitReadable(long timeout)
+{
+	struct epoll_event event;
+	while (true)
+	{
+		int n = epoll_wait(epfd, &event, 1, (int)timeout);
+		if (n >= 0) return (n > 0) ? 1 : 0;
+		if (errno != EINTR)
+		{
+			error = errno;
+			return -1;
+		}
+	}
+}
+
+COMPort::COMPort(
+	const char* name /* = "COM3" */,
+	unsigned long baud /* = 9600 */,
+	unsigned char dataBit /* = 8 */,
+	char parity /* = 'N' */,
+	unsigned char stopBit /* = 1 */) :
+	fd(-1),
+	epfd(-1),
+	error(0),
+	tInterval(0),
+	tMultiplier(0),
+	tConstant(1),
+	clock(&SystemClock())
+{
+	// Check name argument
+	if (name == NULL || *name == 0 || strlen(name) >= sizeof(this->name))
+	{
+		assert(("COMPort::Constructor() Incorrect port name", 0));
+		throw("Incorrect port name");
+	}
+	// Copy port name
+	strcpy(this->name, name);
+	// Set default config
+	SetConfig(baud, dataBit, parity, stopBit);
+
+#ifndef NDEBUG
+	printf("COMPort::Constructor() Created instance 0x%p with params:\n", this);
+	printf("- name: %s\n", name);
+	printf("- baud: %lu\n", baud);
+	printf("- dataBit: %u\n", dataBit);
+	printf("- parity: %c\n", parity);
+	printf("- stopBit: %u\n", stopBit);
+	printf("- tInterval: %lu\n", tInterval);
+	printf("- tMultiplier: %lu\n", tMultiplier);
+	printf("- tConstant: %lu\n", tConstant);
+#endif // NDEBUG
+}
+
+COMPort::COMPort(COMPort& other) :
+	fd(other.fd),
+	epfd(other.epfd),
+	error(other.error),
+	baud(other.baud),
+	dataBit(other.dataBit),
+	parity(other.parity),
+	stopBit(other.stopBit),
+	tInterval(other.tInterval),
+	tMultiplier(other.tMultiplier),
+	tConstant(other.tConstant),
+	clock(other.clock)
+{
+	memcpy(name, other.name, sizeof(name));
+	// release descriptors from other instance to prevent multiple access
+	other.fd = -1;
+	other.epfd = -1;
+}
+
+COMPort& COMPort::operator =(COMPort& other)
+{
+	if (this != &other)
+	{
+		Close();
+		fd = other.fd;
+		epfd = other.epfd;
+		error = other.error;
+		memcpy(name, other.name, sizeof(name));
+		baud = other.baud;
+		dataBit = other.dataBit;
+		parity = other.parity;
+		stopBit = other.stopBit;
+		tInterval = other.tInterval;
+		tMultiplier = other.tMultiplier;
+		tConstant = other.tConstant;
+		clock = other.clock;
+		// release descriptors from other instance to prevent multiple access
+		other.fd = -1;
+		other.epfd = -1;
+	}
+	return (*this);
+}
+
+COMPort::COMPort(COMPort&& other) noexcept :
+	fd(other.fd),
+	epfd(other.epfd),
+	error(other.error),
+	baud(other.baud),
+	dataBit(other.dataBit),
+	parity(other.parity),
+	stopBit(other.stopBit),
+	tInterval(other.tInterval),
+	tMultiplier(other.tMultiplier),
+	tConstant(other.tConstant),
+	clock(other.clock)
+{
+	// copy port parameters from other instance into this
+	memcpy(name, other.name, sizeof(name));
+	// release descriptors from other instance to prevent multiple access
+	other.fd = -1;
+	other.epfd = -1;
+}
+
+COMPort& COMPort::operator =(COMPort&& other) noexcept
+{
+	if (this != &other)
+	{
+		Close();
+		// copy port parameters from other instance into this
+		fd = other.fd;
+		epfd = other.epfd;
+		error = other.error;
+		memcpy(name, other.name, sizeof(name));
+		baud = other.baud;
+		dataBit = other.dataBit;
+		parity = other.parity;
+		stopBit = other.stopBit;
+		tInterval = other.tInterval;
+		tMultiplier = other.tMultiplier;
+		tConstant = other.tConstant;
+		clock = other.clock;
+		// release descriptors from other instance
+		other.fd = -1;
+		other.epfd = -1;
+	}
+	return (*this);
+}
+
+COMPort::~COMPort()
+{
+	Close();
+#ifndef NDEBUG
+	printf("COMPort::Destructor() Deleted instance 0x%p\n", this);
+#endif // NDEBUG
+}
+
+bool COMPort::Open()
+{
+#ifndef NDEBUG
+	printf("COMPort::Open() Device path: %s\n", name);
+#endif // NDEBUG
+	if (isOpen() == true) Close(); // close port if it is already opened by accident
+
+	// Try to open port (non-blocking, all waits are done with epoll)
+	fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		error = errno;
+		if (error == ENOENT)
+		{
+			assert(("COMPort::Open() Device not connected", 0));
+		}
+		else if ((error == EACCES) || (error == EBUSY))
+		{
+			assert(("COMPort::Open() Port is used by another program or access denied", 0));
+		}
+		else
+		{
+			assert(("COMPort::Open() Other error in port opening", 0));
+		}
+		return false;
+	}
+	// Register receive event
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if ((epfd < 0) || (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0))
+	{
+		error = errno;
+		assert(("COMPort::Open() epoll setup error", 0));
+		Close();
+		return false;
+	}
+	// Here port is totally opened
+
+	if (!WriteTermios())
+	{
+		Close();
+		return false;
+	}
+	// Here port parameters is set
+	if (!ClearReadBuffer()) return false;
+#ifndef NDEBUG
+	printf("COMPort::Open() Port opened (fd: %d)\n", fd);
+#endif // NDEBUG
+	return true;
+}
+
+bool COMPort::isOpen()
+{
+	return fd >= 0;
+}
+
+unsigned long COMPort::GetBaudrate()
+{
+	return baud;
+}
+
+void COMPort::SetClock(Clock& clock)
+{
+	this->clock = &clock;
+}
+
+Clock& COMPort::GetClock()
+{
+	return *clock;
+}
+
+bool COMPort::Close()
+{
+	bool closeState = true;
+	if (epfd >= 0) close(epfd);
+	if (fd >= 0)
+	{
+#ifndef NDEBUG
+		printf("COMPort::Close() Port closed (fd: %d)\n", fd);
+#endif // NDEBUG
+		closeState = (close(fd) == 0);
+	}
+	fd = -1;
+	epfd = -1;
+	return closeState;
+}
+
+bool COMPort::SetConfig(
+	unsigned long baud /* = 9600 */,
+	unsigned char dataBit /* = 8 */,
+	char parity /* = 'N' */,
+	unsigned char stopBit /* = 1 */)
+{
+	// Check baud argument
+	if (BaudToSpeed(baud) != B0) this->baud = baud;
+	else this->baud = 9600;
+	// Check data bits
+	switch (dataBit) {
+	case 5:
+		this->dataBit = 5;
+		break;
+	case 6:
+		this->dataBit = 6;
+		break;
+	case 7:
+		this->dataBit = 7;
+		break;
+	case 8:
+	default:
+		this->dataBit = 8;
+		break;
+	}
+	// Check parity argument
+	if (parity == 'E' || parity == 'e' || parity == EVENPARITY) this->parity = EVENPARITY;
+	else if (parity == 'O' || parity == 'o' || parity == ODDPARITY) this->parity = ODDPARITY;
+	else this->parity = NOPARITY;
+	// Check stop bits
+	if (stopBit == 1) this->stopBit = ONESTOPBIT;
+	else this->stopBit = TWOSTOPBITS;
+	// if not opened then return here
+	if (isOpen() == false) return true;
+	// if opened then write parameters into termios
+	if (!WriteTermios()) return false;
+#ifndef NDEBUG
+	printf("COMPort::SetConfig() Config is set\n");
+#endif // NDEBUG
+	return true;
+}
+
+bool COMPort::SetReadTimeouts(
+	unsigned long interval /* = 0 */,
+	unsigned long multiplier /* = 0 */,
+	unsigned long constant /* = 1 */)
+{
+	// Interval shorter than 1.5 character times will split frames at low baudrates
+	if (interval != 0)
+	{
+		unsigned int charBits = 1 + dataBit + ((parity == NOPARITY) ? 0 : 1) +
+			((stopBit == TWOSTOPBITS) ? 2 : 1);
+		double t15 = (baud > 19200) ? 0.75 : (1.5 * charBits * 1000.0 / baud);
+		unsigned long minInterval = (unsigned long)ceil(t15) + 1; // +1 ms for epoll resolution
+		if (interval < minInterval) interval = minInterval;
+	}
+	tInterval = interval;
+	tMultiplier = multiplier;
+	tConstant = constant;
+#ifndef NDEBUG
+	printf("COMPort::SetReadTimeouts() Timeouts is set (%lu, %lu, %lu)\n",
+		tInterval, tMultiplier, tConstant);
+#endif // NDEBUG
+	return true;
+}
+
+bool COMPort::ClearReadBuffer()
+{
+	if (isOpen() == false) return true;
+	if (tcflush(fd, TCIFLUSH) != 0)
+	{
+		error = errno;
+		assert(("COMPort::ClearReadBuffer() Clearing read buffer error", 0));
+		return false;
+	}
+#ifndef NDEBUG
+	printf("COMPort::ClearReadBuffer() Clearing read buffer success\n");
+#endif // NDEBUG
+	return true;
+}
+
+long COMPort::Write(unsigned char* buf, unsigned char length)
+{
+	if (isOpen() == false) Open();
+#ifndef NDEBUG
+	printf("COMPort::Write() Writing %d bytes into port: 0x", length);
+	for (unsigned int i = 0; i < length; i++)
+		printf(" %02X", buf[i]);
+	printf("\n");
+	long long start_time = MonotonicMs();
+#endif // NDEBUG
+	long n_bytes = 0;
+	while (n_bytes < length)
+	{
+		ssize_t n = write(fd, buf + n_bytes, length - n_bytes);
+		if (n > 0)
+		{
+			n_bytes += n;
+			continue;
+		}
+		if ((n < 0) && (errno == EINTR)) continue;
+		int code = errno;
+		if (n == 0) code = EIO; // nothing is written without an error: errno is stale
+		else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			// Output buffer is full, wait until driver accepts more bytes
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			int ready = poll(&pfd, 1, -1);
+			if ((ready < 0) && (errno == EINTR)) continue;
+			if ((ready > 0) && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) continue;
+			// Line is broken: write() would fail again at once
+			code = (ready < 0) ? errno : EIO;
+		}
+		error = code;
+		if (error == EIO)
+		{
+			assert(("COMPort::Write() Connection to port lost", 0));
+		}
+#ifndef NDEBUG
+		printf("COMPort::Write() Write failed error %d\n", error);
+#endif // NDEBUG
+		return -1;
+	}
+#ifndef NDEBUG
+	printf("COMPort::Write() %ld bytes written in %lldms\n", n_bytes, (MonotonicMs() - start_time));
+#endif // NDEBUG
+	return n_bytes;
+}
+
+long COMPort::Read(unsigned char* buf, unsigned char length)
+{
+	if (isOpen() == false) Open();
+#ifndef NDEBUG
+	long long start_time = MonotonicMs();
+	printf("COMPort::Read() Reading %d bytes from port: 0x", length);
+#endif // NDEBUG
+	// Same semantics as COMMTIMEOUTS: total timeout for the whole operation
+	// (not used if multiplier and constant are 0) and interval timeout between
+	// bytes (starts after the first byte, not used if it is 0)
+	bool total = (tMultiplier != 0) || (tConstant != 0);
+	long long deadline = MonotonicMs() + tMultiplier * length + tConstant;
+	long n_bytes = 0;
+	while (n_bytes < length)
+	{
+		// Take all bytes which are already in the buffer without waiting
+		ssize_t n = read(fd, buf + n_bytes, length - n_bytes);
+		if (n > 0)
+		{
+			n_bytes += n;
+			continue;
+		}
+		if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		{
+			error = errno;
+			if (error == EIO)
+			{
+				assert(("COMPort::Read() Connection to port lost", 0));
+			}
+#ifndef NDEBUG
+			printf("\nCOMPort::Read() Read failed error %d\n", error);
+#endif // NDEBUG
+			return -1;
+		}
+		// Calculate how long the next byte can be waited
+		long timeout = -1;
+		if (total)
+		{
+			long long left = deadline - MonotonicMs();
+			if (left < 0) left = 0;
+			timeout = (long)left;
+		}
+		if ((n_bytes > 0) && (tInterval != 0) && ((timeout < 0) || ((long)tInterval < timeout)))
+			timeout = (long)tInterval;
+		int ready = WaitReadable(timeout);
+		if (ready < 0)
+		{
+#ifndef NDEBUG
+			printf("\nCOMPort::Read() Wait failed error %d\n", error);
+#endif // NDEBUG
+			return -1;
+		}
+		if (ready == 0) break; // timeout, return bytes that have been received
+	}
+#ifndef NDEBUG
+	for (long i = 0; i < n_bytes; i++)
+		printf(" %02X", buf[i]);
+	printf("\nCOMPort::Read() %ld bytes have read in %lldms\n", n_bytes, (MonotonicMs() - start_time));
+#endif // NDEBUG
+	return n_bytes;
+}
+
+#endif // _WIN32
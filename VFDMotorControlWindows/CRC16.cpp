@@ -0,0 +1,50 @@
+#include "CRC16.h"
+
+// Tables are calculated by compiler, nothing is done at program start
+constexpr CRC16Tables crc16Tables;
+
+unsigned short CRC16Bitwise(const unsigned char* data, unsigned int length)
+{
+	unsigned int i = 0;
+	unsigned int CRC16 = 0xFFFF;
+	while (length > i)
+	{
+		CRC16 = CRC16 ^ data[i];
+		for (int j = 0; j < 8; j++)
+		{
+			if (CRC16 & 0x01)
+			{
+				CRC16 = (CRC16 >> 1) ^ 0xA001;
+			}
+			else
+			{
+				CRC16 = CRC16 >> 1;
+			}
+		}
+		i = i + 1;
+	}
+	return (unsigned short)CRC16;
+}
+
+unsigned short CRC16Update(unsigned short crc, const unsigned char* data, unsigned int length)
+{
+	while (length--)
+		crc = CRC16Update(crc, *data++);
+	return crc;
+}
+
+unsigned short CRC16UpdateSlice8(unsigned short crc, const unsigned char* data, unsigned int length)
+{
+	const unsigned short (*t)[256] = crc16Tables.table;
+	while (length >= 8)
+	{
+		// CRC register covers the first 2 bytes, the rest 6 bytes are independent lookups
+		unsigned short x = (unsigned short)(crc ^ (data[0] | (data[1] << 8)));
+		crc = (unsigned short)(t[7][x & 0xFF] ^ t[6][x >> 8] ^
+			t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^
+			t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]]);
+		data += 8;
+		length -= 8;
+	}
+	return CRC16Update(crc, data, length);
+}
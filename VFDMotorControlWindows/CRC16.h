@@ -0,0 +1,122 @@
+/**
+ * @file CRC16.h
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Modbus CRC16 calculation shared by ModbusRTUClient, COMPortFake and benchmarks.
+ * Tables are generated at compile time from the polynomial A001H.
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#ifndef CRC16_H
+#define CRC16_H
+
+// Initial value of the CRC register
+const unsigned short CRC16_INIT = 0xFFFF;
+
+// Tables for table-driven and slicing-by-8 CRC16 calculation
+struct CRC16Tables
+{
+	// table[0] is the classic byte table, table[k] is the CRC of a byte
+	// followed by k zero bytes
+	unsigned short table[8][256];
+
+	/**
+	 * @brief Construct tables at compile time
+	 *
+	 */
+	constexpr CRC16Tables() : table()
+	{
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			unsigned short crc = (unsigned short)i;
+			for (int j = 0; j < 8; j++)
+				crc = (crc & 0x01) ? (unsigned short)((crc >> 1) ^ 0xA001) : (unsigned short)(crc >> 1);
+			table[0][i] = crc;
+		}
+		for (unsigned int k = 1; k < 8; k++)
+			for (unsigned int i = 0; i < 256; i++)
+				table[k][i] = (unsigned short)((table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF]);
+	}
+};
+
+extern const CRC16Tables crc16Tables; // defined in CRC16.cpp
+
+/**
+ * @brief Calculates CRC16 bit by bit (reference implementation)
+ *
+ * Step 1: Load a 16-bit register (called CRC register) with FFFFH.
+ * Step 2: Exclusive OR the first 8-bit byte of the command message
+ * with the low order byte of the 16-bit CRC register,
+ * putting the result in the CRC register.
+ * Step 3: Examine the LSB of CRC register.
+ * Step 4: If the LSB of CRC register is 0, shift the CRC register
+ * one bit to the right with MSB zero filling, then repeat step 3.
+ * If the LSB of CRC register is 1, shift the CRC register
+ * one bit to the right with MSB zero filling, Exclusive OR the
+ * CRC register with the polynomial value A001H, then repeat step 3.
+ * Step 5: Repeat step 3 and 4 until eight shifts have been performed.
+ * When this is done, a complete 8-bit byte will have been processed.
+ * Step 6: Repeat step 2 to 5 for the next 8-bit byte of the command message.
+ * Continue doing this until all bytes have been processed.
+ * The final contents of the CRC register are the CRC value.
+ * When transmitting the CRC value in the message,
+ * the upper and lower bytes of the CRC value must be swapped,
+ * i.e. the lower order byte will be transmitted first.
+ *
+ * @param data[in]			- a pointer to the message buffer
+ * @param length[in]		- the message buffer length
+ * @return unsigned short	- calculated CRC
+ */
+unsigned short CRC16Bitwise(const unsigned char* data, unsigned int length);
+
+/**
+ * @brief Continue CRC16 calculation with one more byte (one table lookup instead of 8 shifts)
+ *
+ * @param crc[in]			- CRC of previous bytes (CRC16_INIT for the first byte)
+ * @param byte[in]			- next message byte
+ * @return unsigned short	- updated CRC
+ */
+inline unsigned short CRC16Update(unsigned short crc, unsigned char byte)
+{
+	return (unsigned short)((crc >> 8) ^ crc16Tables.table[0][(crc ^ byte) & 0xFF]);
+}
+
+/**
+ * @brief Continue CRC16 calculation with a part of message byte by byte.
+ * Allows to calculate CRC while bytes are arriving.
+ *
+ * @param crc[in]			- CRC of previous bytes (CRC16_INIT for the first part)
+ * @param data[in]			- a pointer to the next part of message
+ * @param length[in]		- length of the part
+ * @return unsigned short	- updated CRC
+ */
+unsigned short CRC16Update(unsigned short crc, const unsigned char* data, unsigned int length);
+
+/**
+ * @brief Continue CRC16 calculation with a part of message 8 bytes at a time
+ * (slicing-by-8). The tail which is shorter than 8 bytes is processed byte by byte.
+ *
+ * @param crc[in]			- CRC of previous bytes (CRC16_INIT for the first part)
+ * @param data[in]			- a pointer to the next part of message
+ * @param length[in]		- length of the part
+ * @return unsigned short	- updated CRC
+ */
+unsigned short CRC16UpdateSlice8(unsigned short crc, const unsigned char* data, unsigned int length);
+
+/**
+ * @brief Calculates CRC16 of the whole message
+ *
+ * @param data[in]			- a pointer to the message buffer
+ * @param length[in]		- the message buffer length
+ * @return unsigned short	- calculated CRC
+ */
+inline unsigned short CRC16(const unsigned char* data, unsigned int length)
+{
+	// Frames shorter than 8 bytes fall through to the byte table inside
+	return CRC16UpdateSlice8(CRC16_INIT, data, length);
+}
+
+#endif // CRC16_H
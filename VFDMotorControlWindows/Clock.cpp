@@ -0,0 +1,89 @@
+#include "Clock.h"
+#ifdef _WIN32
+#include <chrono>	// for monotonic high resolution time
+#include <thread>	// for sleeping
+#else
+#include <time.h>	// for CLOCK_MONOTONIC and clock_nanosleep
+#include <cerrno>	// for EINTR
+#endif // _WIN32
+
+unsigned long Clock::NowMs()
+{
+	return (unsigned long)(long long)(Now() * 1000.0);
+}
+
+#ifdef _WIN32
+double MonotonicClock::Now()
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MonotonicClock::Sleep(double seconds)
+{
+	if (seconds <= 0) return;
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+void MonotonicClock::SleepUntil(double time)
+{
+	std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(time))));
+}
+#else
+double MonotonicClock::Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void MonotonicClock::Sleep(double seconds)
+{
+	if (seconds <= 0) return;
+	SleepUntil(Now() + seconds);
+}
+
+void MonotonicClock::SleepUntil(double time)
+{
+	if (time <= 0) return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)time;
+	ts.tv_nsec = (long)((time - ts.tv_sec) * 1e9);
+	if (ts.tv_nsec >= 1000000000L) ts.tv_nsec = 999999999L;
+	// Absolute deadline: sleep interrupted by a signal is simply repeated
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR);
+}
+#endif // _WIN32
+
+ManualClock::ManualClock(double start /* = 0 */) :
+	time(start)
+{
+}
+
+double ManualClock::Now()
+{
+	return time;
+}
+
+void ManualClock::Sleep(double seconds)
+{
+	Advance(seconds);
+}
+
+void ManualClock::SleepUntil(double time)
+{
+	Advance(time - this->time);
+}
+
+void ManualClock::Advance(double seconds)
+{
+	if (seconds > 0) time += seconds;
+}
+
+Clock& SystemClock()
+{
+	static MonotonicClock clock;
+	return clock;
+}
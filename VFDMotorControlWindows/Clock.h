@@ -0,0 +1,95 @@
+/**
+ * @file Clock.h
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Time source and sleeper used by ports, ModbusRTUClient and diagram runner.
+ * MonotonicClock is the real time (default of COMPort), ManualClock is a virtual
+ * time which goes only when somebody sleeps or advances it (default of COMPortFake),
+ * so the same program runs diagrams against the simulator faster than real time.
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+class Clock
+{
+public:
+	virtual ~Clock() {}
+
+	/**
+	 * @brief Get current time (never goes back)
+	 *
+	 * @return double	- time in seconds from clock dependent origin
+	 */
+	virtual double Now() = 0;
+
+	/**
+	 * @brief Wait until the time goes on
+	 *
+	 * @param seconds[in]	- wait time in seconds
+	 */
+	virtual void Sleep(double seconds) = 0;
+
+	/**
+	 * @brief Wait until absolute time. Unlike Sleep() in a loop, the time
+	 * of wake up does not depend on how long the previous work took
+	 *
+	 * @param time[in]	- time to wake up in seconds (returns at once if it has passed)
+	 */
+	virtual void SleepUntil(double time) = 0;
+
+	/**
+	 * @brief Get current time in milliseconds (for time stamps and intervals)
+	 *
+	 * @return unsigned long	- time in milliseconds (wraps around)
+	 */
+	unsigned long NowMs();
+};
+
+// Real monotonic time (is not affected by system time changes).
+// CLOCK_MONOTONIC and clock_nanosleep(TIMER_ABSTIME) on POSIX hosts
+class MonotonicClock : public Clock
+{
+public:
+	double Now() override;
+	void Sleep(double seconds) override;
+	void SleepUntil(double time) override;
+};
+
+// Virtual time: Sleep() returns at once and moves the time forward
+class ManualClock : public Clock
+{
+private:
+	double	time;	// current virtual time in seconds
+public:
+	/**
+	 * @brief Construct a new ManualClock object
+	 *
+	 * @param start[in]	- initial time in seconds
+	 */
+	ManualClock(double start = 0);
+
+	double Now() override;
+	void Sleep(double seconds) override;
+	void SleepUntil(double time) override;
+
+	/**
+	 * @brief Move the time forward (the same as Sleep())
+	 *
+	 * @param seconds[in]	- time step in seconds (negative steps are ignored)
+	 */
+	void Advance(double seconds);
+};
+
+/**
+ * @brief Get the clock which is used when no other clock is set
+ *
+ * @return Clock&	- shared MonotonicClock instance
+ */
+Clock& SystemClock();
+
+#endif // CLOCK_H
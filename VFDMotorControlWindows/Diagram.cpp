@@ -0,0 +1,596 @@
+#include "Diagram.h"
+#include "Portable.h"	// for MSVC functions on POSIX hosts
+#include <cstdlib>	// for diagram memory
+#include <cstring>	// for messages
+#include <cmath>	// for frequency range check
+#include <chrono>	// for waits of reader thread
+#ifdef _WIN32
+#include <Windows.h>	// for file mapping
+#else
+#include <cerrno>		// for error codes
+#include <fcntl.h>		// for 'open'
+#include <unistd.h>		// for 'close'
+#include <sys/mman.h>	// for 'mmap'
+#include <sys/stat.h>	// for file size
+#endif // _WIN32
+
+//#define NDEBUG
+#include <cassert>
+
+// Reader thread checks the queue with this period when it is full (ms)
+const unsigned int readerWaitMs = 1;
+
+void InitDiagramParser(DiagramParser_t* parser, double maxFrequency)
+{
+	memset(parser, 0, sizeof(*parser));
+	parser->maxFrequency = maxFrequency;
+	parser->pointTime = -1;
+}
+
+DiagramLine_t ParseDiagramLine(DiagramParser_t* parser, const char* line,
+	DiagramPoint_t* point, char* message, size_t size)
+{
+	parser->lineNumber++;
+	double time, freq;
+	int read_result = sscanf_s(line, "%lf%lf", &time, &freq);
+	if (read_result != 2)
+	{
+		// Empty lines and header (text before the first point) have no numbers
+		const char* c = line;
+		while ((*c == ' ') || (*c == '\t')) c++;
+		if ((*c == '\r') || (*c == '\n') || (*c == 0)) return DIAGRAM_LINE_EMPTY;
+		if ((read_result <= 0) && (parser->pointLine == 0)) return DIAGRAM_LINE_EMPTY;
+		snprintf(message, size, "Diagram line %lu: time and frequency expected", parser->lineNumber);
+		return DIAGRAM_LINE_ERROR;
+	}
+	// Time goes only forward
+	if (time < 0)
+	{
+		snprintf(message, size, "Diagram line %lu: time %g is negative", parser->lineNumber, time);
+		return DIAGRAM_LINE_ERROR;
+	}
+	if (time <= parser->pointTime)
+	{
+		snprintf(message, size, "Diagram line %lu: time %g is not after time %g of line %lu",
+			parser->lineNumber, time, parser->pointTime, parser->pointLine);
+		return DIAGRAM_LINE_ERROR;
+	}
+	parser->pointTime = time;
+	parser->pointLine = parser->lineNumber;
+	// Frequency is in range of VFD (01-00)
+	if (fabs(freq) > parser->maxFrequency)
+	{
+		snprintf(message, size, "Diagram line %lu: frequency %g is out of range -%g..%gHz (01-00)",
+			parser->lineNumber, freq, parser->maxFrequency, parser->maxFrequency);
+		return DIAGRAM_LINE_ERROR;
+	}
+	// Point which is too close to the previous one is merged into the next one
+	if (time < (parser->keptTime + minSegmentTime))
+	{
+		// Motor starts from its current frequency, point at 0 s only marks the start
+		if ((time == 0) && (parser->keptLine == 0)) return DIAGRAM_LINE_EMPTY;
+		if (parser->keptLine == 0)
+			snprintf(message, size, "Diagram line %lu: point (%gs, %gHz) merged, it is less than %gs after the start",
+				parser->lineNumber, time, freq, minSegmentTime);
+		else snprintf(message, size, "Diagram line %lu: point (%gs, %gHz) merged, it is less than %gs after line %lu",
+			parser->lineNumber, time, freq, minSegmentTime, parser->keptLine);
+		parser->merged++;
+		return DIAGRAM_LINE_MERGED;
+	}
+	point->time = time;
+	point->frequency = freq;
+	parser->keptTime = time;
+	parser->keptLine = parser->lineNumber;
+	return DIAGRAM_LINE_POINT;
+}
+
+bool LoadDiagram(const char* fileName, double maxFrequency, Diagram_t* diagram)
+{
+	diagram->points = nullptr;
+	diagram->count = 0;
+	FILE* diagram_FILE;
+	int openStatus = fopen_s(&diagram_FILE, fileName, "r");
+#ifndef NDEBUG
+	printf("main::LoadDiagram() File %p opened\n", diagram_FILE);
+#endif // NDEBUG
+	if ((diagram_FILE == nullptr) || openStatus)
+	{
+		printf("Diagram: can't open file %s\n", fileName);
+		assert(("main::LoadDiagram(): Read coords file error", 0));
+		return false;
+	}
+	DiagramParser_t parser;
+	InitDiagramParser(&parser, maxFrequency);
+	unsigned long capacity = 0;	// number of points the buffer can hold
+	bool valid = true;
+	char line[256];
+	char message[160];
+	while (fgets(line, sizeof(line), diagram_FILE) != nullptr)
+	{
+		DiagramPoint_t point;
+		DiagramLine_t type = ParseDiagramLine(&parser, line, &point, message, sizeof(message));
+		if (type == DIAGRAM_LINE_ERROR) valid = false;
+		if ((type == DIAGRAM_LINE_ERROR) || (type == DIAGRAM_LINE_MERGED)) printf("%s\n", message);
+		if (type != DIAGRAM_LINE_POINT) continue;
+		// Store the point
+		if (diagram->count == capacity)
+		{
+			capacity = capacity ? (capacity * 2) : 64;
+			DiagramPoint_t* points = (DiagramPoint_t*)realloc(diagram->points, capacity * sizeof(DiagramPoint_t));
+			if (points == nullptr)
+			{
+				printf("Diagram: not enough memory for %lu points\n", capacity);
+				valid = false;
+				break;
+			}
+			diagram->points = points;
+		}
+		diagram->points[diagram->count++] = point;
+	}
+	fclose(diagram_FILE);
+	if (valid && (diagram->count == 0))
+	{
+		printf("Diagram: file %s has no points\n", fileName);
+		valid = false;
+	}
+	if (!valid)
+	{
+		FreeDiagram(diagram);
+		return false;
+	}
+	printf("Diagram: %lu points (%lu merged), %gs\n", diagram->count, parser.merged,
+		diagram->points[diagram->count - 1].time);
+	return true;
+}
+
+/**
+ * @brief Estimate bus transactions of diagram: VFD::ChangeFrequency() writes
+ * ramp time and frequency (or run command), direction change is two changes
+ * through zero frequency. Motor starts from 0 Hz
+ *
+ * @param diagram[in]		- diagram points
+ * @param keep[in]			- points to count (nullptr - all points)
+ * @return unsigned long	- number of write transactions
+ */
+static unsigned long DiagramTransactions(const Diagram_t* diagram, const bool* keep)
+{
+	unsigned long transactions = 0;
+	double prevFreq = 0;
+	for (unsigned long i = 0; i < diagram->count; i++)
+	{
+		if ((keep != nullptr) && !keep[i]) continue;
+		double freq = diagram->points[i].frequency;
+		if ((prevFreq * freq) < 0) transactions += 4;
+		else if (fabs(freq - prevFreq) >= 0.1) transactions += 2;
+		prevFreq = freq;
+	}
+	return transactions;
+}
+
+bool SimplifyDiagram(Diagram_t* diagram, double tolerance)
+{
+	if (diagram->count < 3) return true;
+	const DiagramPoint_t* points = diagram->points;
+	bool* keep = (bool*)malloc(diagram->count * sizeof(bool));
+	// Ranges which are not checked yet (no recursion, diagram may be long)
+	unsigned long* ranges = (unsigned long*)malloc(2 * diagram->count * sizeof(unsigned long));
+	if ((keep == nullptr) || (ranges == nullptr))
+	{
+		printf("Diagram: not enough memory for simplification\n");
+		free(keep);
+		free(ranges);
+		return false;
+	}
+	memset(keep, 0, diagram->count * sizeof(bool));
+	keep[0] = true;
+	keep[diagram->count - 1] = true;
+	double maxDeviation = 0;	// the worst deviation of dropped points
+	unsigned long nRanges = 0;
+	ranges[nRanges++] = 0;
+	ranges[nRanges++] = diagram->count - 1;
+	while (nRanges > 0)
+	{
+		unsigned long last = ranges[--nRanges];
+		unsigned long first = ranges[--nRanges];
+		// Find the point which is the farthest from the ramp between range ends
+		double slope = (points[last].frequency - points[first].frequency) /
+			(points[last].time - points[first].time);
+		double farthest = 0;
+		unsigned long farthestIndex = first;
+		for (unsigned long i = first + 1; i < last; i++)
+		{
+			double ramp = points[first].frequency + slope * (points[i].time - points[first].time);
+			double deviation = fabs(points[i].frequency - ramp);
+			if (deviation > farthest)
+			{
+				farthest = deviation;
+				farthestIndex = i;
+			}
+		}
+		if (farthest <= tolerance)
+		{
+			// Ramp covers the whole range
+			if (farthest > maxDeviation) maxDeviation = farthest;
+			continue;
+		}
+		keep[farthestIndex] = true;
+		ranges[nRanges++] = first;
+		ranges[nRanges++] = farthestIndex;
+		ranges[nRanges++] = farthestIndex;
+		ranges[nRanges++] = last;
+	}
+	free(ranges);
+	unsigned long transactions = DiagramTransactions(diagram, nullptr);
+	unsigned long keptTransactions = DiagramTransactions(diagram, keep);
+	unsigned long kept = 0;
+	for (unsigned long i = 0; i < diagram->count; i++)
+		if (keep[i]) diagram->points[kept++] = diagram->points[i];
+	printf("Diagram: tolerance %gHz, %lu of %lu points kept, bus writes %lu -> %lu (%lu saved), max deviation %.2fHz\n",
+		tolerance, kept, diagram->count, transactions, keptTransactions,
+		transactions - keptTransactions, maxDeviation);
+	diagram->count = kept;
+	free(keep);
+	return true;
+}
+
+void FreeDiagram(Diagram_t* diagram)
+{
+	free(diagram->points);
+	diagram->points = nullptr;
+	diagram->count = 0;
+}
+
+bool CompileDiagram(const char* textFileName, const char* binaryFileName, double maxFrequency,
+	double tolerance /* = 0 */)
+{
+	Diagram_t diagram;
+	if (!LoadDiagram(textFileName, maxFrequency, &diagram)) return false;
+	if ((tolerance > 0) && !SimplifyDiagram(&diagram, tolerance))
+	{
+		FreeDiagram(&diagram);
+		return false;
+	}
+	if (diagram.points[diagram.count - 1].time >= 4e6)
+	{
+		printf("Diagram: %gs is too long for binary diagram\n", diagram.points[diagram.count - 1].time);
+		FreeDiagram(&diagram);
+		return false;
+	}
+	CompiledDiagramHeader_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, compiledDiagramMagic, sizeof(header.magic));
+	header.version = compiledDiagramVersion;
+	header.recordSize = sizeof(CompiledDiagramRecord_t);
+	header.count = diagram.count;
+	header.maxFrequency = (unsigned int)round(maxFrequency * 100.0);
+	header.duration = (unsigned int)round(diagram.points[diagram.count - 1].time * 1000.0);
+	FILE* binary_FILE;
+	int openStatus = fopen_s(&binary_FILE, binaryFileName, "wb");
+	if ((binary_FILE == nullptr) || openStatus)
+	{
+		printf("Diagram: can't create file %s\n", binaryFileName);
+		FreeDiagram(&diagram);
+		return false;
+	}
+	bool written = (fwrite(&header, sizeof(header), 1, binary_FILE) == 1);
+	for (unsigned long i = 0; written && (i < diagram.count); i++)
+	{
+		const DiagramPoint_t* point = &diagram.points[i];
+		CompiledDiagramRecord_t record;
+		memset(&record, 0, sizeof(record));
+		record.time = (unsigned int)round(point->time * 1000.0);
+		record.frequency = (int)round(point->frequency * 100.0);
+		written = (fwrite(&record, sizeof(record), 1, binary_FILE) == 1);
+	}
+	if (fclose(binary_FILE) != 0) written = false;
+	FreeDiagram(&diagram);
+	if (!written)
+	{
+		printf("Diagram: can't write file %s\n", binaryFileName);
+		return false;
+	}
+	printf("Diagram: %u points compiled into %s for 01-00 %gHz\n", header.count, binaryFileName, maxFrequency);
+	return true;
+}
+
+bool IsCompiledDiagram(const char* fileName)
+{
+	FILE* diagram_FILE;
+	int openStatus = fopen_s(&diagram_FILE, fileName, "rb");
+	if ((diagram_FILE == nullptr) || openStatus) return false;
+	char magic[sizeof(compiledDiagramMagic)];
+	bool compiled = (fread(magic, sizeof(magic), 1, diagram_FILE) == 1) &&
+		!memcmp(magic, compiledDiagramMagic, sizeof(magic));
+	fclose(diagram_FILE);
+	return compiled;
+}
+
+/**
+ * @brief Check header of mapped binary diagram
+ *
+ * @param diagram[in]		- mapped diagram
+ * @param maxFrequency[in]	- 01-00 of VFD in Hz
+ * @return true				- if records can be used
+ * @return false			- if file is damaged or is compiled for other 01-00 (printed)
+ */
+static bool CheckCompiledDiagram(const CompiledDiagram_t* diagram, double maxFrequency)
+{
+	const CompiledDiagramHeader_t* header = diagram->header;
+	if ((diagram->size < sizeof(CompiledDiagramHeader_t)) ||
+		memcmp(header->magic, compiledDiagramMagic, sizeof(header->magic)))
+	{
+		printf("Diagram: file is not a binary diagram\n");
+		return false;
+	}
+	if ((header->version != compiledDiagramVersion) || (header->recordSize != sizeof(CompiledDiagramRecord_t)))
+	{
+		printf("Diagram: binary diagram version %u is not supported, compile it again\n", header->version);
+		return false;
+	}
+	if ((header->count == 0) ||
+		(diagram->size != sizeof(CompiledDiagramHeader_t) + (size_t)header->count * sizeof(CompiledDiagramRecord_t)))
+	{
+		printf("Diagram: binary diagram is damaged (%u points in %zu bytes)\n", header->count, diagram->size);
+		return false;
+	}
+	if (header->maxFrequency != (unsigned int)round(maxFrequency * 100.0))
+	{
+		printf("Diagram: binary diagram is compiled for 01-00 %gHz, VFD has %gHz, compile it again\n",
+			header->maxFrequency / 100.0, maxFrequency);
+		return false;
+	}
+	return true;
+}
+
+#ifdef _WIN32
+bool MapDiagram(const char* fileName, double maxFrequency, CompiledDiagram_t* diagram)
+{
+	memset(diagram, 0, sizeof(*diagram));
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("Diagram: can't open file %s\n", fileName);
+		return false;
+	}
+	diagram->file = file;
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &size) && (size.QuadPart > 0))
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL)
+	{
+		diagram->mapping = mapping;
+		diagram->header = (const CompiledDiagramHeader_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	if (diagram->header == nullptr)
+	{
+		printf("Diagram: can't map file %s (error %lu)\n", fileName, GetLastError());
+		UnmapDiagram(diagram);
+		return false;
+	}
+	diagram->size = (size_t)size.QuadPart;
+	diagram->records = (const CompiledDiagramRecord_t*)(diagram->header + 1);
+	if (!CheckCompiledDiagram(diagram, maxFrequency))
+	{
+		UnmapDiagram(diagram);
+		return false;
+	}
+	return true;
+}
+
+void UnmapDiagram(CompiledDiagram_t* diagram)
+{
+	if (diagram->header != nullptr) UnmapViewOfFile(diagram->header);
+	if (diagram->mapping != nullptr) CloseHandle((HANDLE)diagram->mapping);
+	if (diagram->file != nullptr) CloseHandle((HANDLE)diagram->file);
+	memset(diagram, 0, sizeof(*diagram));
+}
+#else
+bool MapDiagram(const char* fileName, double maxFrequency, CompiledDiagram_t* diagram)
+{
+	memset(diagram, 0, sizeof(*diagram));
+	int fd = open(fileName, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("Diagram: can't open file %s (%s)\n", fileName, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	void* mapping = MAP_FAILED;
+	if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+		mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int mapError = errno;
+	close(fd); // mapping stays valid without the file descriptor
+	if (mapping == MAP_FAILED)
+	{
+		printf("Diagram: can't map file %s (%s)\n", fileName, strerror(mapError));
+		return false;
+	}
+	diagram->header = (const CompiledDiagramHeader_t*)mapping;
+	diagram->records = (const CompiledDiagramRecord_t*)(diagram->header + 1);
+	diagram->size = (size_t)st.st_size;
+	if (!CheckCompiledDiagram(diagram, maxFrequency))
+	{
+		UnmapDiagram(diagram);
+		return false;
+	}
+	return true;
+}
+
+void UnmapDiagram(CompiledDiagram_t* diagram)
+{
+	if (diagram->header != nullptr) munmap((void*)diagram->header, diagram->size);
+	memset(diagram, 0, sizeof(*diagram));
+}
+#endif // _WIN32
+
+DiagramStream::DiagramStream() :
+	file(nullptr),
+	queue(nullptr),
+	capacity(0),
+	head(0),
+	tail(0),
+	state(DIAGRAM_STREAM_POINT),
+	stop(false),
+	merged(0),
+	mergedPrinted(0),
+	underruns(0),
+	starved(false)
+{
+	error[0] = 0;
+}
+
+DiagramStream::~DiagramStream()
+{
+	stop = true;
+	if (reader.joinable()) reader.join();
+	if (file != nullptr) fclose(file);
+	free(queue);
+}
+
+bool DiagramStream::Open(const char* fileName, double maxFrequency, double lookahead)
+{
+	int openStatus = fopen_s(&file, fileName, "r");
+	if ((file == nullptr) || openStatus)
+	{
+		printf("Diagram: can't open file %s\n", fileName);
+		file = nullptr;
+		return false;
+	}
+	// Points in diagram are at least minSegmentTime apart
+	capacity = (unsigned long)ceil(lookahead / minSegmentTime) + 1;
+	queue = (DiagramPoint_t*)malloc(capacity * sizeof(DiagramPoint_t));
+	if (queue == nullptr)
+	{
+		printf("Diagram: not enough memory for %lu points\n", capacity);
+		return false;
+	}
+	InitDiagramParser(&parser, maxFrequency);
+	reader = std::thread(&DiagramStream::Read, this);
+	// Wait until the first part of diagram is ready
+	while ((state.load(std::memory_order_acquire) == DIAGRAM_STREAM_POINT) &&
+		((head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed)) < capacity))
+		std::this_thread::sleep_for(std::chrono::milliseconds(readerWaitMs));
+	PrintMerged();
+	// Error in the first part of diagram is found before the motor starts
+	if (state.load(std::memory_order_acquire) == DIAGRAM_STREAM_ERROR)
+	{
+		printf("%s\n", error);
+		return false;
+	}
+	if ((state.load(std::memory_order_acquire) == DIAGRAM_STREAM_END) && (head.load() == 0))
+	{
+		printf("Diagram: file %s has no points\n", fileName);
+		return false;
+	}
+#ifndef NDEBUG
+	printf("DiagramStream::Open() Queue of %lu points (%gs) holds %lu points\n",
+		capacity, lookahead, head.load());
+#endif // NDEBUG
+	return true;
+}
+
+void DiagramStream::Read()
+{
+	char line[256];
+	char message[sizeof(error)];
+	while (fgets(line, sizeof(line), file) != nullptr)
+	{
+		DiagramPoint_t point;
+		DiagramLine_t type = ParseDiagramLine(&parser, line, &point, message, sizeof(message));
+		if (type == DIAGRAM_LINE_MERGED)
+		{
+			// Message is written before the count is published, motor thread reads it after
+			unsigned long m = merged.load(std::memory_order_relaxed);
+			if (m < streamMergedMessages) memcpy(mergedMessages[m], message, sizeof(message));
+			merged.store(m + 1, std::memory_order_release);
+			continue;
+		}
+		if (type == DIAGRAM_LINE_ERROR)
+		{
+			memcpy(error, message, sizeof(error));
+			// Points before the error are played, then the motor thread sees the error
+			state.store(DIAGRAM_STREAM_ERROR, std::memory_order_release);
+			return;
+		}
+		if (type != DIAGRAM_LINE_POINT) continue;
+		// Wait for a free place in queue
+		unsigned long h = head.load(std::memory_order_relaxed);
+		while ((h - tail.load(std::memory_order_acquire)) >= capacity)
+		{
+			if (stop.load(std::memory_order_relaxed)) return;
+			std::this_thread::sleep_for(std::chrono::milliseconds(readerWaitMs));
+		}
+		queue[h % capacity] = point;
+		head.store(h + 1, std::memory_order_release);
+		if (stop.load(std::memory_order_relaxed)) return;
+	}
+	state.store(DIAGRAM_STREAM_END, std::memory_order_release);
+}
+
+DiagramStreamRead_t DiagramStream::Take(DiagramPoint_t* point)
+{
+	// State is read before the queue: points put before END or ERROR are seen
+	unsigned char s = state.load(std::memory_order_acquire);
+	unsigned long t = tail.load(std::memory_order_relaxed);
+	if (head.load(std::memory_order_acquire) == t)
+	{
+		if (s == DIAGRAM_STREAM_POINT)
+		{
+			// Polls of the same late point are one underrun
+			if (!starved) underruns++;
+			starved = true;
+			return DIAGRAM_STREAM_UNDERRUN;
+		}
+		return (DiagramStreamRead_t)s;
+	}
+	*point = queue[t % capacity];
+	starved = false;
+	tail.store(t + 1, std::memory_order_release);
+	return DIAGRAM_STREAM_POINT;
+}
+
+bool DiagramStream::Ready()
+{
+	return (state.load(std::memory_order_acquire) != DIAGRAM_STREAM_POINT) ||
+		(head.load(std::memory_order_acquire) != tail.load(std::memory_order_relaxed));
+}
+
+const char* DiagramStream::Error()
+{
+	if (state.load(std::memory_order_acquire) != DIAGRAM_STREAM_ERROR) return "";
+	return error;
+}
+
+unsigned long DiagramStream::Underruns()
+{
+	return underruns;
+}
+
+unsigned long DiagramStream::Taken()
+{
+	return tail.load(std::memory_order_relaxed);
+}
+
+unsigned long DiagramStream::Merged()
+{
+	return merged.load(std::memory_order_relaxed);
+}
+
+void DiagramStream::PrintMerged()
+{
+	unsigned long m = merged.load(std::memory_order_acquire);
+	for (; (mergedPrinted < m) && (mergedPrinted < streamMergedMessages); mergedPrinted++)
+		printf("%s\n", mergedMessages[mergedPrinted]);
+	if (mergedPrinted < m)
+	{
+		printf("Diagram: %lu more points merged\n", m - mergedPrinted);
+		mergedPrinted = m;
+	}
+}
+
+unsigned long DiagramStream::Capacity()
+{
+	return capacity;
+}
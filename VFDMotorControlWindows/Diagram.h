@@ -0,0 +1,317 @@
+/**
+ * @file Diagram.h
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Motor diagram (table of times and frequencies) reading.
+ * Diagram is either loaded into memory and checked before the motor starts
+ * (LoadDiagram()) or read by a separate thread a few seconds ahead of the
+ * motor (DiagramStream) when the file is too long to be held in memory.
+ * Diagram compiled into binary file (CompileDiagram()) is mapped into memory
+ * and executed without parsing (MapDiagram()).
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#ifndef DIAGRAM_H
+#define DIAGRAM_H
+
+#include <cstddef>	// for 'size_t'
+#include <cstdio>	// for 'FILE'
+#include <atomic>	// for lock-free queue of DiagramStream
+#include <thread>	// for reader thread of DiagramStream
+
+// Segments shorter than this would update frequency too fast (seconds)
+const double minSegmentTime = 0.25;
+
+// Point of motor diagram
+typedef struct {
+	double	time;		// time from the diagram start in seconds
+	double	frequency;	// frequency to reach at this time in Hz (negative - reverse)
+} DiagramPoint_t;
+
+// Motor diagram loaded into memory
+typedef struct {
+	DiagramPoint_t*	points;	// points in order of time
+	unsigned long	count;	// number of points
+} Diagram_t;
+
+// State of diagram file parsing
+typedef struct {
+	double			maxFrequency;	// maximal output frequency of VFD (01-00) in Hz
+	unsigned long	lineNumber;		// number of the last parsed line
+	unsigned long	pointLine;		// line of the last point in file
+	double			pointTime;		// time of the last point in file (negative - no points)
+	unsigned long	keptLine;		// line of the last point in diagram (0 - diagram start)
+	double			keptTime;		// time of the last point in diagram
+	unsigned long	merged;			// number of merged points
+} DiagramParser_t;
+
+// Result of one diagram line parsing
+enum DiagramLine_t : unsigned char
+{
+	DIAGRAM_LINE_EMPTY = 0,	// empty line, header or start point (nothing to do)
+	DIAGRAM_LINE_POINT,		// new point of diagram
+	DIAGRAM_LINE_MERGED,	// point is too close to the previous one and is merged into the next one
+	DIAGRAM_LINE_ERROR		// line is not correct
+};
+
+/**
+ * @brief Prepare parser for the first line of file
+ *
+ * @param parser[out]		- parser state
+ * @param maxFrequency[in]	- maximal output frequency of VFD (01-00) in Hz
+ */
+void InitDiagramParser(DiagramParser_t* parser, double maxFrequency);
+
+/**
+ * @brief Parse and check the next line of diagram file:
+ * lines are pairs of time and frequency (text before the first point is a header),
+ * time goes only forward, frequency is in range of VFD. Points less than 0.25 s
+ * after the previous one are merged into the next one.
+ *
+ * @param parser[in,out]	- parser state
+ * @param line[in]			- text line
+ * @param point[out]		- new point (DIAGRAM_LINE_POINT)
+ * @param message[out]		- what is wrong or what was merged (DIAGRAM_LINE_ERROR, DIAGRAM_LINE_MERGED)
+ * @param size[in]			- size of message buffer
+ * @return DiagramLine_t	- what the line is
+ */
+DiagramLine_t ParseDiagramLine(DiagramParser_t* parser, const char* line,
+	DiagramPoint_t* point, char* message, size_t size);
+
+/**
+ * @brief Read the whole diagram file into memory and check it (see ParseDiagramLine())
+ *
+ * @param fileName[in]		- file with diagram
+ * @param maxFrequency[in]	- maximal output frequency of VFD (01-00) in Hz
+ * @param diagram[out]		- loaded diagram (free it with FreeDiagram())
+ * @return true				- if diagram is loaded
+ * @return false			- if file can't be read or has errors (all of them are printed)
+ */
+bool LoadDiagram(const char* fileName, double maxFrequency, Diagram_t* diagram);
+
+/**
+ * @brief Drop points which a straight ramp between the kept points already
+ * follows within the tolerance (Douglas-Peucker on frequency deviation).
+ * The first and the last points are always kept, segments only become longer.
+ * Prints kept points, estimated bus transactions saved and the worst deviation
+ *
+ * @param diagram[in,out]	- loaded diagram
+ * @param tolerance[in]		- allowed frequency deviation in Hz
+ * @return true				- if diagram is simplified
+ * @return false			- if there is not enough memory (diagram remains the same)
+ */
+bool SimplifyDiagram(Diagram_t* diagram, double tolerance);
+
+/**
+ * @brief Free memory of loaded diagram
+ *
+ * @param diagram[in]	- diagram loaded by LoadDiagram()
+ */
+void FreeDiagram(Diagram_t* diagram);
+
+// Binary diagram file: CompiledDiagramHeader_t and then 'count' of
+// CompiledDiagramRecord_t (little-endian, records are 4 byte aligned)
+const char compiledDiagramMagic[4] = { 'V', 'F', 'D', 'D' };
+const unsigned short compiledDiagramVersion = 2;	// 1 - records had register values which were not used
+
+// Header of binary diagram file
+typedef struct {
+	char			magic[4];		// compiledDiagramMagic
+	unsigned short	version;		// compiledDiagramVersion
+	unsigned short	recordSize;		// size of one record in bytes
+	unsigned int	count;			// number of records
+	unsigned int	maxFrequency;	// 01-00 the diagram is compiled for in 0.01 Hz
+	unsigned int	duration;		// time of the last point in ms
+	unsigned int	reserved;		// zero
+} CompiledDiagramHeader_t;
+
+// Point of binary diagram (checked against range of 01-00 from the header).
+// Register writes are planned at run time from the drive state
+// (see VFD::PlanTransition()), so they are not stored
+typedef struct {
+	unsigned int	time;		// time from the diagram start in ms
+	int				frequency;	// frequency in 0.01 Hz (negative - reverse)
+} CompiledDiagramRecord_t;
+
+static_assert(sizeof(CompiledDiagramHeader_t) == 24, "Binary diagram header layout");
+static_assert(sizeof(CompiledDiagramRecord_t) == 8, "Binary diagram record layout");
+
+// Binary diagram mapped into memory
+typedef struct {
+	const CompiledDiagramHeader_t*	header;		// start of mapping
+	const CompiledDiagramRecord_t*	records;	// records after the header
+	size_t							size;		// size of mapping in bytes
+	void*							file;		// file handle (Windows)
+	void*							mapping;	// file mapping handle (Windows)
+} CompiledDiagram_t;
+
+/**
+ * @brief Check and convert text diagram into binary file
+ *
+ * @param textFileName[in]		- file with diagram (see LoadDiagram())
+ * @param binaryFileName[in]	- binary file to write
+ * @param maxFrequency[in]		- 01-00 of VFD which will run the diagram in Hz
+ * @param tolerance[in]			- frequency tolerance of SimplifyDiagram() in Hz (0 - all points are kept)
+ * @return true					- if binary file is written
+ * @return false				- if text file has errors or binary file can't be written (printed)
+ */
+bool CompileDiagram(const char* textFileName, const char* binaryFileName, double maxFrequency,
+	double tolerance = 0);
+
+/**
+ * @brief Check whether the file is a binary diagram (by its first bytes)
+ *
+ * @param fileName[in]	- diagram file
+ * @return true			- if file is a binary diagram
+ * @return false		- if file is a text diagram or can't be read
+ */
+bool IsCompiledDiagram(const char* fileName);
+
+/**
+ * @brief Map binary diagram into memory (read only, page cache is shared between runs).
+ * Only the header is checked, records are used as they are
+ *
+ * @param fileName[in]		- binary diagram file
+ * @param maxFrequency[in]	- 01-00 of VFD in Hz (must be the one diagram is compiled for)
+ * @param diagram[out]		- mapped diagram (unmap it with UnmapDiagram())
+ * @return true				- if diagram is mapped
+ * @return false			- if file can't be mapped or doesn't fit this VFD (printed)
+ */
+bool MapDiagram(const char* fileName, double maxFrequency, CompiledDiagram_t* diagram);
+
+/**
+ * @brief Unmap binary diagram
+ *
+ * @param diagram[in]	- diagram mapped by MapDiagram()
+ */
+void UnmapDiagram(CompiledDiagram_t* diagram);
+
+// Result of taking the next point from DiagramStream
+enum DiagramStreamRead_t : unsigned char
+{
+	DIAGRAM_STREAM_POINT = 0,	// point is taken
+	DIAGRAM_STREAM_END,			// all points of file are taken
+	DIAGRAM_STREAM_UNDERRUN,	// reader is behind, point is not ready yet
+	DIAGRAM_STREAM_ERROR		// file has error here (see Error())
+};
+
+// DiagramStream keeps messages of this many merged points, the rest are counted
+const unsigned long streamMergedMessages = 16;
+
+/**
+ * @brief Diagram file which is read while the motor runs.
+ * Reader thread parses the file into a bounded single producer single consumer
+ * queue and waits while the queue is full, so memory does not depend on the
+ * file length. Taking a point never blocks and never touches the file.
+ *
+ */
+class DiagramStream
+{
+private:
+	FILE*				file;		// diagram file
+	DiagramParser_t		parser;		// parser state (used by reader thread only)
+	DiagramPoint_t*		queue;		// ring buffer of parsed points
+	unsigned long		capacity;	// number of points in queue
+	std::atomic<unsigned long> head;	// number of points put into queue (reader thread)
+	std::atomic<unsigned long> tail;	// number of points taken from queue (motor thread)
+	std::atomic<unsigned char> state;	// DIAGRAM_STREAM_POINT while reading, then END or ERROR
+	std::atomic<bool>	stop;		// reader thread has to finish
+	std::atomic<unsigned long> merged;	// number of merged points read so far
+	unsigned long		mergedPrinted;	// number of merged points reported by PrintMerged()
+	char				mergedMessages[streamMergedMessages][160];	// messages of the first merged points
+	char				error[160];	// error message (valid in DIAGRAM_STREAM_ERROR state)
+	unsigned long		underruns;	// number of points which were not ready when they were needed
+	bool				starved;	// the last Take() found the queue empty
+	std::thread			reader;		// reader thread
+
+	/**
+	 * @brief Reader thread: parse file into queue until its end, error or stop
+	 *
+	 */
+	void Read();
+public:
+	DiagramStream();
+
+	/**
+	 * @brief Destroy the DiagramStream object (stops reader thread, closes file)
+	 *
+	 */
+	~DiagramStream();
+
+	/**
+	 * @brief Open diagram file and start reading it. Returns when the queue is
+	 * full or the whole file is read, so the first part of diagram is checked
+	 * before the motor starts
+	 *
+	 * @param fileName[in]		- file with diagram
+	 * @param maxFrequency[in]	- maximal output frequency of VFD (01-00) in Hz
+	 * @param lookahead[in]		- queue size in seconds of diagram
+	 * @return true				- if reading started
+	 * @return false			- if file can't be opened or its first part has errors (printed)
+	 */
+	bool Open(const char* fileName, double maxFrequency, double lookahead);
+
+	/**
+	 * @brief Take the next point (never blocks)
+	 *
+	 * @param point[out]			- the next point (DIAGRAM_STREAM_POINT)
+	 * @return DiagramStreamRead_t	- point, end of diagram, underrun or error
+	 */
+	DiagramStreamRead_t Take(DiagramPoint_t* point);
+
+	/**
+	 * @brief Check whether Take() will not underrun (never blocks)
+	 *
+	 * @return true		- if the next point is read or the stream has ended
+	 * @return false	- if reader is behind
+	 */
+	bool Ready();
+
+	/**
+	 * @brief Get the error message of file
+	 *
+	 * @return const char*	- error message (empty if there is no error)
+	 */
+	const char* Error();
+
+	/**
+	 * @brief Get number of points which were not ready when they were needed
+	 *
+	 * @return unsigned long	- number of underruns
+	 */
+	unsigned long Underruns();
+
+	/**
+	 * @brief Get number of points taken from queue
+	 *
+	 * @return unsigned long	- number of points
+	 */
+	unsigned long Taken();
+
+	/**
+	 * @brief Get number of merged points read so far
+	 *
+	 * @return unsigned long	- number of merged points
+	 */
+	unsigned long Merged();
+
+	/**
+	 * @brief Print messages of merged points read since the last call, as LoadDiagram()
+	 * does. Points beyond the kept messages are printed as a count. Open() reports
+	 * the first part of diagram, call it again after the run for the rest
+	 *
+	 */
+	void PrintMerged();
+
+	/**
+	 * @brief Get queue size
+	 *
+	 * @return unsigned long	- number of points queue holds
+	 */
+	unsigned long Capacity();
+};
+
+#endif // DIAGRAM_H
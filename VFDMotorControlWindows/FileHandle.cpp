@@ -11,22 +11,149 @@
  */
 
 #include "main.h"
+#include <cmath>	// for tracking error
 
- /**
-  * @brief Get the Next Time and Frequency pair from file with diagram coordinates
-  *
-  * @param diagramFile[in]	- pointer to FILE handle with diagram
-  * @param curTime[in]		- current time
-  * @param curFreq[in]		- current frequency
-  * @param nextTime[out]	- pointer to variable when the next time will be stored
-  * @param nextFreq[out]	- pointer to variable when the next frequency will be stored
-  * @return true			- if new coordinates have read
-  * @return false			- if no new coordinates (end of file reached)
-  */
-bool GetNextTimeAndFrequency(FILE* diagramFile,
+// Diagram point is polled with this period while stream reader is behind (seconds)
+const double underrunRetryTime = 0.01;
+// Time interval between read parameters (seconds)
+const double readInterval = 0.1;
+// Acceleration and deceleration time of setpoint streaming (seconds)
+const double setpointRampTime = 0.5;
+// Part of bus time which is left by reads that setpoints may take
+const double setpointBusShare = 0.8;
+// Part of bus time which is taken as left by reads when the measured read is longer
+const double setpointMinBusLeft = 0.1;
+// Part of measured lag added to setpoint trim at every read (--trim with --setpoints)
+const double trimGain = 0.5;
+// Lag which is not corrected by ramp time (Hz)
+const double trimDeadband = 0.1;
+// Ramps ending sooner than this are not corrected (seconds)
+const double trimMinTime = 0.2;
+
+// Duration of stream diagram which real-time parameter log is allocated for (seconds)
+const double realTimeLogTime = 3600;
+// Samples which real-time parameter log holds above the diagram duration
+const unsigned long realTimeLogMargin = 64;
+
+// Parameters of one read stored by ParameterLog
+typedef struct {
+	double			time;			// time of measure in seconds
+	VFD_param_t		param;			// motorParams
+	double			power;			// OutPower
+	double			temperature;	// VFDtemperature
+	unsigned short	reg;			// getReg_v
+} ParameterSample_t;
+
+/**
+ * @brief Output of parameters measured by diagram loop. In real-time mode
+ * samples are stored into memory allocated before the loop and are printed
+ * (and written into file) after the loop, so the loop does no file output
+ *
+ */
+class ParameterLog
+{
+private:
+	ParameterSample_t*	samples;	// stored samples (nullptr - samples are printed at once)
+	unsigned long		capacity;	// number of samples the memory holds
+	unsigned long		count;		// number of stored samples
+	unsigned long		lost;		// samples which didn't fit into memory
+public:
+	ParameterLog();
+
+	/**
+	 * @brief Print stored samples (see Flush()) and free memory
+	 *
+	 */
+	~ParameterLog();
+
+	/**
+	 * @brief Allocate memory, so samples are stored instead of printing
+	 *
+	 * @param capacity[in]	- number of samples
+	 * @return true			- if memory is allocated
+	 * @return false		- if there is not enough memory
+	 */
+	bool Allocate(unsigned long capacity);
+
+	/**
+	 * @brief Print measured parameters (see OutParameters()) or store them
+	 *
+	 * @param time[in]	- time when parameters measured
+	 */
+	void Out(double time);
+
+	/**
+	 * @brief Print stored samples and write the last one into file
+	 *
+	 */
+	void Flush();
+};
+
+// Deviation of measured frequency from diagram
+typedef struct {
+	unsigned long	count;		// number of measurements
+	double			sumSquares;	// sum of squared deviations in Hz^2
+	double			max;		// maximal deviation in Hz
+} TrackingStats_t;
+
+// Position of diagram loop in the diagram
+typedef struct {
+	const Diagram_t*	diagram;	// loaded diagram
+	const CompiledDiagram_t* compiled;	// binary diagram mapped into memory
+	DiagramStream*		stream;		// diagram which is read while the motor runs
+	unsigned long		index;		// number of points taken from the diagram
+	DiagramPoint_t		point;		// the last taken point
+	bool				pending;	// the last taken point is not given yet
+	bool				dirChange;	// zero frequency point is given before the pending point
+	bool				started;	// a point of the diagram is given (crossings are not its points)
+	DiagramPoint_t		given;		// the last given point of the diagram
+	double				stalled;	// time the diagram has waited for stream reader in seconds
+} DiagramCursor_t;
+
+/**
+ * @brief Follow the diagram which is loaded or opened as a stream
+ *
+ * @param motor[in]			- reference to VFD class instance
+ * @param cursor[in,out]	- diagram and position in it
+ * @return true				- if motor have run according to the diagram
+ * @return false			- if some error occured
+ */
+template <class Transport>
+bool RunDiagram(VFD<Transport>& motor, DiagramCursor_t* cursor);
+
+/**
+ * @brief Get the Next Time and Frequency pair from the diagram.
+ * When direction changes, the point of zero frequency is given first. It is
+ * interpolated between the diagram points, so deceleration to zero and
+ * acceleration from zero have the rates of the diagram segment and the
+ * direction changes at the crossing time
+ *
+ * @param cursor[in,out]		- diagram and position in it
+ * @param curTime[in]			- current time (segment start before the first point of diagram)
+ * @param curFreq[in]			- current frequency (segment start before the first point of diagram)
+ * @param nextTime[out]			- pointer to variable when the next time will be stored
+ * @param nextFreq[out]			- pointer to variable when the next frequency will be stored
+ * @return DiagramStreamRead_t	- DIAGRAM_STREAM_POINT if there is the next point,
+ * DIAGRAM_STREAM_END at the end of diagram, DIAGRAM_STREAM_UNDERRUN if stream
+ * reader is behind, DIAGRAM_STREAM_ERROR if stream has found an error in file
+ */
+DiagramStreamRead_t GetNextTimeAndFrequency(DiagramCursor_t* cursor,
 	double curTime, double curFreq,
 	double* nextTime, double* nextFreq);
 
+/**
+ * @brief Get diagram frequency at the time by linear interpolation in the segment
+ * (the segment ends are taken outside of it)
+ *
+ * @param timeCur[in]	- segment start time
+ * @param freqCur[in]	- segment start frequency
+ * @param timeNext[in]	- segment end time
+ * @param freqNext[in]	- segment end frequency
+ * @param time[in]		- time from the diagram start
+ * @return double		- frequency in Hz
+ */
+double DiagramFrequency(double timeCur, double freqCur, double timeNext, double freqNext, double time);
+
 /**
  * @brief Prints measured parameters into screen and into file
  *
@@ -34,155 +161,515 @@ bool GetNextTimeAndFrequency(FILE* diagramFile,
  */
 void OutParameters(double time);
 
-bool RunDiagramFromFile(VFD& motor)
+template <class Transport>
+bool RunDiagramFromFile(VFD<Transport>& motor)
 {
 	// 1) Update max frequency parameter from VFD (and check connection by doing this)
-	if (!motor.ReadMaxFrequency())
+	double maxFrequency;
+	ModbusResult result = motor.ReadMaxFrequency(&maxFrequency);
+	if (!result)
 	{
-		assert(("main::RunDiagramFromFile(): Read max frequency error", 0));
+		printf("main::RunDiagramFromFile(): Read max frequency error: %s\n", result.Describe());
 		return false;
 	}
-	// 2) Open file with required diagram and check open error
-	FILE* diagram_FILE;
-	int openStatus = fopen_s(&diagram_FILE, diagramFileName, "r");
-#ifndef NDEBUG
-	printf("main::RunDiagramFromFile() File %p opened\n", diagram_FILE);
-#endif // NDEBUG
-	if ((diagram_FILE == nullptr) || openStatus)
+	DiagramCursor_t cursor;
+	memset(&cursor, 0, sizeof(cursor));
+	// 2) Binary diagram is checked by compiler, it is executed right from the mapping
+	if (IsCompiledDiagram(diagramFileName))
+	{
+		if (diagramTolerance > 0) printf("Warning: binary diagram is run as it is compiled, use --tolerance with --compile\n");
+		CompiledDiagram_t compiled;
+		if (!MapDiagram(diagramFileName, maxFrequency, &compiled)) return false;
+		printf("Diagram: %u points (compiled), %gs\n", compiled.header->count, compiled.header->duration / 1000.0);
+		cursor.compiled = &compiled;
+		bool success = RunDiagram(motor, &cursor);
+		UnmapDiagram(&compiled);
+		return success;
+	}
+	// 2) Diagram is read ahead of the motor by a separate thread,
+	// the reader is started before the loop enters real-time mode and keeps normal priority
+	if (streamLookahead > 0)
+	{
+		if (diagramTolerance > 0) printf("Warning: --tolerance needs the whole diagram, it is not applied to --stream\n");
+		DiagramStream stream;
+		if (!stream.Open(diagramFileName, maxFrequency, streamLookahead)) return false;
+		cursor.stream = &stream;
+		bool success = RunDiagram(motor, &cursor);
+		stream.PrintMerged();
+		printf("Diagram stream: %lu points taken (%lu merged), %lu underruns (%gs stalled), queue of %lu points\n",
+			stream.Taken(), stream.Merged(), stream.Underruns(), cursor.stalled, stream.Capacity());
+		return success;
+	}
+	// 2) Load and check the whole diagram before the motor starts
+	Diagram_t diagram;
+	if (!LoadDiagram(diagramFileName, maxFrequency, &diagram)) return false;
+	if ((diagramTolerance > 0) && !SimplifyDiagram(&diagram, diagramTolerance))
 	{
-		assert(("main::RunDiagramFromFile(): Read coords file error", 0));
+		FreeDiagram(&diagram);
 		return false;
 	}
+	cursor.diagram = &diagram;
+	bool success = RunDiagram(motor, &cursor);
+	FreeDiagram(&diagram);
+	return success;
+}
+
+template <class Transport>
+bool RunDiagram(VFD<Transport>& motor, DiagramCursor_t* cursor)
+{
+	ModbusResult result;
+	Clock&	clock = motor.GetClock();
 	// 3) Print output parameters table header to screen
 	// 3.1) Read and print initial parameters
 	PrintParametersHeader(true);
 	// 4) Update max frequency and read parameters to determine current frequency
 	// (This will allow to start motor not only from zero frequency)
+	double readDuration = clock.Now();	// bus time of one parameters read
 	if (!GetMotorParameters(motor)) return false;
+	readDuration = clock.Now() - readDuration;
 	OutParameters(0); // Out parameters at 0 time
 	// 5) Set watchdog 
-	if (!motor.SetWatchdog(1))
+	result = motor.SetWatchdog(1);
+	if (!result)
 	{
-		assert(("main::RunDiagramFromFile(): Set watchdog timer error", 0));
+		printf("main::RunDiagramFromFile(): Set watchdog timer error: %s\n", result.Describe());
 		return false;
 	}
 	// 6) Create initial variables
-	// parameters from file
-	double	fileFreqNext = 0;	// next frequency from file
-	double	fileTimeNext = 0;	// next time from file
-	double	fileFreqCur = 0;	// current frequency from file
-	double	fileTimeCur = 0;	// current time from file
-	// timers
-	double	timeStart = clock() / 1000.0;	// time of start following diagram in seconds
-	double	timeLastOperation = 0;			// last time of parameters measure
-	const double readInterval = 0.1;		// time interval between read parameters
+	// parameters from diagram
+	double	fileFreqNext = 0;	// next frequency from diagram
+	double	fileTimeNext = 0;	// next time from diagram
+	double	fileFreqCur = 0;	// current frequency from diagram
+	double	fileTimeCur = 0;	// current time from diagram
+	double	pointFreqCur = 0;	// current frequency of diagram point (fileFreqCur may be measured)
+	// look-ahead planner (--prestage, --compensate): the segment after the current one is taken
+	// from diagram right after the boundary, its ramp time is written in advance
+	// and its writes are started earlier by their round trip time
+	bool	aheadReady = false;	// the point after the next one is taken
+	double	aheadTime = 0;		// its time
+	double	aheadFreq = 0;		// its frequency
+	unsigned long prestaged = 0;	// ramp times written in advance
+	double	boundaryLead = 0;		// the next boundary writes start this time before it (seconds)
+	unsigned long predictions = 0;	// frequency changes with predicted time of effect
+	double	predictionSum = 0;		// sum of absolute errors of these predictions
+	double	predictionMax = 0;		// the worst of these errors
+	unsigned long setpoints = 0;	// frequency changes written
+	double	setpointSum = 0;		// sum of times from segment boundary to the end of setpoint write
+	double	setpointMin = 0;		// the shortest of these times
+	double	setpointMax = 0;		// the longest of these times
+	// setpoint streaming (--setpoints): ramps are fixed, frequency is interpolated
+	// from diagram and written on the setpoint grid
+	bool	streaming = (setpointRate > 0);
+	double	setpointPeriod = 0;		// time interval between setpoints
+	unsigned long setpointTick = 0;	// number of the next setpoint on the setpoint grid
+	unsigned short runDirection = 0;	// direction of the last run command (0 - unknown)
+	double	lastSetpoint = -1;		// the last written setpoint in Hz (negative - nothing written)
+	unsigned long streamed = 0;		// setpoints written
+	unsigned long unchanged = 0;	// setpoints which were not written because they remain the same
+	// run statistics of both modes
+	TrackingStats_t tracking;		// measured frequency against diagram
+	memset(&tracking, 0, sizeof(tracking));
+	double	writeBusy = 0;			// bus time of writes
+	// closed-loop trim (--trim): measured lag is corrected by ramp time or by setpoint
+	unsigned long trimmedRamps = 0;	// ramp times rewritten during their ramps
+	double	setpointTrim = 0;		// frequency added to interpolated setpoints (Hz)
+	double	setpointTrimMax = 0;	// the largest absolute setpoint trim (Hz)
+	double	readBusy = 0;			// bus time of reads
+	if (streaming)
+	{
+		// Fixed short ramps: drive follows every setpoint in a fraction of the period
+		double writeDuration = clock.Now();
+		result = motor.SetAccDecTime(setpointRampTime);
+		writeDuration = clock.Now() - writeDuration;
+		if (!result)
+		{
+			printf("main::RunDiagramFromFile(): Set ramp time error: %s\n", result.Describe());
+			return false;
+		}
+		// Setpoints may take a part of bus time which is left by reads. The first read
+		// may be retried, so reads never take more than a part of bus time here,
+		// and a write takes at least its transmission time
+		double busLeft = 1 - readDuration / readInterval;
+		if (busLeft < setpointMinBusLeft) busLeft = setpointMinBusLeft;
+		if (writeDuration < motor.WriteAirTime(1)) writeDuration = motor.WriteAirTime(1);
+		double maxRate = setpointBusShare * busLeft / writeDuration;
+		double rate = (setpointRate < maxRate) ? setpointRate : maxRate;
+		if (!(rate > 0))
+		{
+			printf("main::RunDiagramFromFile(): Setpoint rate %g is not positive, streaming is impossible\n", rate);
+			return false;
+		}
+		setpointPeriod = 1 / rate;
+		printf("Setpoint streaming: %gHz (requested %gHz, bus allows %.1fHz: write %.1fms, reads %.0f%%), ramps %gs\n",
+			rate, setpointRate, maxRate, writeDuration * 1000, readDuration / readInterval * 100, setpointRampTime);
+	}
+	// timers (clock of the port: real time or virtual time of simulator)
+	// All deadlines are absolute (from the diagram start), so late wake ups
+	// and long transfers never shift the following deadlines
+	double	timeStart = clock.Now();	// time of start following diagram in seconds
+	unsigned long readTick = 1;			// number of the next parameters read on the read grid
+	DeadlineStats_t deadlines;			// lateness of wake ups
+	memset(&deadlines, 0, sizeof(deadlines));
+	// 7) Real-time mode: everything the loop needs is allocated here,
+	// measured parameters are printed after the loop
+	ParameterLog log;
+	AllocationGuardScope guard;	// is disarmed before the log is printed at every return
+	if (realtimeCPU >= 0)
+	{
+		double duration = realTimeLogTime;
+		if (cursor->compiled != nullptr) duration = cursor->compiled->header->duration / 1000.0;
+		else if ((cursor->diagram != nullptr) && (cursor->diagram->count > 0))
+			duration = cursor->diagram->points[cursor->diagram->count - 1].time;
+		if (!log.Allocate((unsigned long)(duration / readInterval) + realTimeLogMargin))
+		{
+			printf("main::RunDiagramFromFile(): Not enough memory for parameter log\n");
+			return false;
+		}
+		EnterRealTime(realtimeCPU);
+		guard.Arm();
+		timeStart = clock.Now();
+	}
 #ifndef NDEBUG
 	printf("main::RunDiagramFromFile() Diagram started in %g\n", timeStart);
 #endif // NDEBUG
 	// Start following diagram ////////////////////////////////////////////////
 	while (true)
 	{
-		double timeNow = (clock() / 1000.0) - timeStart; // current moment time (seconds)
+		double readTime = readTick * readInterval;
+		double setpointTime = setpointTick * setpointPeriod;
+		bool boundaryDue;	// segment boundary goes first
+		bool setpointDue;	// then setpoint
+		if (streaming)
+		{
+			// Reads, setpoints and boundaries have their own grids
+			boundaryDue = (fileTimeNext <= setpointTime) && (fileTimeNext <= readTime);
+			setpointDue = !boundaryDue && (setpointTime <= readTime);
+		}
+		else
+		{
+			// Read current motor parameters every 100 ms,
+			// but only when no write operations in the next 100 ms
+			boundaryDue = !((readTime + readInterval) < (fileTimeNext - boundaryLead));
+			setpointDue = false;
+		}
+		double deadline = boundaryDue ? (fileTimeNext - boundaryLead) : (setpointDue ? setpointTime : readTime);
+		clock.SleepUntil(timeStart + deadline);
+		double timeNow = clock.Now() - timeStart; // current moment time (seconds)
+		RecordDeadline(&deadlines, timeNow - deadline);
 		// Set new motor parameters
-		if (timeNow >= fileTimeNext) // if current time is greater than assigned time from file
+		if (boundaryDue)
 		{
 #ifndef NDEBUG
 			printf("main::RunDiagramFromFile() Write new parameter in %g\n", timeNow);
 #endif // NDEBUG
-			fileTimeCur = timeNow;		// timeNow here to calculate parameters more precise
-			fileFreqCur = motorParams.OutFrequency; // update frequency
-			// Read new time and frequency parameters from file
-			if (!GetNextTimeAndFrequency(diagram_FILE, fileTimeCur, fileFreqCur, &fileTimeNext, &fileFreqNext))
+			// Planner and streaming follow planned frequencies (ramp times written
+			// in advance are computed from them), otherwise the measured one is used.
+			// Zero is always taken as planned: direction of the next segment is given
+			// at the crossing and residual frequency doesn't turn it into a reversal
+			if ((prestageRamps || compensateLatency || streaming || (fileFreqNext == 0)) && (fileTimeNext > 0))
+				fileFreqCur = fileFreqNext;
+			else fileFreqCur = motorParams.OutFrequency; // update frequency
+			pointFreqCur = fileFreqNext;
+			fileTimeCur = fileTimeNext;	// segment starts when it is planned, not when we woke up
+			// Take the next time and frequency from diagram
+			DiagramStreamRead_t next = DIAGRAM_STREAM_POINT;
+			if (aheadReady)
 			{
-				// Reached end of file
-				fclose(diagram_FILE);
+				fileTimeNext = aheadTime;
+				fileFreqNext = aheadFreq;
+				aheadReady = false;
+			}
+			else next = GetNextTimeAndFrequency(cursor, fileTimeCur, fileFreqCur, &fileTimeNext, &fileFreqNext);
+			if (next == DIAGRAM_STREAM_UNDERRUN)
+			{
+				// Point is not read yet: the last command stays in force and
+				// the diagram waits for the reader (the rest of diagram is shifted)
+				timeStart += underrunRetryTime;
+				cursor->stalled += underrunRetryTime;
+				continue;
+			}
+			if (next != DIAGRAM_STREAM_POINT)
+			{
+				// Reached end of diagram
 				// 1) Print last coordinate parameters
 				if (!GetMotorParameters(motor)) return false;
-				timeNow = (clock() / 1000.0) - timeStart; // get new fresh time
-				OutParameters(timeNow);
+				timeNow = clock.Now() - timeStart; // get new fresh time
+				log.Out(timeNow);
 
 				// 2) Stop motor at the minimal deceleration (0 deceleration time is dangerous)
-				if (!motor.SetDecelerationTime(0) || !motor.Stop())
+				result = motor.SetDecelerationTime(0);
+				if (result) result = motor.Stop();
+				if (!result)
 				{
-					assert(("main::RunDiagramFromFile(): Stop motor error", 0));
+					printf("main::RunDiagramFromFile(): Stop motor error: %s\n", result.Describe());
 					return false;
 				}
+				guard.Disarm();
+				log.Flush();
+				if (next == DIAGRAM_STREAM_ERROR)
+				{
+					printf("%s\n", cursor->stream->Error());
+					printf("main::RunDiagramFromFile(): Diagram error, motor is stopped\n");
+					return false;
+				}
+				PrintDeadlineStats(&deadlines);
+				runStats.samples = tracking.count;
+				runStats.trackingRms = (tracking.count > 0) ? sqrt(tracking.sumSquares / tracking.count) : 0;
+				runStats.trackingMax = tracking.max;
+				runStats.writeLoad = writeBusy / timeNow;
+				runStats.readLoad = readBusy / timeNow;
+				if (setpoints > 0)
+					printf("Setpoint latency: mean %.2fms, min %.2fms, max %.2fms (%lu changes, %lu ramps pre-staged)\n",
+						setpointSum * 1000 / setpoints, setpointMin * 1000, setpointMax * 1000, setpoints, prestaged);
+				if (streaming) printf("Setpoints: %lu written, %lu unchanged\n", streamed, unchanged);
+				if (tracking.count > 0)
+					printf("Tracking error: RMS %.2fHz, max %.2fHz (%lu samples)\n",
+						runStats.trackingRms, runStats.trackingMax, runStats.samples);
+				printf("Bus load: %.0f%% (writes %.0f%%, reads %.0f%%)\n", (runStats.writeLoad + runStats.readLoad) * 100,
+					runStats.writeLoad * 100, runStats.readLoad * 100);
+				if ((trimLimit > 0) && streaming)
+					printf("Tracking trim: max setpoint trim %.2fHz (limit %gHz)\n", setpointTrimMax, trimLimit);
+				else if (trimLimit > 0)
+					printf("Tracking trim: %lu ramp times corrected (limit %gHz)\n", trimmedRamps, trimLimit);
+				if (predictions > 0)
+					printf("Command lead: write round trip 0x06 %.1fms, 0x10 %.1fms, prediction error mean %.2fms, max %.2fms\n",
+						motor.WriteTime(1) * 1000, motor.WriteTime(2) * 1000,
+						predictionSum * 1000 / predictions, predictionMax * 1000);
+				if (realtimeCPU >= 0) printf("Allocations in real-time loop: %lu\n", GuardedAllocations());
+#ifndef NDEBUG
+				ModbusShadowStats_t stats = motor.GetShadowStats();
+				printf("main::RunDiagramFromFile() Shadow registers: %lu hits, %lu misses, %lu skipped writes\n",
+					stats.hits, stats.misses, stats.skips);
+#endif // NDEBUG
 				return true;
 			}
 #ifndef NDEBUG
 			printf("main::RunDiagramFromFile() Change frequency to %g in %g s\n", fileFreqNext, fileTimeNext);
 #endif // NDEBUG
+			// Setpoints of the new segment are written on their own grid
+			if (streaming) continue;
 			// Set new parameters
-			if (!motor.ChangeFrequency(fileFreqCur, fileFreqNext, fileTimeNext - fileTimeCur))
+			double delay = motor.TransitionDelay(fileFreqCur, fileFreqNext, fileTimeNext - fileTimeCur);
+			// Transient bus errors are worth one more try, rejected request is not
+			result = motor.ChangeFrequency(fileFreqCur, fileFreqNext, fileTimeNext - fileTimeCur);
+			if (!result && result.IsRetryable())
+				result = motor.ChangeFrequency(fileFreqCur, fileFreqNext, fileTimeNext - fileTimeCur);
+			if (!result)
 			{
-				assert(("main::RunDiagramFromFile(): Change frequency error", 0));
+				printf("main::RunDiagramFromFile(): Change frequency error: %s\n", result.Describe());
 				return false;
 			}
+			if (VFD<Transport>::RampParameters(fileFreqCur, fileFreqNext) != VFD_RAMP_NONE)
+			{
+				double latency = clock.Now() - timeStart - fileTimeCur;
+				if ((setpoints == 0) || (latency < setpointMin)) setpointMin = latency;
+				if (latency > setpointMax) setpointMax = latency;
+				setpointSum += latency;
+				setpoints++;
+				if (compensateLatency)
+				{
+					// New frequency command is in force when the drive answers the last write
+					double error = fabs(latency - (timeNow + delay - fileTimeCur));
+					predictionSum += error;
+					if (error > predictionMax) predictionMax = error;
+					predictions++;
+					printf("Transition at %.2fs: issued %+.1fms, predicted %+.1fms, effective %+.1fms\n",
+						fileTimeCur, (timeNow - fileTimeCur) * 1000, (timeNow + delay - fileTimeCur) * 1000,
+						latency * 1000);
+				}
+			}
+			// Ramp time of the following segment is written now, while the bus is idle,
+			// if the ramp in progress doesn't use the same parameter
+			if ((prestageRamps || compensateLatency) && ((cursor->stream == nullptr) || cursor->stream->Ready()) &&
+				(GetNextTimeAndFrequency(cursor, fileTimeNext, fileFreqNext, &aheadTime, &aheadFreq) == DIAGRAM_STREAM_POINT))
+			{
+				aheadReady = true;
+				if (prestageRamps && !(VFD<Transport>::RampParameters(fileFreqCur, fileFreqNext) &
+					VFD<Transport>::RampParameters(fileFreqNext, aheadFreq)))
+				{
+					// Failed write is not lost: the boundary writes the ramp time itself
+					if (motor.PrepareFrequencyChange(fileFreqNext, aheadFreq, aheadTime - fileTimeNext)) prestaged++;
+				}
+			}
+			// Writes of the next boundary are started earlier by their round trip time
+			// (one setpoint write when the next point is not read yet), but never
+			// before the middle of the segment
+			if (compensateLatency)
+			{
+				boundaryLead = aheadReady ?
+					motor.TransitionDelay(fileFreqNext, aheadFreq, aheadTime - fileTimeNext) : motor.WriteTime(1);
+				if (boundaryLead > (fileTimeNext - fileTimeCur) / 2) boundaryLead = (fileTimeNext - fileTimeCur) / 2;
+			}
+			// Reads which were put off for this write are not missed
+			double timeWritten = clock.Now() - timeStart;
+			writeBusy += timeWritten - timeNow;
+			timeNow = timeWritten;
+			while ((readTick * readInterval) <= timeNow) readTick++;
+		}
+		else if (setpointDue)
+		{
+			// Setpoint for the middle of its period, so the steps are centred on the diagram
+			// (and for the moment it is in force with --compensate)
+			double lead = compensateLatency ? motor.WriteTime(1) : 0;
+			double freq = DiagramFrequency(fileTimeCur, pointFreqCur, fileTimeNext, fileFreqNext,
+				setpointTime + setpointPeriod / 2 + lead);
+			// Trim never changes the direction
+			if (setpointTrim != 0) freq = ((freq + setpointTrim) * freq > 0) ? (freq + setpointTrim) : 0;
+			unsigned short direction = (freq > 0) ? 1 : ((freq < 0) ? 2 : runDirection);
+			if ((direction != runDirection) || (fabs(fabs(freq) - lastSetpoint) >= 0.005))
+			{
+				// Direction is given with the frequency when it changes
+				if (direction != runDirection) result = motor.RunWithFrequency(fabs(freq), direction);
+				else result = motor.SetFrequency(fabs(freq));
+				if (!result && !result.IsRetryable())
+				{
+					printf("main::RunDiagramFromFile(): Set frequency error: %s\n", result.Describe());
+					return false;
+				}
+				if (result)
+				{
+					runDirection = direction;
+					lastSetpoint = fabs(freq);
+					streamed++;
+				}
+				double timeWritten = clock.Now() - timeStart;
+				writeBusy += timeWritten - timeNow;
+				timeNow = timeWritten;
+			}
+			else unchanged++;
+			// Setpoints whose time has passed during this one are dropped
+			setpointTick++;
+			while ((setpointTick * setpointPeriod) <= timeNow)
+			{
+				setpointTick++;
+				deadlines.dropped++;
+			}
 		}
-		// Read current motor parameters (every 100 ms)
-		// read only when no write operations in the next 100 ms
-		if (((timeNow - timeLastOperation) > readInterval) && ((timeNow + readInterval) < fileTimeNext))
+		else
 		{
-			timeLastOperation = timeNow;
-			if (!GetMotorParameters(motor)) return false;
-			timeNow = (clock() / 1000.0) - timeStart; // get new fresh time
-			OutParameters(timeNow);
+			// Lost sample is skipped, next one is taken at its place on the read grid
+			result = GetMotorParameters(motor);
+			if (!result && !result.IsRetryable()) return false;
+			double timeRead = clock.Now() - timeStart; // get new fresh time
+			readBusy += timeRead - timeNow;
+			if (result)
+			{
+				log.Out(timeRead);
+				// Frequency is measured at the end of read, diagram is the same reference in every mode
+				double diagramFreq = DiagramFrequency(fileTimeCur, pointFreqCur, fileTimeNext, fileFreqNext, timeRead);
+				double lag = diagramFreq - motorParams.OutFrequency; // signed: reverse lag is negative
+				tracking.sumSquares += lag * lag;
+				if (fabs(lag) > tracking.max) tracking.max = fabs(lag);
+				tracking.count++;
+				if ((trimLimit > 0) && streaming)
+				{
+					// Setpoints are trimmed by integrated lag
+					setpointTrim += trimGain * lag;
+					if (setpointTrim > trimLimit) setpointTrim = trimLimit;
+					if (setpointTrim < -trimLimit) setpointTrim = -trimLimit;
+					if (fabs(setpointTrim) > setpointTrimMax) setpointTrimMax = fabs(setpointTrim);
+				}
+				else if ((trimLimit > 0) && (fabs(lag) > trimDeadband) && ((fileTimeNext - timeRead) >= trimMinTime))
+				{
+					// The rest of ramp is replanned from measured frequency (lag is taken
+					// within the limit), so the drive reaches diagram at segment end.
+					// Only ramp time is written (frequency command is in force already),
+					// ramp type and direction must remain the same
+					if (lag > trimLimit) lag = trimLimit;
+					if (lag < -trimLimit) lag = -trimLimit;
+					double freq = diagramFreq - lag;
+					unsigned char ramp = VFD<Transport>::RampParameters(fileFreqCur, fileFreqNext);
+					if (((ramp == VFD_RAMP_ACCELERATION) || (ramp == VFD_RAMP_DECELERATION)) &&
+						(VFD<Transport>::RampParameters(freq, fileFreqNext) == ramp) &&
+						((freq * fileFreqNext) > 0) && (fabs(freq) >= 0.1))
+					{
+						bool written = false; // the drive may hold this ramp time already
+						result = motor.PrepareFrequencyChange(freq, fileFreqNext, fileTimeNext - timeRead, &written);
+						if (!result && !result.IsRetryable())
+						{
+							printf("main::RunDiagramFromFile(): Trim ramp time error: %s\n", result.Describe());
+							return false;
+						}
+						if (result && written) trimmedRamps++;
+						double timeWritten = clock.Now() - timeStart;
+						writeBusy += timeWritten - timeRead;
+						timeRead = timeWritten;
+					}
+				}
+			}
+			timeNow = timeRead;
+			// Reads whose time has passed during this one are dropped
+			readTick++;
+			while ((readTick * readInterval) <= timeNow)
+			{
+				readTick++;
+				deadlines.dropped++;
+			}
 		}
-		// Small delay between iterations for stability
-		Sleep(1);
 	}
 	return true;
 }
 
-bool GetNextTimeAndFrequency(FILE* diagramFile,
+double DiagramFrequency(double timeCur, double freqCur, double timeNext, double freqNext, double time)
+{
+	if (time >= timeNext) return freqNext;
+	if (time <= timeCur) return freqCur;
+	return freqCur + (freqNext - freqCur) * (time - timeCur) / (timeNext - timeCur);
+}
+
+DiagramStreamRead_t GetNextTimeAndFrequency(DiagramCursor_t* cursor,
 	double curTime, double curFreq,
 	double* nextTime, double* nextFreq)
 {
-	// temporary variables (necessary for part of diagram when direction changes)
-	static bool		dirChange = false;	// true if direction is going to change
-	static double	tempTime = 0;		// stores temporary time
-	static double	tempFreq = 0;		// stores temporary frequency
-#ifndef NDEBUG
-	printf("main::GetNextTimeAndFrequency() Read new data from file %p\n", diagramFile);
-#endif // NDEBUG
-	if (!dirChange) // no direction change
+	if (!cursor->pending)
 	{
-		while (true)
+		if (cursor->stream != nullptr)
+		{
+			DiagramStreamRead_t read = cursor->stream->Take(&cursor->point);
+			if (read != DIAGRAM_STREAM_POINT) return read;
+		}
+		else if (cursor->compiled != nullptr)
+		{
+			if (cursor->index >= cursor->compiled->header->count) return DIAGRAM_STREAM_END; // reached end of diagram
+			const CompiledDiagramRecord_t* record = &cursor->compiled->records[cursor->index];
+			cursor->point.time = record->time / 1000.0;
+			cursor->point.frequency = record->frequency / 100.0;
+		}
+		else
 		{
-			int read_result = fscanf_s(diagramFile, "%lf%lf",
-				nextTime, nextFreq);
-			// success read check
+			if (cursor->index >= cursor->diagram->count) return DIAGRAM_STREAM_END; // reached end of diagram
+			cursor->point = cursor->diagram->points[cursor->index];
+		}
+		cursor->index++;
+		cursor->pending = true;
+	}
+	const DiagramPoint_t* point = &cursor->point;
 #ifndef NDEBUG
-			printf("main::GetNextTimeAndFrequency() New point %g, %g\n", *nextTime, *nextFreq);
+	printf("main::GetNextTimeAndFrequency() Point %lu: %g, %g\n", cursor->index - 1, point->time, point->frequency);
 #endif // NDEBUG
-			// 0.25 is necessary to prevent updating frequency to fast
-			if ((read_result == 2) && (*nextTime >= (curTime + 0.25)))
-			{
-				// check direction change
-				if ((curFreq * (*nextFreq)) < 0)
-				{
-					dirChange = true;
-					tempTime = *nextTime;
-					tempFreq = *nextFreq;
-					*nextFreq = 0;
-					// Calculate time when frequency should be 0 with interpolation
-					*nextTime = curTime + (*nextFreq - curFreq) *
-						((tempTime - curTime) / (tempFreq - curFreq));
-				}
-				return true;
-			}
-			// clean current line
-			while ((fgetc(diagramFile) != '\n') && (!feof(diagramFile)));
-			if (feof(diagramFile)) return false;// reached end of file
-		}
+	// Segment starts at the previous diagram point, not at the measured frequency
+	if (cursor->started)
+	{
+		curTime = cursor->given.time;
+		curFreq = cursor->given.frequency;
 	}
-	else // direction is going to change
+	// check direction change (zero frequency point is given first)
+	if (!cursor->dirChange && ((curFreq * point->frequency) < 0))
 	{
-		*nextTime = tempTime;
-		*nextFreq = tempFreq;
-		dirChange = false;
+		cursor->dirChange = true;
+		*nextFreq = 0;
+		// Calculate time when frequency should be 0 with interpolation
+		*nextTime = curTime + (*nextFreq - curFreq) *
+			((point->time - curTime) / (point->frequency - curFreq));
+		return DIAGRAM_STREAM_POINT;
 	}
-	return true;
+	cursor->dirChange = false;
+	cursor->pending = false;
+	cursor->started = true;
+	cursor->given = *point;
+	*nextTime = point->time;
+	*nextFreq = point->frequency;
+	return DIAGRAM_STREAM_POINT;
 }
 
 void OutParameters(double time)
@@ -199,3 +686,68 @@ void OutParameters(double time)
 		fclose(param_FILE);
 	}
 }
+
+ParameterLog::ParameterLog() :
+	samples(nullptr),
+	capacity(0),
+	count(0),
+	lost(0)
+{
+}
+
+ParameterLog::~ParameterLog()
+{
+	Flush();
+	free(samples);
+}
+
+bool ParameterLog::Allocate(unsigned long capacity)
+{
+	samples = (ParameterSample_t*)malloc(capacity * sizeof(ParameterSample_t));
+	if (samples == nullptr) return false;
+	// Pages are touched now, not by the loop
+	memset(samples, 0, capacity * sizeof(ParameterSample_t));
+	this->capacity = capacity;
+	return true;
+}
+
+void ParameterLog::Out(double time)
+{
+	if (samples == nullptr)
+	{
+		OutParameters(time);
+		return;
+	}
+	if (count >= capacity)
+	{
+		lost++;
+		return;
+	}
+	ParameterSample_t* sample = &samples[count++];
+	sample->time = time;
+	sample->param = motorParams;
+	sample->power = OutPower;
+	sample->temperature = VFDtemperature;
+	sample->reg = getReg_v;
+}
+
+void ParameterLog::Flush()
+{
+	for (unsigned long i = 0; i < count; i++)
+	{
+		motorParams = samples[i].param;
+		OutPower = samples[i].power;
+		VFDtemperature = samples[i].temperature;
+		getReg_v = samples[i].reg;
+		// File holds the last sample as when parameters are printed at once
+		if (i == count - 1) OutParameters(samples[i].time);
+		else PrintParameters(samples[i].time);
+	}
+	count = 0;
+	if (lost > 0) printf("Warning: %lu parameter samples didn't fit into real-time log\n", lost);
+	lost = 0;
+}
+
+// Transports used by this program
+template bool RunDiagramFromFile(VFD<COMPort>& motor);
+template bool RunDiagramFromFile(VFD<COMPortFake>& motor);
@@ -1,36 +1,87 @@
 #include "ModbusRTUclient.h"
+#include "CRC16.h"   // for frames check
 #include <cstdio>   // for exceprion printing
+#include <cstring>  // for buffers operations
+#include <cmath>    // for timeouts calculation
 
 //#define NDEBUG
 #include <cassert>
-#ifndef NDEBUG
-#include <ctime>    // for transfer time measure
-#endif // NDEBUG
 
-unsigned int ModbusRTUClient::CRC16(unsigned char* data, unsigned char length)
+// Read planner cost model ////////////////////////////////////////////////////
+// Expected time from the end of request to the start of response (microseconds)
+const double serverTurnaroundUs = 5000;
+// Request ADU: address, function, starting address, quantity and CRC
+const double readRequestChars = 8;
+// Response ADU without data: address, function, byte count and CRC
+const double readResponseChars = 5;
+
+// Response timeout model //////////////////////////////////////////////////////
+// Turnaround timeout before the first response (no measurements yet)
+const double initialTurnaroundMs = 100;
+// Turnaround timeout is never shorter than this (scheduling and driver latency)
+const double minTurnaroundMs = 20;
+// Turnaround timeout is never longer than this (default response timeout)
+const double maxTurnaroundMs = 1000;
+// Number of timeouts in a row after which server is considered dead
+const unsigned int maxTimeouts = 3;
+// First wait after SERVER DEVICE BUSY exception, doubled on every next one
+const unsigned long busyDelayMs = 20;
+
+template <class Transport>
+double ModbusRTUClient<Transport>::AirTimeMs(unsigned int bytes)
+{
+	// Modbus RTU character is always 11 bits
+	return bytes * 11 * 1000.0 / COM.GetBaudrate();
+}
+
+template <class Transport>
+unsigned long ModbusRTUClient<Transport>::TurnaroundTimeout()
+{
+	if (srtt < 0) return (unsigned long)initialTurnaroundMs;
+	// RFC 6298: RTO = SRTT + 4 * RTTVAR
+	double timeout = srtt + 4 * rttvar;
+	if (timeout < minTurnaroundMs) timeout = minTurnaroundMs;
+	if (timeout > maxTurnaroundMs) timeout = maxTurnaroundMs;
+	return (unsigned long)ceil(timeout);
+}
+
+template <class Transport>
+void ModbusRTUClient<Transport>::UpdateTurnaround(double sample)
 {
-	int i = 0;
-	unsigned int CRC16 = 0xFFFF;
-	while (length > i)
+	if (sample < 0) sample = 0;
+	if (srtt < 0)
 	{
-		CRC16 = CRC16 ^ data[i];
-		for (int j = 0; j < 8; j++)
-		{
-			if (CRC16 & 0x01)
-			{
-				CRC16 = (CRC16 >> 1) ^ 0xA001;
-			}
-			else
-			{
-				CRC16 = CRC16 >> 1;
-			}
-		}
-		i = i + 1;
+		// First measurement
+		srtt = sample;
+		rttvar = sample / 2;
 	}
-	return CRC16;
+	else
+	{
+		rttvar = 0.75 * rttvar + 0.25 * fabs(srtt - sample);
+		srtt = 0.875 * srtt + 0.125 * sample;
+	}
+#ifndef NDEBUG
+	printf("ModbusRTUClient::UpdateTurnaround() Sample %gms, SRTT %gms, RTTVAR %gms, timeout %lums\n",
+		sample, srtt, rttvar, TurnaroundTimeout());
+#endif // NDEBUG
+}
+
+template <class Transport>
+bool ModbusRTUClient<Transport>::SetResponseTimeout(unsigned char wADUBytes, unsigned int backoff)
+{
+	// Request has to leave the port before the server starts its turnaround
+	unsigned long constant = (unsigned long)ceil(AirTimeMs(wADUBytes)) + (TurnaroundTimeout() << backoff);
+	// Every received byte adds its character time
+	unsigned long multiplier = (unsigned long)ceil(AirTimeMs(1));
+	if ((constant == readConstant) && (multiplier == readMultiplier)) return true;
+	if (!COM.SetReadTimeouts(readInterval, multiplier, constant)) return false;
+	readConstant = constant;
+	readMultiplier = multiplier;
+	return true;
 }
 
-bool ModbusRTUClient::responseCRCCheck(unsigned char pduBytes)
+template <class Transport>
+bool ModbusRTUClient<Transport>::responseCRCCheck(unsigned char pduBytes)
 {
 	unsigned short rCRC;
 	rCRC = rBuf[pduBytes + 2];					// CRC Hi
@@ -39,42 +90,73 @@ bool ModbusRTUClient::responseCRCCheck(unsigned char pduBytes)
 	return rCRC == rCalcCRC;
 }
 
-bool ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
+template <class Transport>
+ModbusResult ModbusRTUClient<Transport>::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes,
+	const ModbusPinnedFrame_t* frame /* = nullptr */)
 {
-#ifndef NDEBUG
-	clock_t start_time = clock();
-#endif // NDEBUG
-	// Fill request ADU
-	wBuf[0] = devAddress;				// Server device address
-	// Calculate CRC
-	unsigned short wCRC = CRC16(wBuf, (wPDUBytes + 1));
-	wBuf[wPDUBytes + 1] = wCRC & 0xFF;	// CRC Lo
-	wBuf[wPDUBytes + 2] = wCRC >> 8;	// CRC Hi
+	unsigned char* request = wBuf;	// request ADU to write
+	if (frame != nullptr)
+	{
+		// Pre-encoded request already has server address and CRC
+		request = (unsigned char*)frame->request;
+	}
+	else
+	{
+		// Fill request ADU
+		wBuf[0] = devAddress;				// Server device address
+		// Calculate CRC
+		unsigned short wCRC = CRC16(wBuf, (wPDUBytes + 1));
+		wBuf[wPDUBytes + 1] = wCRC & 0xFF;	// CRC Lo
+		wBuf[wPDUBytes + 2] = wCRC >> 8;	// CRC Hi
+	}
 	// Transfer frame
+	ModbusResult result(MB_PORT_ERROR);	// result of the last attempt
+	unsigned int timeouts = 0;		// timeouts in a row (timeout is doubled after every one)
+	unsigned int busy = 0;			// SERVER DEVICE BUSY exceptions in a row
+	bool lateResponse = false;		// response to a timed out attempt may still come
 	for (unsigned int attempt = 1; attempt <= transmitAttempts; attempt++)
 	{
-		// Write buffer to port
-		long bytesWritten = COM.Write(wBuf, (wPDUBytes + 3));
-		if (bytesWritten != (wPDUBytes + 3))
+		result.attempts = (unsigned char)attempt;
+		if (!SetResponseTimeout(wPDUBytes + 3, timeouts))
+		{
+			result.failure = MB_PORT_ERROR;
+			break;
+		}
+		// Bytes received before the request is sent can't be its response
+		if (resync)
 		{
+			if (COM.ClearReadBuffer() == 0)
+			{
+				result.failure = MB_PORT_ERROR;
 #ifndef NDEBUG
-			printf("ModbusRTUClient::Transfer() Attempt %u: Request write failed\n", attempt);
+				printf("ModbusRTUClient::Transfer() Attempt %u: Clear buffer failed\n", attempt);
 #endif // NDEBUG
-			continue;
+				continue;
+			}
+			resync = false;
 		}
-		// Clear buffer
-		if (COM.ClearReadBuffer() == 0)
+		unsigned long sendTime = COM.GetClock().NowMs();
+		// Write buffer to port
+		long bytesWritten = COM.Write(request, (wPDUBytes + 3));
+		if (bytesWritten != (wPDUBytes + 3))
 		{
+			result.failure = MB_PORT_ERROR;
 #ifndef NDEBUG
-			printf("ModbusRTUClient::Transfer() Attempt %u: Clear buffer failed\n", attempt);
+			printf("ModbusRTUClient::Transfer() Attempt %u: Request write failed\n", attempt);
 #endif // NDEBUG
 			continue;
 		}
 
-		long bytesRead = COM.Read(rBuf, (rPDUBytes + 3));
+		// Flood limit of ReceiveResponse() is per attempt, the result sums all of them
+		unsigned short staleBytes = 0;
+		long bytesRead = ReceiveResponse(request, rPDUBytes + 3, &staleBytes);
+		result.staleBytes += staleBytes;
+		result.rtt = (unsigned short)(COM.GetClock().NowMs() - sendTime);
 		// Check receive errors
 		if (bytesRead == -1)
 		{
+			result.failure = MB_PORT_ERROR;
+			resync = true;
 #ifndef NDEBUG
 			printf("ModbusRTUClient::Transfer() Attempt %u: Response read failed\n", attempt);
 #endif // NDEBUG
@@ -82,128 +164,260 @@ bool ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
 		}
 		if (bytesRead == 0)
 		{
-			assert(("ModbusRTUClient::Transfer() Transfer timeout", 0));
-			return false;
+			result.failure = MB_TIMEOUT;
+			resync = true;
+			lateResponse = true;
+#ifndef NDEBUG
+			printf("ModbusRTUClient::Transfer() Attempt %u: Response timeout\n", attempt);
+#endif // NDEBUG
+			// Server may have missed the request: repeat it waiting twice longer
+			if (++timeouts >= maxTimeouts) break;
+			continue;
 		}
+		// Only the answers to the first request are measured: it is unknown
+		// which request the answer to a repeated one belongs to (Karn's algorithm)
+		bool measure = (attempt == 1);
+		timeouts = 0;
 		if (bytesRead != (rPDUBytes + 3))
 		{
 			// 2 bytes of PDU into CRC check (error function + exception code)
-			if ((bytesRead == 5) && responseCRCCheck(2) && (rBuf[1] > 0x80))
+			if ((bytesRead == 5) && (rBuf[1] > 0x80) && responseCRCCheck(2))
 			{
-				PrintException(attempt);
+				if (measure) UpdateTurnaround(result.rtt - AirTimeMs(wPDUBytes + 3 + 5));
+				result.failure = MB_EXCEPTION;
+				result.exceptionCode = rBuf[2];
+#ifndef NDEBUG
+				printf("ModbusRTUClient::Transfer() Attempt %u: Exception occurred: %s\n",
+					attempt, ModbusExceptionName(result.exceptionCode));
+#endif // NDEBUG
+				// Other exceptions will be the same on every attempt
+				if (result.exceptionCode != 0x06) return result;
+				// SERVER DEVICE BUSY: give the server time to finish its work
+				COM.GetClock().Sleep((busyDelayMs << busy) / 1000.0);
+				busy++;
 				continue;
 			}
+			result.failure = MB_FRAME_ERROR;
+			resync = true;
 #ifndef NDEBUG
 			printf("ModbusRTUClient::Transfer() Attempt %u: Bytes count mismatch\n", attempt);
 #endif // NDEBUG
-			// Increase timeout if the server is too slow
-			COM.SetReadTimeouts((attempt * 2), 0, 1000);
+			// Increase interval timeout if the server is too slow (frame was cut by interval timeout)
+			unsigned char aduLength = ResponseADULength(rBuf, (unsigned char)bytesRead);
+			if ((aduLength == 0) || (bytesRead < aduLength))
+			{
+				readInterval = attempt * 2;
+				readConstant = 0; // apply new interval with the next response timeout
+			}
 			continue;
 		}
+		// Whole expected response is known: comparison replaces CRC calculation
+		if ((frame != nullptr) && (frame->responseLength == bytesRead) &&
+			(memcmp(rBuf, frame->response, frame->responseLength) == 0))
+		{
+			if (measure) UpdateTurnaround(result.rtt - AirTimeMs(wPDUBytes + 3 + bytesRead));
+#ifndef NDEBUG
+			printf("ModbusRTUClient::Transfer() Transfer success (pinned frame). Attempt: %u, time: %ums, stale bytes: %u\n",
+				attempt, result.rtt, result.staleBytes);
+#endif // NDEBUG
+			resync = lateResponse;
+			result.failure = MB_SUCCESS;
+			return result;
+		}
 		if (!responseCRCCheck(rPDUBytes))
 		{
+			// Line noise: repeat at once, the server is alive
+			result.failure = MB_FRAME_ERROR;
+			resync = true;
 #ifndef NDEBUG
 			printf("ModbusRTUClient::Transfer() Attempt %u: Frame CRC check error\n", attempt);
 #endif // NDEBUG
 			continue;
 		}
-		if (rBuf[0] == wBuf[0]) // Success transfer
+		// Check server address (and the whole header of pinned read response)
+		bool headerMatch = (rBuf[0] == request[0]);
+		if ((frame != nullptr) && (frame->responseLength < bytesRead))
+			headerMatch = (memcmp(rBuf, frame->response, frame->responseLength) == 0);
+		if (headerMatch) // Success transfer
 		{
+			if (measure) UpdateTurnaround(result.rtt - AirTimeMs(wPDUBytes + 3 + bytesRead));
 #ifndef NDEBUG
-			printf("ModbusRTUClient::Transfer() Transfer success. Attempt: %u, time: %ldms\n",
-				attempt, (clock() - start_time));
+			printf("ModbusRTUClient::Transfer() Transfer success. Attempt: %u, time: %ums, stale bytes: %u\n",
+				attempt, result.rtt, result.staleBytes);
 #endif // NDEBUG
-			return true;
+			resync = lateResponse;
+			result.failure = MB_SUCCESS;
+			return result;
 		}
 		else
 		{
+			result.failure = MB_FRAME_ERROR;
+			resync = true;
 #ifndef NDEBUG
 			printf("ModbusRTUClient::Transfer() Attempt %u: Incorrect server address in response\n", attempt);
 #endif // NDEBUG
 			continue;
 		}
 	}
+#ifndef NDEBUG
+	printf("ModbusRTUClient::Transfer() Transfer failed: %s\n", result.Describe());
+#endif // NDEBUG
+	return result;
+}
 
-	assert(("ModbusRTUClient::Transfer() Attempts to transfer frame ended up", 0));
-	return false;
+template <class Transport>
+unsigned char ModbusRTUClient<Transport>::ResponseADULength(const unsigned char* adu, unsigned char received)
+{
+	if (received < 2) return 0;
+	// Exception response: address, function + 0x80, exception code, CRC
+	if (adu[1] & 0x80) return 5;
+	switch (adu[1])
+	{
+	case 0x01: // Read Coils
+	case 0x02: // Read Discrete Inputs
+	case 0x03: // Read Holding Registers
+	case 0x04: // Read Input Registers
+		if (received < 3) return 0;
+		if (adu[2] > 250) return 0; // frame length does not fit into unsigned char (3 + 250 + 2 = 255)
+		// address, function, byte count, data, CRC
+		return (unsigned char)(3 + adu[2] + 2);
+	case 0x05: // Write Single Coil
+	case 0x06: // Write Single Register
+	case 0x0F: // Write Multiple Coils
+	case 0x10: // Write Multiple Registers
+		// address, function, 2 bytes address, 2 bytes value or quantity, CRC
+		return 8;
+	default:
+		return 0;
+	}
 }
 
-void ModbusRTUClient::PrintException(unsigned int attempt)
+template <class Transport>
+long ModbusRTUClient<Transport>::ReceiveResponse(const unsigned char* request, unsigned char expectedBytes,
+	unsigned short* staleBytes)
 {
-	unsigned char excepCode = rBuf[2];
-	printf("ModbusRTUClient::Transfer() Attempt: %u. Exception occurred: ", attempt);
-	if (excepCode == 0x01)		printf("ILLEGAL FUNCTION\n");
-	else if (excepCode == 0x02) printf("ILLEGAL DATA ADDRESS\n");
-	else if (excepCode == 0x03) printf("ILLEGAL DATA VALUE\n");
-	else if (excepCode == 0x04) printf("SERVER DEVICE FAILURE\n");
-	else if (excepCode == 0x05) printf("ACKNOWLEDGE\n");
-	else if (excepCode == 0x06) printf("SERVER DEVICE BUSY\n");
-	else if (excepCode == 0x08) printf("MEMORY PARITY ERROR\n");
-	else if (excepCode == 0x0A) printf("GATEWAY PATH UNAVAILABLE\n");
-	else if (excepCode == 0x0B) printf("GATEWAY TARGET DEVICE FAILED TO RESPOND\n");
-	else                        printf("OTHER EXCEPTION\n");
+	long received = 0;	// bytes of the frame candidate in rBuf
+	while (true)
+	{
+		// Every response is at least 5 bytes long, 3 of them are enough to know its length
+		if (received < 3)
+		{
+			long header = COM.Read(&rBuf[received], (unsigned char)(3 - received));
+			if (header < 0) return -1;
+			received += header;
+			if (received < 3) return received;
+		}
+		// Response starts with server address and function code of the request
+		// (function code with 0x80 bit in exception response)
+		if ((rBuf[0] != request[0]) || ((rBuf[1] & 0x7F) != request[1]))
+		{
+			// Rest of an old frame or line noise: shift by one byte
+			memmove(rBuf, &rBuf[1], --received);
+			(*staleBytes)++;
+			// Line is flooded: let Transfer() fail this attempt
+			if (*staleBytes >= sizeof(rBuf)) return received;
+			continue;
+		}
+		unsigned char aduLength = ResponseADULength(rBuf, (unsigned char)received);
+		if (aduLength == 0) aduLength = expectedBytes;
+		// Read exactly the rest of the frame
+		long rest = COM.Read(&rBuf[received], (unsigned char)(aduLength - received));
+		if (rest < 0) return -1;
+		received += rest;
+		if (received < aduLength) return received;
+		// Whole frame with correct CRC which is not the answer to this request
+		// is a late response to the previous one: drop it and wait for the next
+		bool answer = (aduLength == expectedBytes) || (rBuf[1] & 0x80);
+		if (answer && (aduLength == 8) && (rBuf[1] >= 0x05))
+			answer = (memcmp(rBuf, request, 6) == 0); // write response echoes the request
+		if (answer || !responseCRCCheck((unsigned char)(aduLength - 3))) return received;
+		*staleBytes += aduLength;
+#ifndef NDEBUG
+		printf("ModbusRTUClient::ReceiveResponse() Late response of %u bytes dropped\n", aduLength);
+#endif // NDEBUG
+		received = 0;
+	}
 }
 
-#ifdef FAKE_PORT
-ModbusRTUClient::ModbusRTUClient(unsigned char devAddress /* = 1 */,
-	COMPortFake com /* = { "COM3", 19200, 8, 'E', 1 } */) :
-	COM(com),
-	transmitAttempts(5)
+const char* ModbusExceptionName(unsigned char exceptionCode)
 {
-	memset(wBuf, 0, 256);
-	memset(rBuf, 0, 256);
-	// check device address
-	if (devAddress > 247) // Modbus_over_serial_line_V1_02.pdf (chapter 2.2)
+	switch (exceptionCode)
 	{
-		assert(("ModbusRTUClient::Constructor() Incorrect server device address", 0));
-		throw("Incorrect server device address");
+	case 0x01: return "ILLEGAL FUNCTION";
+	case 0x02: return "ILLEGAL DATA ADDRESS";
+	case 0x03: return "ILLEGAL DATA VALUE";
+	case 0x04: return "SERVER DEVICE FAILURE";
+	case 0x05: return "ACKNOWLEDGE";
+	case 0x06: return "SERVER DEVICE BUSY";
+	case 0x08: return "MEMORY PARITY ERROR";
+	case 0x0A: return "GATEWAY PATH UNAVAILABLE";
+	case 0x0B: return "GATEWAY TARGET DEVICE FAILED TO RESPOND";
+	default:   return "OTHER EXCEPTION";
 	}
-	this->devAddress = devAddress;
-	if (!COM.Open())
+}
+
+bool ModbusResult::IsRetryable() const
+{
+	switch (failure)
 	{
-		assert(("ModbusRTUClient::Constructor() Port open error", 0));
-		throw("Port open error");
+	case MB_TIMEOUT:		// server could miss the request
+	case MB_FRAME_ERROR:	// line noise
+		return true;
+	case MB_EXCEPTION:		// server is busy with a long operation
+		return (exceptionCode == 0x05) || (exceptionCode == 0x06);
+	default:
+		return false;
 	}
-	// Set wait response timeout to 1 second (default) and for read not full message
-	// Modbus_over_serial_line_V1_02.pdf (chapter 2.4.1)
-	if (!COM.SetReadTimeouts(1, 0, 1000))
+}
+
+const char* ModbusResult::Describe() const
+{
+	switch (failure)
 	{
-		assert(("ModbusRTUClient::Constructor() Error setting port timeouts", 0));
-		throw("Error setting port timeouts");
+	case MB_SUCCESS:			return "Success";
+	case MB_INVALID_REQUEST:	return "Invalid request";
+	case MB_PORT_ERROR:			return "Port error";
+	case MB_TIMEOUT:			return "Response timeout";
+	case MB_FRAME_ERROR:		return "Corrupted response";
+	case MB_EXCEPTION:			return ModbusExceptionName(exceptionCode);
+	case MB_RESPONSE_MISMATCH:	return "Unexpected response";
+	default:					return "Unknown error";
 	}
-#ifndef NDEBUG
-	printf("ModbusRTUClient::Constructor() Created instance 0x%p with params:\n", this);
-	printf("- COM: 0x%p\n", &(this->COM));
-	printf("- devAddress: %u\n", this->devAddress);
-	printf("- transmitAttempts: %u\n", this->transmitAttempts);
-#endif // NDEBUG
 }
-#else
-ModbusRTUClient::ModbusRTUClient(unsigned char devAddress /* = 1 */,
-	COMPort com /* = { "COM3", 19200, 8, 'E', 1 } */) :
+
+template <class Transport>
+ModbusRTUClient<Transport>::ModbusRTUClient(unsigned char devAddress /* = 1 */,
+	Transport com /* = { "COM3", 19200, 8, 'E', 1 } */) :
 	COM(com),
-	transmitAttempts(5)
+	transmitAttempts(5),
+	nShadow(0),
+	nPinned(0),
+	srtt(-1),
+	rttvar(0),
+	readInterval(1),
+	readMultiplier(0),
+	readConstant(1000),
+	resync(false)
 {
 	memset(wBuf, 0, 256);
 	memset(rBuf, 0, 256);
+	memset(&shadowStats, 0, sizeof(shadowStats));
 	// check device address
 	if (devAddress > 247) // Modbus_over_serial_line_V1_02.pdf (chapter 2.2)
 	{
-		assert(("ModbusRTUClient::Constructor() Incorrect server device address", 0));
-		throw("Incorrect server device address");
+		throw ModbusError("Incorrect server device address", ModbusResult(MB_INVALID_REQUEST));
 	}
 	this->devAddress = devAddress;
 	if (!COM.Open())
 	{
-		assert(("ModbusRTUClient::Constructor() Port open error", 0));
-		throw("Port open error");
+		throw ModbusError("Port open error");
 	}
 	// Set wait response timeout to 1 second (default) and for read not full message
 	// Modbus_over_serial_line_V1_02.pdf (chapter 2.4.1)
+	// Transfer() adapts response timeout to the measured server turnaround time
 	if (!COM.SetReadTimeouts(1, 0, 1000))
 	{
-		assert(("ModbusRTUClient::Constructor() Error setting port timeouts", 0));
-		throw("Error setting port timeouts");
+		throw ModbusError("Error setting port timeouts");
 	}
 #ifndef NDEBUG
 	printf("ModbusRTUClient::Constructor() Created instance 0x%p with params:\n", this);
@@ -212,34 +426,59 @@ ModbusRTUClient::ModbusRTUClient(unsigned char devAddress /* = 1 */,
 	printf("- transmitAttempts: %u\n", this->transmitAttempts);
 #endif // NDEBUG
 }
-#endif
 
-ModbusRTUClient::ModbusRTUClient(ModbusRTUClient& other) :
+template <class Transport>
+ModbusRTUClient<Transport>::ModbusRTUClient(ModbusRTUClient& other) :
 	COM(other.COM),
 	devAddress(other.devAddress),
-	transmitAttempts(other.transmitAttempts)
+	transmitAttempts(other.transmitAttempts),
+	nShadow(other.nShadow),
+	shadowStats(other.shadowStats),
+	nPinned(other.nPinned),
+	srtt(other.srtt),
+	rttvar(other.rttvar),
+	readInterval(other.readInterval),
+	readMultiplier(other.readMultiplier),
+	readConstant(other.readConstant),
+	resync(other.resync)
 {
 	memcpy(wBuf, other.wBuf, 256);
 	memcpy(rBuf, other.rBuf, 256);
+	memcpy(shadow, other.shadow, sizeof(shadow));
+	memcpy(pinned, other.pinned, sizeof(pinned));
 }
 
-ModbusRTUClient::ModbusRTUClient(ModbusRTUClient&& other) noexcept :
+template <class Transport>
+ModbusRTUClient<Transport>::ModbusRTUClient(ModbusRTUClient&& other) noexcept :
 	COM(other.COM),
 	devAddress(other.devAddress),
-	transmitAttempts(other.transmitAttempts)
+	transmitAttempts(other.transmitAttempts),
+	nShadow(other.nShadow),
+	shadowStats(other.shadowStats),
+	nPinned(other.nPinned),
+	srtt(other.srtt),
+	rttvar(other.rttvar),
+	readInterval(other.readInterval),
+	readMultiplier(other.readMultiplier),
+	readConstant(other.readConstant),
+	resync(other.resync)
 {
 	memcpy(wBuf, other.wBuf, 256);
 	memcpy(rBuf, other.rBuf, 256);
+	memcpy(shadow, other.shadow, sizeof(shadow));
+	memcpy(pinned, other.pinned, sizeof(pinned));
 }
 
-ModbusRTUClient::~ModbusRTUClient()
+template <class Transport>
+ModbusRTUClient<Transport>::~ModbusRTUClient()
 {
 #ifndef NDEBUG
 	printf("ModbusRTUClient::Destructor() Deleted instance 0x%p\n", this);
 #endif // NDEBUG
 }
 
-bool ModbusRTUClient::ReadHoldingRegisters(
+template <class Transport>
+ModbusResult ModbusRTUClient<Transport>::ReadHoldingRegisters(
 	unsigned short startAddress,
 	unsigned char nRegisters,
 	unsigned short* buf)
@@ -252,28 +491,57 @@ bool ModbusRTUClient::ReadHoldingRegisters(
 	if ((nRegisters > 125) || (nRegisters < 1))
 	{
 		assert(("ModbusRTUClient::ReadHoldingRegisters() Insufficient quality of registers", 0));
-		return false;
+		return ModbusResult(MB_INVALID_REQUEST);
 	}
 	if ((startAddress + (nRegisters - 1)) < startAddress)
 	{
 		assert(("ModbusRTUClient::ReadHoldingRegisters() Address range exceeded", 0));
-		return false;
+		return ModbusResult(MB_INVALID_REQUEST);
+	}
+	// Serve read from shadow register file if all registers are cached and fresh
+	unsigned int nCached = 0;	// number of registers cached with read policy
+	unsigned int nFresh = 0;	// number of them with fresh values
+	for (unsigned int i = 0; i < nRegisters; i++)
+	{
+		ModbusShadowRegister_t* reg = FindShadowRegister(startAddress + i, MB_SHADOW_READ);
+		if (reg == nullptr) continue;
+		nCached++;
+		if (!IsShadowFresh(reg)) continue;
+		nFresh++;
+		buf[i] = reg->value;
+	}
+	if (nFresh == nRegisters)
+	{
+		shadowStats.hits++;
+#ifndef NDEBUG
+		printf("ModbusRTUClient::ReadHoldingRegisters() Registers are read from shadow register file\n");
+#endif // NDEBUG
+		return ModbusResult();
+	}
+	if (nCached > 0) shadowStats.misses++;
+	const ModbusPinnedFrame_t* frame = FindPinnedFrame(0x03, startAddress, nRegisters);
+	if (frame == nullptr)
+	{
+		// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.3)
+		wBuf[1] = 0x03;					// Function code
+		wBuf[2] = startAddress >> 8;	// Starting Address Hi
+		wBuf[3] = startAddress & 0xFF;	// Starting Address Lo
+		wBuf[4] = 0x00;					// N of Registers Hi
+		wBuf[5] = nRegisters;			// N of Registers Lo
 	}
-	// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.3)
-	wBuf[1] = 0x03;					// Function code
-	wBuf[2] = startAddress >> 8;	// Starting Address Hi
-	wBuf[3] = startAddress & 0xFF;	// Starting Address Lo
-	wBuf[4] = 0x00;					// N of Registers Hi
-	wBuf[5] = nRegisters;			// N of Registers Lo
 
 	// (Number of PDU bytes to read) = (Function code) + (Byte count) + 2 * (Quantity of Registers)
-	if (!Transfer(5, (1 + 1 + 2 * nRegisters))) return false;
+	ModbusResult result = Transfer(5, (1 + 1 + 2 * nRegisters), frame);
+	if (!result) return result;
 
 	// Check byte count
 	if (rBuf[2] != (2 * nRegisters))
 	{
-		assert(("ModbusRTUClient::ReadHoldingRegisters() Byte count mismatch", 0));
-		return false;
+#ifndef NDEBUG
+		printf("ModbusRTUClient::ReadHoldingRegisters() Byte count mismatch\n");
+#endif // NDEBUG
+		result.failure = MB_RESPONSE_MISMATCH;
+		return result;
 	}
 #ifndef NDEBUG
 	printf("ModbusRTUClient::ReadHoldingRegisters() Registers data: 0x");
@@ -290,10 +558,12 @@ bool ModbusRTUClient::ReadHoldingRegisters(
 #ifndef NDEBUG
 	printf("\n");
 #endif // NDEBUG
-	return true;
+	UpdateShadowRegisters(startAddress, nRegisters, buf);
+	return result;
 }
 
-bool ModbusRTUClient::WriteSingleRegister(
+template <class Transport>
+ModbusResult ModbusRTUClient<Transport>::WriteSingleRegister(
 	unsigned short regAddress,
 	unsigned short regValue)
 {
@@ -301,29 +571,390 @@ bool ModbusRTUClient::WriteSingleRegister(
 	printf("ModbusRTUClient::WriteSingleRegister() Write value 0x%04X into address 0x%04X\n",
 		regValue, regAddress);
 #endif // NDEBUG
-	// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.6)
-	wBuf[1] = 0x06;				// Function code
-	wBuf[2] = regAddress >> 8;	// Register Address Hi
-	wBuf[3] = regAddress & 0xFF;// Register Address Lo
-	wBuf[4] = regValue >> 8;	// Register Value Hi
-	wBuf[5] = regValue & 0xFF;	// Register Value Lo
+	// Skip write if device already holds the value
+	ModbusShadowRegister_t* reg = FindShadowRegister(regAddress, MB_SHADOW_WRITE);
+	if ((reg != nullptr) && IsShadowFresh(reg) && (reg->value == regValue))
+	{
+		shadowStats.skips++;
+#ifndef NDEBUG
+		printf("ModbusRTUClient::WriteSingleRegister() Device already holds the value, write skipped\n");
+#endif // NDEBUG
+		return ModbusResult();
+	}
+	const ModbusPinnedFrame_t* frame = FindPinnedFrame(0x06, regAddress, regValue);
+	if (frame == nullptr)
+	{
+		// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.6)
+		wBuf[1] = 0x06;				// Function code
+		wBuf[2] = regAddress >> 8;	// Register Address Hi
+		wBuf[3] = regAddress & 0xFF;// Register Address Lo
+		wBuf[4] = regValue >> 8;	// Register Value Hi
+		wBuf[5] = regValue & 0xFF;	// Register Value Lo
+	}
 
 	// Write and read PDU size is the same
-	if (!Transfer(5, 5)) return false;
+	ModbusResult result = Transfer(5, 5, frame);
+	if (!result)
+	{
+		UpdateShadowRegisters(regAddress, 1, nullptr); // it is unknown if value was written
+		return result;
+	}
 
 	// The normal response is an echo of the request. Check it
+	const unsigned char* request = (frame != nullptr) ? frame->request : wBuf;
+	if (memcmp(&(request[1]), &(rBuf[1]), 5) != 0)
+	{
+#ifndef NDEBUG
+		printf("ModbusRTUClient::WriteSingleRegister() Response check mismatch\n");
+#endif // NDEBUG
+		result.failure = MB_RESPONSE_MISMATCH;
+		UpdateShadowRegisters(regAddress, 1, nullptr);
+		return result;
+	}
+	UpdateShadowRegisters(regAddress, 1, &regValue);
+#ifndef NDEBUG
+	printf("ModbusRTUClient::WriteSingleRegister() Write register success\n");
+#endif // NDEBUG
+	return result;
+}
+
+template <class Transport>
+ModbusResult ModbusRTUClient<Transport>::WriteMultipleRegisters(
+	unsigned short startAddress,
+	unsigned char nRegisters,
+	const unsigned short* values)
+{
+#ifndef NDEBUG
+	printf("ModbusRTUClient::WriteMultipleRegisters() Write %d registers from starting address 0x%04X\n",
+		nRegisters, startAddress);
+#endif // NDEBUG
+	// Check input data
+	if ((nRegisters > 123) || (nRegisters < 1))
+	{
+		assert(("ModbusRTUClient::WriteMultipleRegisters() Insufficient quality of registers", 0));
+		return ModbusResult(MB_INVALID_REQUEST);
+	}
+	if ((startAddress + (nRegisters - 1)) < startAddress)
+	{
+		assert(("ModbusRTUClient::WriteMultipleRegisters() Address range exceeded", 0));
+		return ModbusResult(MB_INVALID_REQUEST);
+	}
+	// Skip write if device already holds all values
+	bool holds = true;
+	for (unsigned int i = 0; (i < nRegisters) && holds; i++)
+	{
+		ModbusShadowRegister_t* reg = FindShadowRegister(startAddress + i, MB_SHADOW_WRITE);
+		holds = (reg != nullptr) && IsShadowFresh(reg) && (reg->value == values[i]);
+	}
+	if (holds)
+	{
+		shadowStats.skips++;
+#ifndef NDEBUG
+		printf("ModbusRTUClient::WriteMultipleRegisters() Device already holds the values, write skipped\n");
+#endif // NDEBUG
+		return ModbusResult();
+	}
+	// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.12)
+	wBuf[1] = 0x10;					// Function code
+	wBuf[2] = startAddress >> 8;	// Starting Address Hi
+	wBuf[3] = startAddress & 0xFF;	// Starting Address Lo
+	wBuf[4] = 0x00;					// Quantity of Registers Hi
+	wBuf[5] = nRegisters;			// Quantity of Registers Lo
+	wBuf[6] = 2 * nRegisters;		// Byte Count
+	for (unsigned int i = 0; i < nRegisters; i++)
+	{
+		wBuf[2 * i + 7] = values[i] >> 8;	// Register Value Hi
+		wBuf[2 * i + 8] = values[i] & 0xFF;	// Register Value Lo
+	}
+
+	// (Number of PDU bytes to write) = (Function code) + 4 + (Byte count) + 2 * (Quantity of Registers)
+	// Response PDU is function code, starting address and quantity of registers
+	ModbusResult result = Transfer((1 + 4 + 1 + 2 * nRegisters), 5);
+	if (!result)
+	{
+		UpdateShadowRegisters(startAddress, nRegisters, nullptr); // it is unknown if values were written
+		return result;
+	}
+
+	// The normal response echoes function code, starting address and quantity. Check it
 	if (memcmp(&(wBuf[1]), &(rBuf[1]), 5) != 0)
 	{
-		assert(("ModbusRTUClient::WriteSingleRegister() Response check mismatch", 0));
+#ifndef NDEBUG
+		printf("ModbusRTUClient::WriteMultipleRegisters() Response check mismatch\n");
+#endif // NDEBUG
+		result.failure = MB_RESPONSE_MISMATCH;
+		UpdateShadowRegisters(startAddress, nRegisters, nullptr);
+		return result;
+	}
+	UpdateShadowRegisters(startAddress, nRegisters, values);
+#ifndef NDEBUG
+	printf("ModbusRTUClient::WriteMultipleRegisters() Write registers success\n");
+#endif // NDEBUG
+	return result;
+}
+
+template <class Transport>
+unsigned char ModbusRTUClient<Transport>::PlanReadFrames(
+	const unsigned short* addresses,
+	unsigned char count,
+	ModbusReadFrame_t* frames)
+{
+	if ((addresses == nullptr) || (frames == nullptr) || (count == 0))
+	{
+		assert(("ModbusRTUClient::PlanReadFrames() Incorrect arguments", 0));
+		return 0;
+	}
+	// Sort addresses and remove duplicates (insertion sort, lists are short)
+	unsigned short sorted[256];
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		unsigned int j = n;
+		while ((j > 0) && (sorted[j - 1] > addresses[i])) j--;
+		if ((j > 0) && (sorted[j - 1] == addresses[i])) continue;
+		memmove(&sorted[j + 1], &sorted[j], (n - j) * sizeof(sorted[0]));
+		sorted[j] = addresses[i];
+		n++;
+	}
+	// Line time of one character (Modbus RTU character is always 11 bits)
+	double charUs = 11 * 1000000.0 / COM.GetBaudrate();
+	// Silent interval is 3.5 characters, but fixed to 1750us above 19200 baud
+	// Modbus_over_serial_line_V1_02.pdf (chapter 2.5.1.1)
+	double silentUs = (COM.GetBaudrate() > 19200) ? 1750 : 3.5 * charUs;
+	// Cost of one more frame and of one more register in the response (microseconds)
+	double frameUs = (readRequestChars + readResponseChars) * charUs + 2 * silentUs + serverTurnaroundUs;
+	double registerUs = 2 * charUs;
+
+	// cost[j] - minimal time to read the first j registers,
+	// first[j] - index of the first register in the last frame of that plan
+	double cost[256];
+	unsigned char first[256];
+	cost[0] = 0;
+	for (unsigned int j = 1; j <= n; j++)
+	{
+		cost[j] = -1;
+		for (unsigned int i = j; i > 0; i--)
+		{
+			unsigned int span = sorted[j - 1] - sorted[i - 1] + 1;
+			if (span > 125) break; // Quantity of Registers limit
+			double c = cost[i - 1] + frameUs + span * registerUs;
+			if ((cost[j] < 0) || (c < cost[j]))
+			{
+				cost[j] = c;
+				first[j] = (unsigned char)(i - 1);
+			}
+		}
+	}
+	// Restore frames from the end of plan
+	unsigned char nFrames = 0;
+	for (unsigned int j = n; j > 0; j = first[j]) nFrames++;
+	unsigned char f = nFrames;
+	for (unsigned int j = n; j > 0; j = first[j])
+	{
+		f--;
+		frames[f].startAddress = sorted[first[j]];
+		frames[f].nRegisters = (unsigned char)(sorted[j - 1] - sorted[first[j]] + 1);
+	}
+#ifndef NDEBUG
+	printf("ModbusRTUClient::PlanReadFrames() %u registers in %u frames (%.0fus):",
+		n, nFrames, cost[n]);
+	for (unsigned int i = 0; i < nFrames; i++)
+		printf(" 0x%04X[%u]", frames[i].startAddress, frames[i].nRegisters);
+	printf("\n");
+#endif // NDEBUG
+	return nFrames;
+}
+
+template <class Transport>
+ModbusResult ModbusRTUClient<Transport>::ReadScatteredRegisters(
+	const unsigned short* addresses,
+	unsigned char count,
+	unsigned short* values)
+{
+	ModbusReadFrame_t frames[256];
+	unsigned char nFrames = PlanReadFrames(addresses, count, frames);
+	if (nFrames == 0) return ModbusResult(MB_INVALID_REQUEST);
+	ModbusResult result;
+	unsigned short regArray[125]; // registers of one frame
+	for (unsigned int f = 0; f < nFrames; f++)
+	{
+		result = ReadHoldingRegisters(frames[f].startAddress, frames[f].nRegisters, regArray);
+		if (!result) return result;
+		// Scatter values of this frame into caller's buffer
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned short offset = addresses[i] - frames[f].startAddress;
+			if (offset < frames[f].nRegisters) values[i] = regArray[offset];
+		}
+	}
+	return result;
+}
+
+template <class Transport>
+const ModbusPinnedFrame_t* ModbusRTUClient<Transport>::FindPinnedFrame(
+	unsigned char function,
+	unsigned short address,
+	unsigned short value)
+{
+	for (unsigned int i = 0; i < nPinned; i++)
+	{
+		const ModbusPinnedFrame_t* frame = &pinned[i];
+		if ((frame->function == function) && (frame->address == address) &&
+			(frame->value == value) && (frame->request[0] == devAddress))
+			return frame;
+	}
+	return nullptr;
+}
+
+template <class Transport>
+bool ModbusRTUClient<Transport>::PinFrame(
+	unsigned char function,
+	unsigned short address,
+	unsigned short value)
+{
+	if (FindPinnedFrame(function, address, value) != nullptr) return true; // already pinned
+	if (nPinned >= sizeof(pinned) / sizeof(pinned[0]))
+	{
+		assert(("ModbusRTUClient::PinFrame() Frame cache is full", 0));
+		return false;
+	}
+	if ((function == 0x03) && ((value < 1) || (value > 125) || ((address + (value - 1)) > 0xFFFF)))
+	{
+		assert(("ModbusRTUClient::PinFrame() Incorrect quantity of registers", 0));
+		return false;
+	}
+	if ((function != 0x03) && (function != 0x06))
+	{
+		assert(("ModbusRTUClient::PinFrame() Function is not supported", 0));
 		return false;
 	}
+	ModbusPinnedFrame_t* frame = &pinned[nPinned];
+	frame->function = function;
+	frame->address = address;
+	frame->value = value;
+	// Request ADU: address, function, address (quantity or value) and CRC
+	frame->request[0] = devAddress;
+	frame->request[1] = function;
+	frame->request[2] = address >> 8;
+	frame->request[3] = address & 0xFF;
+	frame->request[4] = value >> 8;
+	frame->request[5] = value & 0xFF;
+	unsigned short crc = CRC16(frame->request, 6);
+	frame->request[6] = crc & 0xFF;	// CRC Lo
+	frame->request[7] = crc >> 8;	// CRC Hi
+	if (function == 0x06)
+	{
+		// The normal response is an echo of the request
+		memcpy(frame->response, frame->request, 8);
+		frame->responseLength = 8;
+	}
+	else
+	{
+		// Only header is known: address, function and byte count
+		frame->response[0] = devAddress;
+		frame->response[1] = function;
+		frame->response[2] = (unsigned char)(2 * value);
+		frame->responseLength = 3;
+	}
+	nPinned++;
 #ifndef NDEBUG
-	printf("ModbusRTUClient::WriteSingleRegister() Write register success\n");
+	printf("ModbusRTUClient::PinFrame() Pinned frame 0x%02X 0x%04X 0x%04X\n", function, address, value);
 #endif // NDEBUG
 	return true;
 }
 
-void ModbusRTUClient::SetNumberOfTransmitAttempts(unsigned char attempts /* = 1 */)
+template <class Transport>
+ModbusShadowRegister_t* ModbusRTUClient<Transport>::FindShadowRegister(unsigned short address, unsigned char policy)
+{
+	for (unsigned int i = 0; i < nShadow; i++)
+		if ((shadow[i].address == address) && (shadow[i].policy & policy)) return &shadow[i];
+	return nullptr;
+}
+
+template <class Transport>
+bool ModbusRTUClient<Transport>::IsShadowFresh(const ModbusShadowRegister_t* reg)
+{
+	if (!reg->valid) return false;
+	return (reg->ttl == 0) || ((COM.GetClock().NowMs() - reg->timestamp) < reg->ttl);
+}
+
+template <class Transport>
+void ModbusRTUClient<Transport>::UpdateShadowRegisters(
+	unsigned short startAddress,
+	unsigned char nRegisters,
+	const unsigned short* values)
+{
+	if (nShadow == 0) return;
+	unsigned long now = COM.GetClock().NowMs();
+	for (unsigned int i = 0; i < nShadow; i++)
+	{
+		unsigned short offset = shadow[i].address - startAddress;
+		if (offset >= nRegisters) continue;
+		shadow[i].valid = (values != nullptr);
+		if (values != nullptr) shadow[i].value = values[offset];
+		shadow[i].timestamp = now;
+	}
+}
+
+template <class Transport>
+bool ModbusRTUClient<Transport>::SetShadowPolicy(
+	unsigned short address,
+	unsigned char policy,
+	unsigned long ttl /* = 0 */)
+{
+	ModbusShadowRegister_t* reg = FindShadowRegister(address, MB_SHADOW_READ | MB_SHADOW_WRITE);
+	if (reg == nullptr)
+	{
+		if (policy == MB_SHADOW_NONE) return true;
+		if (nShadow >= sizeof(shadow) / sizeof(shadow[0]))
+		{
+			assert(("ModbusRTUClient::SetShadowPolicy() Shadow register file is full", 0));
+			return false;
+		}
+		reg = &shadow[nShadow++];
+		reg->address = address;
+		reg->valid = false;
+		reg->value = 0;
+		reg->timestamp = 0;
+	}
+	else if (policy == MB_SHADOW_NONE)
+	{
+		// Remove register from shadow register file
+		*reg = shadow[--nShadow];
+		return true;
+	}
+	reg->policy = policy;
+	reg->ttl = ttl;
+#ifndef NDEBUG
+	printf("ModbusRTUClient::SetShadowPolicy() Register 0x%04X: policy 0x%02X, ttl %lums\n",
+		address, policy, ttl);
+#endif // NDEBUG
+	return true;
+}
+
+template <class Transport>
+void ModbusRTUClient<Transport>::InvalidateShadowRegisters()
+{
+	for (unsigned int i = 0; i < nShadow; i++) shadow[i].valid = false;
+}
+
+template <class Transport>
+bool ModbusRTUClient<Transport>::GetShadowValue(unsigned short address, unsigned short* value)
+{
+	ModbusShadowRegister_t* reg = FindShadowRegister(address, MB_SHADOW_READ | MB_SHADOW_WRITE);
+	if ((reg == nullptr) || !IsShadowFresh(reg)) return false;
+	*value = reg->value;
+	return true;
+}
+
+template <class Transport>
+ModbusShadowStats_t ModbusRTUClient<Transport>::GetShadowStats()
+{
+	return shadowStats;
+}
+
+template <class Transport>
+void ModbusRTUClient<Transport>::SetNumberOfTransmitAttempts(unsigned char attempts /* = 1 */)
 {
 	if (attempts == 0) attempts = 1;
 	this->transmitAttempts = attempts;
@@ -331,3 +962,13 @@ void ModbusRTUClient::SetNumberOfTransmitAttempts(unsigned char attempts /* = 1
 	printf("ModbusRTUClient::SetNumberOfTransmitAttempts() Set %u transmit attempts\n", attempts);
 #endif // NDEBUG
 }
+
+template <class Transport>
+Clock& ModbusRTUClient<Transport>::GetClock()
+{
+	return COM.GetClock();
+}
+
+// Transports used by this program
+template class ModbusRTUClient<COMPort>;
+template class ModbusRTUClient<COMPortFake>;
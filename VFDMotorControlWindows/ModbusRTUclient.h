@@ -12,55 +12,220 @@
 #ifndef MODBUSRTUCLIENT_H
 #define MODBUSRTUCLIENT_H
 
-//#define FAKE_PORT // uncomment it for use fake port and test modbus
+#include <exception> // for ModbusError
 
-#ifdef FAKE_PORT
-#include "COMPortFake.h"
-#else
-#include "COMPort.h"
-#endif
+#include "COMPort.h"		// serial port transport
+#include "COMPortFake.h"	// fake port transport for testing without VFD
 
+// Class of Modbus transaction failure
+enum ModbusFailure_t : unsigned char
+{
+	MB_SUCCESS = 0,			// transaction is complete
+	MB_INVALID_REQUEST,		// request arguments are incorrect, nothing was sent
+	MB_PORT_ERROR,			// port write, read or setup failed
+	MB_TIMEOUT,				// server did not answer
+	MB_FRAME_ERROR,			// responses were corrupted (CRC, length or server address)
+	MB_EXCEPTION,			// server answered with exception (see exceptionCode)
+	MB_RESPONSE_MISMATCH	// correct frame with unexpected content (echo or byte count)
+};
+
+/**
+ * @brief Get the name of Modbus exception
+ * Modbus_Application_Protocol_V1_1b3.pdf (chapter 7)
+ *
+ * @param exceptionCode[in]	- exception code from response
+ * @return const char*		- exception name (static string)
+ */
+const char* ModbusExceptionName(unsigned char exceptionCode);
+
+// Result of Modbus transaction. It is small and returned by value:
+// error path does no allocation and no formatted output
+struct ModbusResult
+{
+	ModbusFailure_t	failure;		// failure class (MB_SUCCESS if transaction is complete)
+	unsigned char	exceptionCode;	// Modbus exception code (0 if there was no exception)
+	unsigned char	attempts;		// number of sent requests (0 - served without bus transfer)
+	unsigned short	rtt;			// time from the last request to its response in ms
+	unsigned short	staleBytes;		// bytes dropped before the response (late answers and line noise)
+
+	ModbusResult(ModbusFailure_t failure = MB_SUCCESS) :
+		failure(failure), exceptionCode(0), attempts(0), rtt(0), staleBytes(0) {}
+
+	/**
+	 * @brief Check if transaction is complete: if (!MB.ReadHoldingRegisters(...))
+	 *
+	 */
+	explicit operator bool() const { return failure == MB_SUCCESS; }
+
+	/**
+	 * @brief Check if the same request may succeed later
+	 * (timeout, corrupted response, ACKNOWLEDGE or SERVER DEVICE BUSY)
+	 *
+	 * @return true		- if it is worth to repeat request
+	 * @return false	- if request will fail again (exception, port error or invalid request)
+	 */
+	bool IsRetryable() const;
+
+	/**
+	 * @brief Get the failure description
+	 *
+	 * @return const char*	- description (static string)
+	 */
+	const char* Describe() const;
+};
+
+// Exception thrown by ModbusRTUClient constructor
+class ModbusError : public std::exception
+{
+private:
+	const char*		message;	// static error message
+	ModbusResult	result;		// failure class
+public:
+	ModbusError(const char* message, ModbusResult result = ModbusResult(MB_PORT_ERROR)) :
+		message(message), result(result) {}
+	const char* what() const noexcept override { return message; }
+	ModbusResult Result() const { return result; }
+};
+
+// One Read Holding Registers request of the read plan
+typedef struct {
+	unsigned short	startAddress;	// Starting Address
+	unsigned char	nRegisters;		// Quantity of Registers (1 to 125)
+} ModbusReadFrame_t;
+
+// Fully encoded request of a hot fixed command and its expected response
+typedef struct {
+	unsigned char	function;		// Function code (0x03 or 0x06)
+	unsigned short	address;		// Register Address or Starting Address
+	unsigned short	value;			// Register Value (0x06) or Quantity of Registers (0x03)
+	unsigned char	request[8];		// Request ADU with server address and CRC
+	unsigned char	response[8];	// Expected response ADU (0x06) or its header (0x03)
+	unsigned char	responseLength;	// Number of bytes in expected response
+} ModbusPinnedFrame_t;
+
+// Caching policies of shadow register file (can be combined)
+const unsigned char MB_SHADOW_NONE = 0x00;	// register is not cached
+const unsigned char MB_SHADOW_READ = 0x01;	// reads are served from cache while value is fresh
+const unsigned char MB_SHADOW_WRITE = 0x02;	// writes of the value that device already holds are skipped
+
+// Shadow copy of one holding register
+typedef struct {
+	unsigned short	address;	// Register Address
+	unsigned char	policy;		// MB_SHADOW_READ and/or MB_SHADOW_WRITE
+	bool			valid;		// true if value is known
+	unsigned short	value;		// last read or written value
+	unsigned long	ttl;		// time to live of the value in ms (0 - never expires)
+	unsigned long	timestamp;	// time when value was read or written in ms
+} ModbusShadowRegister_t;
+
+// Shadow register file counters
+typedef struct {
+	unsigned long	hits;		// reads served from cache
+	unsigned long	misses;		// reads of cached registers which went to the bus
+	unsigned long	skips;		// writes skipped because device already holds the value
+} ModbusShadowStats_t;
+
+/**
+ * @brief Modbus RTU client over any transport with interface of COMPort:
+ * Open(), GetBaudrate(), SetReadTimeouts(interval, multiplier, constant),
+ * ClearReadBuffer(), Write(buf, length) and Read(buf, length).
+ * Transport calls are resolved at compile time (no virtual calls).
+ * Instantiated for COMPort and COMPortFake in ModbusRTUclient.cpp.
+ *
+ * @tparam Transport	- port class (COMPort, COMPortFake)
+ */
+template <class Transport>
 class ModbusRTUClient
 {
 private:
-#ifdef FAKE_PORT
-	COMPortFake     COM;        // Instance of fake COM port class
-#else
-	COMPort         COM;        // Instance of COM port class
-#endif
+	Transport       COM;        // Instance of transport (serial port or fake port)
 	unsigned char   devAddress; // Server device address
 	// Number of repeated transmit attempts when transmit fails (default: 5)
 	unsigned char   transmitAttempts;
 	unsigned char   wBuf[256];  // Buffer for write frame
 	unsigned char   rBuf[256];  // Buffer for read frame
+	ModbusShadowRegister_t shadow[16];	// Shadow register file (registers with caching policy)
+	unsigned char   nShadow;    // Number of registers in shadow register file
+	ModbusShadowStats_t shadowStats; // Shadow register file counters
+	ModbusPinnedFrame_t pinned[8];	// Pre-encoded frames of hot fixed commands
+	unsigned char   nPinned;    // Number of pre-encoded frames
+	// Response timeout model of this server (RFC 6298 applied to turnaround time)
+	double          srtt;       // Smoothed turnaround time in ms (negative - not measured yet)
+	double          rttvar;     // Turnaround time variation in ms
+	unsigned long   readInterval;   // Interval timeout between received bytes in ms
+	unsigned long   readMultiplier; // Applied read timeout per received byte in ms
+	unsigned long   readConstant;   // Applied read timeout constant in ms
+	// Previous exchange may have left bytes on the line (purge before the next request)
+	bool            resync;
+
+	/**
+	 * @brief Get time to wait for the server to start answering:
+	 * SRTT + 4 * RTTVAR, restricted to 20-1000ms (100ms before the first measurement)
+	 *
+	 * @return unsigned long	- turnaround timeout in ms
+	 */
+	unsigned long TurnaroundTimeout();
+
+	/**
+	 * @brief Refine turnaround time mean and variation with a new measurement
+	 *
+	 * @param sample[in]	- measured response time without frames transmission time in ms
+	 */
+	void UpdateTurnaround(double sample);
+
+	/**
+	 * @brief Set port read timeouts for the next response: request transmission
+	 * time plus turnaround timeout plus character time for every received byte
+	 *
+	 * @param wADUBytes[in]	- request ADU size in bytes
+	 * @param backoff[in]	- turnaround timeout is multiplied by 2^backoff (after timeouts)
+	 * @return true			- if timeouts are set
+	 * @return false		- if port error occurred
+	 */
+	bool SetResponseTimeout(unsigned char wADUBytes, unsigned int backoff);
 
 	/**
-	 * @brief Calculates CRC16
-	 * 
-	 * Step 1: Load a 16-bit register (called CRC register) with FFFFH.
-	 * Step 2: Exclusive OR the first 8-bit byte of the command message
-	 * with the low order byte of the 16-bit CRC register,
-	 * putting the result in the CRC register. 
-	 * Step 3: Examine the LSB of CRC register. 
-	 * Step 4: If the LSB of CRC register is 0, shift the CRC register
-	 * one bit to the right with MSB zero filling, then repeat step 3.
-	 * If the LSB of CRC register is 1, shift the CRC register
-	 * one bit to the right with MSB zero filling, Exclusive OR the
-	 * CRC register with the polynomial value A001H, then repeat step 3.
-	 * Step 5: Repeat step 3 and 4 until eight shifts have been performed.
-	 * When this is done, a complete 8-bit byte will have been processed.
-	 * Step 6: Repeat step 2 to 5 for the next 8-bit byte of the command message.
-	 * Continue doing this until all bytes have been processed.
-	 * The final contents of the CRC register are the CRC value.
-	 * When transmitting the CRC value in the message,
-	 * the upper and lower bytes of the CRC value must be swapped,
-	 * i.e. the lower order byte will be transmitted first.
-	 *
-	 * @param data[in]		- a pointer to the message buffer
-	 * @param length[in]	- the message buffer length
-	 * @return unsigned int - calculated CRC
-	 */
-	unsigned int CRC16(unsigned char* data, unsigned char length);
+	 * @brief Find pre-encoded frame of request for this server
+	 *
+	 * @param function[in]				- Function code
+	 * @param address[in]				- Register Address or Starting Address
+	 * @param value[in]					- Register Value or Quantity of Registers
+	 * @return ModbusPinnedFrame_t*		- pre-encoded frame or nullptr if request is not pinned
+	 */
+	const ModbusPinnedFrame_t* FindPinnedFrame(
+		unsigned char function,
+		unsigned short address,
+		unsigned short value);
+
+	/**
+	 * @brief Find register with required policy in shadow register file
+	 *
+	 * @param address[in]				- Register Address
+	 * @param policy[in]				- MB_SHADOW_READ or MB_SHADOW_WRITE
+	 * @return ModbusShadowRegister_t*	- cached register or nullptr if it is not cached with this policy
+	 */
+	ModbusShadowRegister_t* FindShadowRegister(unsigned short address, unsigned char policy);
+
+	/**
+	 * @brief Check if cached value is known and its time to live is not expired
+	 *
+	 * @param reg[in]	- cached register
+	 * @return true		- if value can be used instead of device value
+	 * @return false	- if value has to be read from device
+	 */
+	bool IsShadowFresh(const ModbusShadowRegister_t* reg);
+
+	/**
+	 * @brief Store values which device holds now into shadow register file
+	 *
+	 * @param startAddress[in]	- Starting Address
+	 * @param nRegisters[in]	- Quantity of Registers
+	 * @param values[in]		- Registers values (nullptr - values are unknown, invalidate them)
+	 */
+	void UpdateShadowRegisters(
+		unsigned short startAddress,
+		unsigned char nRegisters,
+		const unsigned short* values);
 
 	/**
 	 * @brief Check CRC of response message
@@ -71,6 +236,39 @@ private:
 	 */
 	bool responseCRCCheck(unsigned char pduBytes);
 
+	/**
+	 * @brief Determine full response ADU length from the bytes received so far.
+	 * Length is known after 2 bytes for exception responses and fixed size
+	 * responses (0x05, 0x06, 0x0F, 0x10) and after 3 bytes for responses
+	 * with byte count field (0x01-0x04).
+	 * Modbus_Application_Protocol_V1_1b3.pdf (chapters 6 and 7)
+	 *
+	 * @param adu[in]			- received response bytes (starting from server address)
+	 * @param received[in]		- number of bytes received
+	 * @return unsigned char	- full ADU length (with CRC), 0 if more bytes are needed
+	 * or function code is unknown
+	 */
+	static unsigned char ResponseADULength(const unsigned char* adu, unsigned char received);
+
+	/**
+	 * @brief Read response ADU into rBuf. Reads header first and then
+	 * exactly the rest of the frame, so reading returns as soon as the
+	 * last CRC byte arrives instead of waiting for the interval timeout.
+	 *
+	 * Receive buffer is not purged before the response, so the frame is
+	 * resynchronised here: bytes before the request's server address and
+	 * function code are dropped, and so is a whole frame with correct CRC
+	 * which can't be the answer (wrong length or echo of another write).
+	 *
+	 * @param request[in]		- request ADU the response answers to
+	 * @param expectedBytes[in]	- ADU size of normal response (used if function code is unknown)
+	 * @param staleBytes[in,out]	- number of dropped bytes is added here (start from 0 at every attempt:
+	 * the line is taken as flooded when it reaches the buffer size)
+	 * @return long				- number of bytes read, 0 on timeout or -1 if error
+	 */
+	long ReceiveResponse(const unsigned char* request, unsigned char expectedBytes,
+		unsigned short* staleBytes);
+
 	/**
 	 * @brief Transfers one frame to server.
 	 * Creares ADU frame (Modbus_over_serial_line_V1_02.pdf).
@@ -79,43 +277,35 @@ private:
 	 * Checks frame using CRC
 	 * Check if exception occurred and prints it
 	 * Returns result if frame is correct
+	 * Retries depend on the failure: timeout - repeat with doubled timeout
+	 * (3 timeouts in a row mean that server is dead), CRC error - repeat at once,
+	 * SERVER DEVICE BUSY - repeat after growing delay, other exceptions - fail at once.
+	 * Receive buffer is purged only after an exchange which may have left bytes
+	 * on the line (timeout, corrupted response), otherwise response is resynchronised
+	 * by ReceiveResponse().
+	 *
+	 * When pre-encoded frame is given, it is written as is (without filling
+	 * wBuf and CRC calculation) and the response is compared with its template.
 	 *
 	 * @param wPDUBytes[in]	- Number of PDU bytes to write
 	 * @param rPDUBytes[in]	- Number of PDU bytes to read
-	 * @return true			- If transfer success
-	 * @return false		- If some error occurred
+	 * @param frame[in]		- [optional] Pre-encoded request (see PinFrame())
+	 * @return ModbusResult	- failure class, exception code, attempts and response time
 	 */
-	bool Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes);
+	ModbusResult Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes,
+		const ModbusPinnedFrame_t* frame = nullptr);
 
-	/**
-	 * @brief Print Modbus exception by its code
-	 *
-	 */
-	void PrintException(unsigned int attempt);
 public:
-#ifdef FAKE_PORT
-	/**
-	 * @brief Construct a new ModbusRTUClient object with fake COM port object for testing.
-	 * Setup port communication parameters
-	 *
-	 * @param devAddress[in]	- Modbus server address. (Range: 0-247, Default: 1)
-	 * @param com[in]           - COMPortFake class instance with its parameters
-	 * (Defaults according to: Modbus_over_serial_line_V1_02.pdf)
-	 */
-	ModbusRTUClient(unsigned char devAddress = 1,
-		COMPortFake com = { "COM3", 19200, 8, 'E', 1 });
-#else
 	/**
 	 * @brief Construct a new ModbusRTUClient object.
 	 * Setup port communication parameters
 	 *
 	 * @param devAddress[in]    - Modbus server address. (Range: 0-247, Default: 1)
-	 * @param com[in]           - COMPort class instance with its parameters
+	 * @param com[in]           - Transport class instance with its parameters
 	 * (Defaults according to: Modbus_over_serial_line_V1_02.pdf)
 	 */
 	ModbusRTUClient(unsigned char devAddress = 1,
-		COMPort com = { "COM3", 19200, 8, 'E', 1 });
-#endif
+		Transport com = { "COM3", 19200, 8, 'E', 1 });
 
 	/**
 	 * @brief Copy constructor for ModbusRTUClient.
@@ -147,10 +337,10 @@ public:
 	 * @param startAddress[in]	- Starting Address (0x0000 to 0xFFFF)
 	 * @param nRegisters[in]    - Quantity of Registers (1 to 125 (0x7D))
 	 * @param buf[out]          - Buffer to store the read result as 16-bit HEX values.
-	 * @return true				- If read success
-	 * @return false			- If some error occurred
+	 * @return ModbusResult	- converts to true if read success, otherwise failure class
+	 * and exception code tell if it is worth to repeat the request
 	 */
-	bool ReadHoldingRegisters(
+	ModbusResult ReadHoldingRegisters(
 		unsigned short startAddress,
 		unsigned char nRegisters,
 		unsigned short* buf);
@@ -161,13 +351,116 @@ public:
 	 *
 	 * @param regAddress[in]	- Register Address (0x0000 to 0xFFFF)
 	 * @param regValue[in]      - Register Value (0x0000 to 0xFFFF)
-	 * @return true				- If write success
-	 * @return false			- If some error occurred
+	 * @return ModbusResult	- converts to true if write success, otherwise failure class
+	 * and exception code tell if it is worth to repeat the request
 	 */
-	bool WriteSingleRegister(
+	ModbusResult WriteSingleRegister(
 		unsigned short regAddress,
 		unsigned short regValue);
 
+	/**
+	 * @brief Write Multiple Registers (0x10 Function code).
+	 * Write a block of contiguous registers in a remote device with one frame.
+	 * Transfer is repeated with the same rules as other requests.
+	 *
+	 * @param startAddress[in]	- Starting Address (0x0000 to 0xFFFF)
+	 * @param nRegisters[in]    - Quantity of Registers (1 to 123 (0x7B))
+	 * @param values[in]        - Registers values to write
+	 * @return ModbusResult	- converts to true if write success, otherwise failure class
+	 * and exception code tell if it is worth to repeat the request
+	 */
+	ModbusResult WriteMultipleRegisters(
+		unsigned short startAddress,
+		unsigned char nRegisters,
+		const unsigned short* values);
+
+	/**
+	 * @brief Plan the cheapest set of Read Holding Registers (0x03) requests
+	 * that covers all wanted registers. Registers between wanted ones are read
+	 * too when this costs less line time than the header, CRC, silent intervals
+	 * and server turnaround of one more frame at the current baudrate.
+	 * Frames never exceed 125 registers.
+	 *
+	 * @param addresses[in]		- Wanted register addresses (any order, duplicates allowed)
+	 * @param count[in]			- Number of wanted addresses
+	 * @param frames[out]		- Planned requests sorted by address (must hold 'count' items)
+	 * @return unsigned char	- Number of planned requests (0 if input is incorrect)
+	 */
+	unsigned char PlanReadFrames(
+		const unsigned short* addresses,
+		unsigned char count,
+		ModbusReadFrame_t* frames);
+
+	/**
+	 * @brief Read scattered holding registers with the minimal set of 0x03 requests
+	 * (see PlanReadFrames()) and put every value in place of its address.
+	 *
+	 * @param addresses[in]		- Register addresses to read (any order, duplicates allowed)
+	 * @param count[in]			- Number of addresses
+	 * @param values[out]		- Buffer to store the read values in order of addresses
+	 * @return ModbusResult	- result of the last request (the first failed one if any)
+	 */
+	ModbusResult ReadScatteredRegisters(
+		const unsigned short* addresses,
+		unsigned char count,
+		unsigned short* values);
+
+	/**
+	 * @brief Encode request once and keep it with its CRC and expected response.
+	 * Later calls of ReadHoldingRegisters() or WriteSingleRegister() with the
+	 * same arguments only hand the stored buffer over to the port.
+	 *
+	 * @param function[in]	- Function code (0x03 or 0x06)
+	 * @param address[in]	- Register Address or Starting Address
+	 * @param value[in]		- Register Value (0x06) or Quantity of Registers (0x03, 1 to 125)
+	 * @return true			- If frame is pinned
+	 * @return false		- If function is not supported or frame cache is full
+	 */
+	bool PinFrame(
+		unsigned char function,
+		unsigned short address,
+		unsigned short value);
+
+	/**
+	 * @brief Set caching policy of register in shadow register file.
+	 * Only registers which are changed by this client only should be cached
+	 * (configuration parameters). Never cache command and status registers.
+	 *
+	 * @param address[in]	- Register Address
+	 * @param policy[in]	- MB_SHADOW_READ, MB_SHADOW_WRITE, both or MB_SHADOW_NONE
+	 * @param ttl[in]		- time to live of cached value in ms (0 - never expires)
+	 * @return true			- If policy is set
+	 * @return false		- If shadow register file is full
+	 */
+	bool SetShadowPolicy(
+		unsigned short address,
+		unsigned char policy,
+		unsigned long ttl = 0);
+
+	/**
+	 * @brief Forget all cached values (e.g. after device restart or keypad changes).
+	 * Policies are kept.
+	 *
+	 */
+	void InvalidateShadowRegisters();
+
+	/**
+	 * @brief Get value which device holds from shadow register file
+	 *
+	 * @param address[in]	- Register Address
+	 * @param value[out]	- pointer to variable where value will be stored
+	 * @return true			- If register is cached and its value is fresh
+	 * @return false		- If value is unknown
+	 */
+	bool GetShadowValue(unsigned short address, unsigned short* value);
+
+	/**
+	 * @brief Get shadow register file counters
+	 *
+	 * @return ModbusShadowStats_t	- hits, misses and skipped writes
+	 */
+	ModbusShadowStats_t GetShadowStats();
+
 	/**
 	 * @brief Set the Number Of Transmit Attempts when frame transfer fails.
 	 * Default value (1) means that after first transmit and its fail an error will be returned.
@@ -177,6 +470,22 @@ public:
 	 * @param attempts[in] - number of repeated transmit attempts
 	 */
 	void SetNumberOfTransmitAttempts(unsigned char attempts = 1);
+
+	/**
+	 * @brief Get time of frame transmission at the current baudrate
+	 *
+	 * @param bytes[in]		- frame size in bytes
+	 * @return double		- transmission time in ms
+	 */
+	double AirTimeMs(unsigned int bytes);
+
+	/**
+	 * @brief Get the clock of transport which response times, shadow registers
+	 * time to live and waits of this client go by
+	 *
+	 * @return Clock&	- time source of transport
+	 */
+	Clock& GetClock();
 };
 
 #endif // MODBUSRTUCLIENT_H
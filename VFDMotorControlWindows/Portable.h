@@ -0,0 +1,44 @@
+/**
+ * @file Portable.h
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Bounds-checked C library functions of MSVC which this program uses.
+ * They are not declared on POSIX hosts, so they are defined here through
+ * standard functions with the same results for the arguments used here
+ * (sscanf_s() is called without string conversions only).
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#ifndef PORTABLE_H
+#define PORTABLE_H
+
+#ifndef _WIN32
+#include <cstdio>	// for 'fopen' and 'sscanf'
+#include <cstring>	// for 'strlen' and 'memcpy'
+#include <cerrno>	// for error codes
+
+inline int fopen_s(FILE** file, const char* fileName, const char* mode)
+{
+	*file = fopen(fileName, mode);
+	return (*file != nullptr) ? 0 : errno;
+}
+
+inline int strcpy_s(char* dest, size_t size, const char* src)
+{
+	size_t len = strlen(src);
+	if (len >= size)
+	{
+		if (size > 0) dest[0] = 0;
+		return ERANGE;
+	}
+	memcpy(dest, src, len + 1);
+	return 0;
+}
+
+#define sscanf_s sscanf
+#endif // _WIN32
+
+#endif // PORTABLE_H
@@ -0,0 +1,178 @@
+#include "RealTime.h"
+#include <cstdio>	// for warnings and statistics printing
+#include <cstdlib>	// for 'malloc' and 'free' of guarded operator new
+#include <cstring>	// for 'strerror' and stack prefault
+#include <cmath>	// for percentiles
+#include <new>		// for 'std::bad_alloc'
+#ifndef _WIN32
+#include <cerrno>		// for error codes
+#include <sched.h>		// for CPU affinity and SCHED_FIFO
+#include <sys/mman.h>	// for 'mlockall'
+#include <unistd.h>		// for number of CPUs
+#ifdef __GLIBC__
+#include <malloc.h>		// for 'mallopt'
+#endif // __GLIBC__
+#endif // _WIN32
+
+//#define NDEBUG
+#include <cassert>
+
+// SCHED_FIFO priority of diagram loop (above IRQ threads of PREEMPT_RT is 50)
+const int realTimePriority = 80;
+// Stack which is touched before the loop so that it never page faults
+const size_t prefaultStackBytes = 64 * 1024;
+
+static volatile bool allocationGuard = false;			// operator new is not allowed
+static volatile unsigned long guardedAllocations = 0;	// allocations while guard is armed
+
+void* operator new(size_t size)
+{
+	if (allocationGuard)
+	{
+		guardedAllocations = guardedAllocations + 1;
+		assert(("operator new: Allocation in real-time loop", 0));
+	}
+	void* p = malloc(size ? size : 1);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void RecordDeadline(DeadlineStats_t* stats, double lateness)
+{
+	if (lateness < 0) lateness = 0;
+	unsigned long bin = (unsigned long)(lateness * 100000);
+	const unsigned long lastBin = sizeof(stats->histogram) / sizeof(stats->histogram[0]) - 1;
+	stats->histogram[(bin < lastBin) ? bin : lastBin]++;
+	stats->count++;
+	if (lateness > missedLateness) stats->missed++;
+	if (lateness > stats->max) stats->max = lateness;
+}
+
+double DeadlinePercentile(const DeadlineStats_t* stats, double part)
+{
+	const unsigned long nBins = sizeof(stats->histogram) / sizeof(stats->histogram[0]);
+	unsigned long rank = (unsigned long)ceil(part * stats->count);
+	unsigned long sum = 0;
+	for (unsigned long i = 0; i < nBins; i++)
+	{
+		sum += stats->histogram[i];
+		if ((sum >= rank) && (sum > 0))
+			return (i == nBins - 1) ? (stats->max * 1000) : (i / 100.0);
+	}
+	return 0;
+}
+
+void PrintDeadlineStats(const DeadlineStats_t* stats)
+{
+	printf("Deadlines: %lu, missed (> %gms): %lu, dropped: %lu\n",
+		stats->count, missedLateness * 1000, stats->missed, stats->dropped);
+	printf("Lateness: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n",
+		DeadlinePercentile(stats, 0.5), DeadlinePercentile(stats, 0.9),
+		DeadlinePercentile(stats, 0.99), stats->max * 1000);
+}
+
+#ifdef _WIN32
+int DefaultRealTimeCPU()
+{
+	return 0;
+}
+
+bool EnterRealTime(int cpu)
+{
+	printf("Warning: real-time mode is supported on Linux only, running with normal priority\n");
+	return false;
+}
+#else
+int DefaultRealTimeCPU()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 1) ? (int)(n - 1) : 0;
+}
+
+bool EnterRealTime(int cpu)
+{
+	bool success = true;
+	// 1) Pin to CPU: no migrations and cold caches
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+	{
+		printf("Warning: can't pin to CPU %d (%s)\n", cpu, strerror(errno));
+		success = false;
+	}
+	// 2) Run before every normal thread of the box
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = realTimePriority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+	{
+		printf("Warning: SCHED_FIFO is not permitted (%s), running with normal priority "
+			"(run as root or set rtprio limit)\n", strerror(errno));
+		success = false;
+	}
+	// 3) Freed heap is kept in the process and is never returned with page faults
+#ifdef __GLIBC__
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif // __GLIBC__
+	// 4) Lock all memory pages (also the ones mapped later)
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		printf("Warning: can't lock memory (%s), pages may be swapped out "
+			"(run as root or set memlock limit)\n", strerror(errno));
+		success = false;
+	}
+	// 5) Touch the stack which the loop will use
+	volatile unsigned char stack[prefaultStackBytes];
+	for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+#ifndef NDEBUG
+	printf("EnterRealTime() CPU %d, SCHED_FIFO %d, %s\n", cpu, realTimePriority,
+		success ? "all steps succeeded" : "some steps were skipped");
+#endif // NDEBUG
+	return success;
+}
+#endif // _WIN32
+
+void GuardAllocations(bool armed)
+{
+	allocationGuard = armed;
+}
+
+unsigned long GuardedAllocations()
+{
+	return guardedAllocations;
+}
+
+AllocationGuardScope::AllocationGuardScope() :
+	armed(false)
+{
+}
+
+AllocationGuardScope::~AllocationGuardScope()
+{
+	Disarm();
+}
+
+void AllocationGuardScope::Arm()
+{
+	armed = true;
+	GuardAllocations(true);
+}
+
+void AllocationGuardScope::Disarm()
+{
+	if (!armed) return;
+	armed = false;
+	GuardAllocations(false);
+}
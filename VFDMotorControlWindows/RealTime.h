@@ -0,0 +1,120 @@
+/**
+ * @file RealTime.h
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Real-time execution of diagram loop (--realtime CLI argument) and
+ * lateness statistics of its deadlines.
+ * On Linux the thread is pinned to one CPU and runs under SCHED_FIFO with all
+ * memory locked. Every step which is not permitted is skipped with a warning.
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+// Lateness of wake ups of a periodic loop
+typedef struct {
+	unsigned long	count;		// number of deadlines
+	unsigned long	missed;		// deadlines served later than missedLateness
+	unsigned long	dropped;	// periodic work dropped because previous work took too long
+	double			max;		// maximal lateness in seconds
+	unsigned long	histogram[2001];	// lateness in 10 us bins (the last bin - 20 ms and more)
+} DeadlineStats_t;
+
+// Deadline served later than this is missed (seconds)
+const double missedLateness = 0.01;
+
+/**
+ * @brief Add lateness of one wake up into statistics
+ *
+ * @param stats[in,out]	- statistics of the run
+ * @param lateness[in]	- time from deadline to wake up in seconds
+ */
+void RecordDeadline(DeadlineStats_t* stats, double lateness);
+
+/**
+ * @brief Get lateness which is not exceeded by the given part of wake ups
+ *
+ * @param stats[in]		- statistics of the run
+ * @param part[in]		- part of wake ups (0.5 - median)
+ * @return double		- lateness in ms (rounded down to 0.01 ms)
+ */
+double DeadlinePercentile(const DeadlineStats_t* stats, double part);
+
+/**
+ * @brief Print lateness percentiles and missed deadlines of the run
+ *
+ * @param stats[in]	- statistics of the run
+ */
+void PrintDeadlineStats(const DeadlineStats_t* stats);
+
+/**
+ * @brief Get CPU for real-time thread when it is not specified
+ *
+ * @return int	- the last online CPU (the first one gets most of interrupts)
+ */
+int DefaultRealTimeCPU();
+
+/**
+ * @brief Switch calling thread into real-time execution:
+ * pin it to the CPU, set SCHED_FIFO priority, lock current and future memory,
+ * keep freed heap memory in the process and prefault stack.
+ * Call it when everything the loop needs is allocated.
+ *
+ * @param cpu[in]	- CPU number to run on
+ * @return true		- if all steps succeeded
+ * @return false	- if some steps were skipped (warnings are printed)
+ */
+bool EnterRealTime(int cpu);
+
+/**
+ * @brief Arm or disarm allocation guard. Allocation with operator new while
+ * the guard is armed is a bug of real-time loop: it asserts in debug build
+ * and is counted in release build
+ *
+ * @param armed[in]	- true to arm the guard
+ */
+void GuardAllocations(bool armed);
+
+/**
+ * @brief Get number of allocations made while the guard was armed
+ *
+ * @return unsigned long	- number of allocations
+ */
+unsigned long GuardedAllocations();
+
+/**
+ * @brief Allocation guard of one scope: the guard armed with Arm() is disarmed
+ * when the scope is left, so every return path of real-time loop disarms it
+ *
+ */
+class AllocationGuardScope
+{
+private:
+	bool	armed;	// the guard is armed by this scope
+public:
+	AllocationGuardScope();
+
+	/**
+	 * @brief Disarm the guard if it is armed by this scope
+	 *
+	 */
+	~AllocationGuardScope();
+
+	/**
+	 * @brief Arm the guard (see GuardAllocations())
+	 *
+	 */
+	void Arm();
+
+	/**
+	 * @brief Disarm the guard before the scope is left
+	 *
+	 */
+	void Disarm();
+};
+
+#endif // REALTIME_H
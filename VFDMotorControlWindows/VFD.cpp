@@ -5,141 +5,322 @@
 #include <cassert>
 #ifndef NDEBUG
 #include <cstdio>   // for debug printing
-#include <ctime>    // for transfer time measure
 #endif // NDEBUG
 
-VFD::VFD(ModbusRTUClient mb /* = { 1, {portName, 9600, 8, 'E', 1} } */) :
+template <class Transport>
+VFD<Transport>::VFD(ModbusRTUClient<Transport> mb /* = { 1, {portName, 9600, 8, 'E', 1} } */) :
 	MB(mb),
 	maxFrequency(50.0)
 {
+	writeTime[0] = 0;
+	writeTime[1] = 0;
+	// Configuration parameters are changed by this program only, so the shadow
+	// register file holds their values. Command register 0x2000 is never cached:
+	// every command has to reach VFD and feeds its watchdog. Frequency command
+	// 0x2001 is not cached either: keypad, analog input, fault or watchdog stop may change it.
+	MB.SetShadowPolicy(0x0100, MB_SHADOW_READ | MB_SHADOW_WRITE, 60000); // 01-00 max frequency
+	MB.SetShadowPolicy(0x0109, MB_SHADOW_WRITE);	// 01-09 acceleration time
+	MB.SetShadowPolicy(0x010A, MB_SHADOW_WRITE);	// 01-10 deceleration time
+	MB.SetShadowPolicy(0x0902, MB_SHADOW_WRITE);	// 09-02 reaction on watchdog timeout
+	MB.SetShadowPolicy(0x0903, MB_SHADOW_WRITE);	// 09-03 watchdog timeout
+	// Hot fixed commands are encoded once: run in every direction, stop
+	// and status read used by ReadParameterRegisters()
+	for (unsigned short direction = 0; direction <= 3; direction++)
+		MB.PinFrame(0x06, 0x2000, RunCommand(direction));
+	MB.PinFrame(0x06, 0x2000, StopCommand());
+	MB.PinFrame(0x03, 0x2101, 12);
 #ifndef NDEBUG
 	printf("VFD::Constructor() Created instance 0x%p with params:\n", this);
 	printf("- MB: 0x%p\n", &(this->MB));
 #endif // NDEBUG
 }
 
-VFD::~VFD()
+template <class Transport>
+VFD<Transport>::~VFD()
 {
 #ifndef NDEBUG
 	printf("VFD::Destructor() Deleted instance 0x%p\n", this);
 #endif // NDEBUG
 }
 
-bool VFD::Run(unsigned short direction /* = 0 */)
+template <class Transport>
+unsigned short VFD<Transport>::RunCommand(unsigned short direction)
 {
-#ifndef NDEBUG
-	clock_t start_time = clock();
-#endif // NDEBUG
 	if (direction > 3) direction = 0; // Prevent invalid direction parameter set
 	unsigned short command = 0;
 	// Set start bit
 	command |= 1 << 1;
 	// Set direction bits
 	command |= direction << 4;
-	if (!MB.WriteSingleRegister(0x2000, command))
+	return command;
+}
+
+template <class Transport>
+unsigned short VFD<Transport>::StopCommand()
+{
+	unsigned short command = 0;
+	// Set stop bit
+	command |= 1 << 0;
+	return command;
+}
+
+template <class Transport>
+unsigned short VFD<Transport>::FrequencyRegister(double freq)
+{
+	// restrict values according to VFD-B_manual_rus.pdf
+	if (freq < 0) freq = 0;
+	if (freq > maxFrequency) freq = maxFrequency;
+	return (unsigned short)round(freq * 100.0);
+}
+
+template <class Transport>
+unsigned short VFD<Transport>::RampTimeRegister(double time)
+{
+	// restrict values according to VFD-B_manual_rus.pdf
+	if (time < 0.1) time = 0.1;
+	if (time > 3600) time = 3600;
+	return (unsigned short)round(time * 10.0);
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::Run(unsigned short direction /* = 0 */)
+{
+#ifndef NDEBUG
+	double start_time = MB.GetClock().Now();
+#endif // NDEBUG
+	ModbusResult result = MB.WriteSingleRegister(0x2000, RunCommand(direction));
+	if (!result)
 	{
-		assert(("VFD::Run() Run error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::Run() Run error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 #ifndef NDEBUG
-	printf("VFD::Run() Success in %ldms\n",
-		(clock() - start_time));
+	printf("VFD::Run() Success in %gms\n",
+		(MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::Stop()
+template <class Transport>
+ModbusResult VFD<Transport>::RunWithFrequency(double freq, unsigned short direction /* = 0 */)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
-	unsigned short command = 0;
-	// Set stop bit
-	command |= 1 << 0;
-	if (!MB.WriteSingleRegister(0x2000, command))
+	// 0x2000 - command, 0x2001 - frequency command
+	unsigned short regVal[2] = { RunCommand(direction), FrequencyRegister(freq) };
+	ModbusResult result = MB.WriteMultipleRegisters(0x2000, 2, regVal);
+	if (!result)
+	{
+#ifndef NDEBUG
+		printf("VFD::RunWithFrequency() Run error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
+	}
+#ifndef NDEBUG
+	printf("VFD::RunWithFrequency() Success (%gHz) in %gms\n",
+		freq, (MB.GetClock().Now() - start_time) * 1000);
+#endif // NDEBUG
+	return result;
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::Stop()
+{
+#ifndef NDEBUG
+	double start_time = MB.GetClock().Now();
+#endif // NDEBUG
+	ModbusResult result = MB.WriteSingleRegister(0x2000, StopCommand());
+	if (!result)
 	{
-		assert(("VFD::Run() Stop error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::Stop() Stop error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
-	if (!SetWatchdog(0)) return false;
+	result = SetWatchdog(0);
+	if (!result) return result;
 #ifndef NDEBUG
-	printf("VFD::Stop() Success in %ldms\n",
-		(clock() - start_time));
+	printf("VFD::Stop() Success in %gms\n",
+		(MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::ChangeFrequency(
+template <class Transport>
+ModbusResult VFD<Transport>::ChangeFrequency(
 	double curFreq /* = 0 */,
 	double newFreq /* = 50 */,
 	double changeTime /* = 1 */)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
+#endif // NDEBUG
+	VFD_drive_state_t state;
+	ReadDriveState(&state);
+	VFD_write_t writes[VFD_MAX_TRANSITION_WRITES];
+	unsigned char nWrites = PlanTransition(&state, maxFrequency, curFreq, newFreq, changeTime, writes);
+	ModbusResult result = ExecuteWrites(writes, nWrites);
+	if (!result) return result;
+#ifndef NDEBUG
+	printf("VFD::ChangeFrequency() Frequency changed in %gms\n",
+		(MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	if (fabs(newFreq - curFreq) < 0.1) return true; // new frequency remains the same
-	// Acceleration or deceleration time
-	double accDecTime = maxFrequency * changeTime / fabs(newFreq - curFreq);
-	if ((curFreq * newFreq) < 0) // Direction changes
+	return result;
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::PrepareFrequencyChange(
+	double curFreq,
+	double newFreq,
+	double changeTime,
+	bool* written /* = nullptr */)
+{
+	VFD_drive_state_t state;
+	ReadDriveState(&state);
+	VFD_write_t writes[VFD_MAX_TRANSITION_WRITES];
+	unsigned char nWrites = PlanTransition(&state, maxFrequency, curFreq, newFreq, changeTime, writes);
+	// Ramp time is always the first write, command and frequency are left for the change itself
+	bool send = (nWrites > 0) && ((writes[0].address == 0x0109) || (writes[0].address == 0x010A));
+	if (written != nullptr) *written = send;
+	if (send) return ExecuteWrites(writes, 1);
+	return ModbusResult();
+}
+
+template <class Transport>
+unsigned char VFD<Transport>::RampParameters(double curFreq, double newFreq)
+{
+	if (fabs(newFreq - curFreq) < 0.1) return VFD_RAMP_NONE;
+	if ((curFreq * newFreq) < 0) return VFD_RAMP_ACCELERATION | VFD_RAMP_DECELERATION; // Direction changes
+	// Motor frequency increases or decreases
+	return (fabs(newFreq) > fabs(curFreq)) ? VFD_RAMP_ACCELERATION : VFD_RAMP_DECELERATION;
+}
+
+template <class Transport>
+unsigned char VFD<Transport>::PlanTransition(
+	const VFD_drive_state_t* state,
+	double maxFreq,
+	double curFreq,
+	double newFreq,
+	double changeTime,
+	VFD_write_t* writes)
+{
+	unsigned char ramp = RampParameters(curFreq, newFreq);
+	if (ramp == VFD_RAMP_NONE) return 0; // new frequency remains the same
+	unsigned char nWrites = 0;
+	// 1) Acceleration or deceleration time (01-09 and 01-10 are neighbours)
+	unsigned short rampTime = RampTimeRegister(maxFreq * changeTime / fabs(newFreq - curFreq));
+	bool writeAcc = (ramp & VFD_RAMP_ACCELERATION) && !(state->accKnown && (state->acc == rampTime));
+	bool writeDec = (ramp & VFD_RAMP_DECELERATION) && !(state->decKnown && (state->dec == rampTime));
+	if (writeAcc || writeDec)
 	{
-		if (!SetDecelerationTime(accDecTime) || !SetAccelerationTime(accDecTime))
-			return false;
-		// Run motor in the different direction
-		if (!Run(3)) return false;
-		// Set new frequency
-		if (!SetFrequency(fabs(newFreq))) return false;
+		VFD_write_t* write = &writes[nWrites++];
+		write->address = writeAcc ? 0x0109 : 0x010A;
+		write->count = (writeAcc && writeDec) ? 2 : 1;
+		write->values[0] = rampTime;
+		write->values[1] = rampTime;
 	}
-	else // Direction remains the same
+	// 2) Frequency (restricted as FrequencyRegister()) and run command when direction is set
+	double freq = fabs(newFreq);
+	if (freq > maxFreq) freq = maxFreq;
+	unsigned short setpoint = (unsigned short)round(freq * 100.0);
+	bool directionChanges = (ramp == (VFD_RAMP_ACCELERATION | VFD_RAMP_DECELERATION));
+	if (directionChanges || (fabs(curFreq) < 0.1)) // Direction changes or start from zero
 	{
-		// Set new acceleration/deceleration time
-		if (fabs(newFreq) > fabs(curFreq)) // Motor frequency increases
-		{
-			if (!SetAccelerationTime(accDecTime)) return false;
-		}
-		else // Motor frequency decreases
-		{
-			if (!SetDecelerationTime(accDecTime)) return false;
-		}
-		// Set new frequency 
-		if (!SetFrequency(fabs(newFreq))) return false;
-
-		if (fabs(curFreq) < 0.1) // If start from zero
-		{
-			if (newFreq > 0) // Run forward
-			{
-				if (!Run(1)) return false;
-			}
-			else			// Run reverse
-			{
-				if (!Run(2)) return false;
-			}
-		}
+		// 0x2000 - command, 0x2001 - frequency command
+		VFD_write_t* write = &writes[nWrites++];
+		write->address = 0x2000;
+		write->count = 2;
+		write->values[0] = RunCommand((newFreq > 0) ? 1 : 2);
+		write->values[1] = setpoint;
 	}
-#ifndef NDEBUG
-	printf("VFD::ChangeFrequency() Frequency changed in %ldms\n",
-		(clock() - start_time));
-#endif // NDEBUG
-	return true;
+	else
+	{
+		VFD_write_t* write = &writes[nWrites++];
+		write->address = 0x2001;
+		write->count = 1;
+		write->values[0] = setpoint;
+	}
+	return nWrites;
 }
 
-bool VFD::ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param)
+template <class Transport>
+void VFD<Transport>::ReadDriveState(VFD_drive_state_t* state)
 {
-	const unsigned short firstReg = 0x2101; // fisrt register to start reading
-	const unsigned char nReg = 12; // number of registers to read
-	unsigned short regArray[nReg]; // array to store registers values
+	state->accKnown = MB.GetShadowValue(0x0109, &state->acc);
+	state->decKnown = MB.GetShadowValue(0x010A, &state->dec);
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::ExecuteWrites(const VFD_write_t* writes, unsigned char nWrites)
+{
+	ModbusResult result;
+	for (unsigned char i = 0; i < nWrites; i++)
+	{
 #ifndef NDEBUG
-	clock_t start_time = clock();
+		printf("VFD::ExecuteWrites() Write %u of %u: %u registers from 0x%04X\n",
+			i + 1, nWrites, writes[i].count, writes[i].address);
 #endif // NDEBUG
-	// Read registers
-		if (!MB.ReadHoldingRegisters(firstReg, nReg, regArray))
-	{
-		assert(("VFD::ReadParameterRegisters() Read registers error", 0));
-		return false;
-	}
+		double start = MB.GetClock().Now();
+		if (writes[i].count == 1) result = MB.WriteSingleRegister(writes[i].address, writes[i].values[0]);
+		else result = MB.WriteMultipleRegisters(writes[i].address, writes[i].count, writes[i].values);
+		if (!result)
+		{
 #ifndef NDEBUG
-	printf("VFD::ReadParameterRegisters() Read %u parameters in %ldms\n",
-		nReg, (clock() - start_time));
+			printf("VFD::ExecuteWrites() Write error: %s\n", result.Describe());
 #endif // NDEBUG
+			return result;
+		}
+		UpdateWriteTime(writes[i].count, MB.GetClock().Now() - start);
+	}
+	return result;
+}
+
+template <class Transport>
+void VFD<Transport>::UpdateWriteTime(unsigned char count, double time)
+{
+	if (time <= 0) return; // write was skipped by shadow register file
+	double* estimate = &writeTime[(count == 1) ? 0 : 1];
+	if (*estimate == 0) *estimate = time;
+	else *estimate += VFD_WRITE_TIME_SMOOTHING * (time - *estimate);
+}
+
+template <class Transport>
+double VFD<Transport>::WriteTime(unsigned char count)
+{
+	unsigned char i = (count == 1) ? 0 : 1;
+	return (writeTime[i] > 0) ? writeTime[i] : writeTime[1 - i];
+}
+
+template <class Transport>
+double VFD<Transport>::WriteAirTime(unsigned char count)
+{
+	// 0x06: request and echo of 8 bytes, 0x10: request of 9 + 2 * count bytes and response of 8 bytes
+	unsigned int bytes = (count == 1) ? 16 : (17 + 2 * count);
+	return MB.AirTimeMs(bytes) / 1000.0;
+}
+
+template <class Transport>
+double VFD<Transport>::TransitionDelay(double curFreq, double newFreq, double changeTime)
+{
+	VFD_drive_state_t state;
+	ReadDriveState(&state);
+	VFD_write_t writes[VFD_MAX_TRANSITION_WRITES];
+	unsigned char nWrites = PlanTransition(&state, maxFrequency, curFreq, newFreq, changeTime, writes);
+	double delay = 0;
+	for (unsigned char i = 0; i < nWrites; i++) delay += WriteTime(writes[i].count);
+	return delay;
+}
+
+template <class Transport>
+void VFD<Transport>::DecodeParameterRegisters(
+	const unsigned short* regArray,
+	VFD_status_t* status,
+	VFD_param_t* param)
+{
+	const unsigned short firstReg = 0x2101; // address of regArray[0]
 	// Fill status structure
 	status->LED.RUN = (regArray[0] >> 0) & 0x1;
 	status->LED.STOP = (regArray[0] >> 1) & 0x1;
@@ -156,7 +337,7 @@ bool VFD::ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param)
 	status->VFDCurrentState = (regArray[0] >> 12) & 0x1;
 	status->JOGcommand = (regArray[0] >> 13) & 0x1;
 #ifndef NDEBUG
-	printf("VFD::ReadParameterRegisters() Status:\n");
+	printf("VFD::DecodeParameterRegisters() Status:\n");
 	printf("- LED: {RUN: %u, STOP: %u, JOG: %u, FWD: %u, REW: %u}\n",
 		status->LED.RUN, status->LED.STOP, status->LED.JOG, status->LED.FWD, status->LED.REW);
 	printf("- F: %u, H: %u, u: %u\n",
@@ -185,7 +366,7 @@ bool VFD::ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param)
 		param->MotorSpeed *= -1;
 	}
 #ifndef NDEBUG
-	printf("VFD::ReadParameterRegisters() Parameters:\n");
+	printf("VFD::DecodeParameterRegisters() Parameters:\n");
 	printf("- FrequencyCommand: %gHz\n", param->FrequencyCommand);
 	printf("- OutFrequency: %gHz\n", param->OutFrequency);
 	printf("- OutCurrent: %gA\n", param->OutCurrent);
@@ -196,188 +377,323 @@ bool VFD::ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param)
 	printf("- MotorSpeed: %grpm\n", param->MotorSpeed);
 	//printf("- OutPower: %gkW\n", param->OutPower);
 #endif // NDEBUG
-	return true;
 }
 
-bool VFD::GetOutPower(double* power)
+template <class Transport>
+ModbusResult VFD<Transport>::ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param)
+{
+	const unsigned short firstReg = 0x2101; // fisrt register to start reading
+	const unsigned char nReg = 12; // number of registers to read
+	unsigned short regArray[nReg]; // array to store registers values
+#ifndef NDEBUG
+	double start_time = MB.GetClock().Now();
+#endif // NDEBUG
+	// Read registers
+	ModbusResult result = MB.ReadHoldingRegisters(firstReg, nReg, regArray);
+	if (!result)
+	{
+#ifndef NDEBUG
+		printf("VFD::ReadParameterRegisters() Read registers error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
+	}
+#ifndef NDEBUG
+	printf("VFD::ReadParameterRegisters() Read %u parameters in %gms\n",
+		nReg, (MB.GetClock().Now() - start_time) * 1000);
+#endif // NDEBUG
+	DecodeParameterRegisters(regArray, status, param);
+	return result;
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::ReadParameters(
+	VFD_status_t* status,
+	VFD_param_t* param,
+	double* power /* = nullptr */,
+	double* temp /* = nullptr */,
+	unsigned short regAddress /* = 0 */,
+	unsigned short* regValue /* = nullptr */)
+{
+#ifndef NDEBUG
+	double start_time = MB.GetClock().Now();
+#endif // NDEBUG
+	// 0x2101-0x210C first, then optional registers
+	unsigned short addresses[12 + 3];
+	unsigned short regArray[12 + 3];
+	unsigned char nReg = 0;
+	for (; nReg < 12; nReg++) addresses[nReg] = 0x2101 + nReg;
+	unsigned char powerIndex = nReg;
+	if (power != nullptr) addresses[nReg++] = 0x210F;
+	unsigned char tempIndex = nReg;
+	if (temp != nullptr) addresses[nReg++] = 0x2206;
+	unsigned char regIndex = nReg;
+	if (regValue != nullptr) addresses[nReg++] = regAddress;
+	// Read registers
+	ModbusResult result = MB.ReadScatteredRegisters(addresses, nReg, regArray);
+	if (!result)
+	{
+#ifndef NDEBUG
+		printf("VFD::ReadParameters() Read registers error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
+	}
+	DecodeParameterRegisters(regArray, status, param);
+	if (power != nullptr) *power = regArray[powerIndex] / 10.0;
+	if (temp != nullptr) *temp = regArray[tempIndex] / 1.0;
+	if (regValue != nullptr) *regValue = regArray[regIndex];
+#ifndef NDEBUG
+	printf("VFD::ReadParameters() Read %u registers in %gms\n",
+		nReg, (MB.GetClock().Now() - start_time) * 1000);
+#endif // NDEBUG
+	return result;
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::GetOutPower(double* power)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
 	unsigned short regValue;
-	if (!MB.ReadHoldingRegisters(0x210F, 1, &regValue))
+	ModbusResult result = MB.ReadHoldingRegisters(0x210F, 1, &regValue);
+	if (!result)
 	{
-		assert(("VFD::GetOutPower() Read power error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::GetOutPower() Read power error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 	*power = regValue / 10.0;
 #ifndef NDEBUG
-	printf("VFD::GetOutPower() Read power: %gdegC in %ldms\n",
-		*power, (clock() - start_time));
+	printf("VFD::GetOutPower() Read power: %gdegC in %gms\n",
+		*power, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::GetVFDTemperature(double* temp)
+template <class Transport>
+ModbusResult VFD<Transport>::GetVFDTemperature(double* temp)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
 	unsigned short regValue;
-	if (!MB.ReadHoldingRegisters(0x2206, 1, &regValue))
+	ModbusResult result = MB.ReadHoldingRegisters(0x2206, 1, &regValue);
+	if (!result)
 	{
-		assert(("VFD::GetVFDTemperature() Read temperature error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::GetVFDTemperature() Read temperature error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 	*temp = regValue / 1.0;
 #ifndef NDEBUG
-	printf("VFD::GetVFDTemperature() Read temperature: %gdegC in %ldms\n",
-		*temp, (clock() - start_time));
+	printf("VFD::GetVFDTemperature() Read temperature: %gdegC in %gms\n",
+		*temp, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::ReadMaxFrequency(double* maxFreq /* = nullptr */)
+template <class Transport>
+ModbusResult VFD<Transport>::ReadMaxFrequency(double* maxFreq /* = nullptr */)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
 	unsigned short regValue;
-	if (!MB.ReadHoldingRegisters(0x0100, 1, &regValue)) // (read 01-00 parameter)
+	ModbusResult result = MB.ReadHoldingRegisters(0x0100, 1, &regValue); // (read 01-00 parameter)
+	if (!result)
 	{
-		assert(("VFD::ReadMaxFrequency() Read max frequency error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::ReadMaxFrequency() Read max frequency error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 	maxFrequency = regValue / 100.0;
 	if (maxFreq != nullptr) *maxFreq = maxFrequency;
 #ifndef NDEBUG
-	printf("VFD::ReadMaxFrequency() Read max frequency: %gHz in %ldms\n",
-		maxFrequency, (clock() - start_time));
+	printf("VFD::ReadMaxFrequency() Read max frequency: %gHz in %gms\n",
+		maxFrequency, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::SetFrequency(double freq)
+template <class Transport>
+ModbusResult VFD<Transport>::SetFrequency(double freq)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
 	// restrict values according to VFD-B_manual_rus.pdf
 	if (freq < 0) freq = 0;
 	if (freq > maxFrequency) freq = maxFrequency;
-	unsigned short regVal = (unsigned short)round(freq * 100.0);
-	if (!MB.WriteSingleRegister(0x2001, regVal))
+	ModbusResult result = MB.WriteSingleRegister(0x2001, FrequencyRegister(freq));
+	if (!result)
 	{
-		assert(("VFD::SetFrequency() Set frequency error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::SetFrequency() Set frequency error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 #ifndef NDEBUG
-	printf("VFD::SetFrequency() Frequency %gHz set in %ldms\n",
-		freq, (clock() - start_time));
+	printf("VFD::SetFrequency() Frequency %gHz set in %gms\n",
+		freq, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::SetAccelerationTime(double time)
+template <class Transport>
+ModbusResult VFD<Transport>::SetAccelerationTime(double time)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
 	// restrict values according to VFD-B_manual_rus.pdf
 	if (time < 0.1) time = 0.1;
 	if (time > 3600) time = 3600;
-	unsigned short regVal = (unsigned short)round(time * 10.0);
-	if (!MB.WriteSingleRegister(0x0109, regVal)) // (write 01-09 parameter)
+	ModbusResult result = MB.WriteSingleRegister(0x0109, RampTimeRegister(time)); // (write 01-09 parameter)
+	if (!result)
 	{
-		assert(("VFD::SetAccelerationTime() Set acceleration time error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::SetAccelerationTime() Set acceleration time error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 #ifndef NDEBUG
-	printf("VFD::SetAccelerationTime() Acceleration time %gs set in %ldms\n",
-		time, (clock() - start_time));
+	printf("VFD::SetAccelerationTime() Acceleration time %gs set in %gms\n",
+		time, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::SetDecelerationTime(double time)
+template <class Transport>
+ModbusResult VFD<Transport>::SetDecelerationTime(double time)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
 	// restrict values according to VFD-B_manual_rus.pdf
 	if (time < 0.1) time = 0.1;
 	if (time > 3600) time = 3600;
-	unsigned short regVal = (unsigned short)round(time * 10.0);
-	if (!MB.WriteSingleRegister(0x010A, regVal)) // (write 01-10 parameter)
+	ModbusResult result = MB.WriteSingleRegister(0x010A, RampTimeRegister(time)); // (write 01-10 parameter)
+	if (!result)
 	{
-		assert(("VFD::SetDecelerationTime() Set deceleration time error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::SetDecelerationTime() Set deceleration time error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 #ifndef NDEBUG
-	printf("VFD::SetDecelerationTime() Deceleration time %gs set in %ldms\n",
-		time, (clock() - start_time));
+	printf("VFD::SetDecelerationTime() Deceleration time %gs set in %gms\n",
+		time, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::SetWatchdog(double time  /* = 0 */)
+template <class Transport>
+ModbusResult VFD<Transport>::SetAccDecTime(double time)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
+	unsigned short regVal[2] = { RampTimeRegister(time), RampTimeRegister(time) };
+	ModbusResult result = MB.WriteMultipleRegisters(0x0109, 2, regVal); // (write 01-09 and 01-10 parameters)
+	if (!result)
+	{
+#ifndef NDEBUG
+		printf("VFD::SetAccDecTime() Set acceleration and deceleration time error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
+	}
+#ifndef NDEBUG
+	printf("VFD::SetAccDecTime() Acceleration and deceleration time %gs set in %gms\n",
+		regVal[0] / 10.0, (MB.GetClock().Now() - start_time) * 1000);
+#endif // NDEBUG
+	return result;
+}
+
+template <class Transport>
+ModbusResult VFD<Transport>::SetWatchdog(double time  /* = 0 */)
+{
+	double start_time = MB.GetClock().Now(); // also for write time estimate
 	// restrict values according to VFD-B_manual_rus.pdf
 	if (time < 0.0) time = 0.0;
 	if (time > 60.0) time = 60.0;
-	unsigned short regVal = (unsigned short)round(time * 10.0);
-	if (!MB.WriteSingleRegister(0x0903, regVal)) // (write 09-03 parameter)
-	{
-		assert(("VFD::SetWatchdog() Set watchdog time error", 0));
-		return false;
-	}
-	if (time > 0) regVal = 02;	// Warn and COAST to stop
-	else regVal = 03;			// No warning and keep operating
-	if (!MB.WriteSingleRegister(0x0902, regVal)) // (write 09-02 parameter)
+	unsigned short regVal[2];
+	if (time > 0) regVal[0] = 02;	// Warn and COAST to stop
+	else regVal[0] = 03;			// No warning and keep operating
+	regVal[1] = (unsigned short)round(time * 10.0);
+	// 09-02 (reaction on timeout) and 09-03 (timeout) parameters with one request
+	ModbusResult result = MB.WriteMultipleRegisters(0x0902, 2, regVal);
+	if (!result)
 	{
-		assert(("VFD::SetWatchdog() Switch watchdog error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::SetWatchdog() Set watchdog error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
+	UpdateWriteTime(2, MB.GetClock().Now() - start_time);
 #ifndef NDEBUG
-	printf("VFD::SetWatchdog() Watchdog time %gs set in %ldms\n",
-		time, (clock() - start_time));
+	printf("VFD::SetWatchdog() Watchdog time %gs set in %gms\n",
+		time, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::GetParam(unsigned short addr, unsigned short* val)
+template <class Transport>
+ModbusResult VFD<Transport>::GetParam(unsigned short addr, unsigned short* val)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
-	if (!MB.ReadHoldingRegisters(addr, 1, val))
+	ModbusResult result = MB.ReadHoldingRegisters(addr, 1, val);
+	if (!result)
 	{
-		assert(("VFD::GetParam() Get parameter error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::GetParam() Get parameter error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 #ifndef NDEBUG
-	printf("VFD::GetParam() Parameter 0x%04X: 0x%04X read in %ldms\n",
-		addr, *val,  (clock() - start_time));
+	printf("VFD::GetParam() Parameter 0x%04X: 0x%04X read in %gms\n",
+		addr, *val,  (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
-bool VFD::SetParam(unsigned short addr, unsigned short val)
+template <class Transport>
+ModbusResult VFD<Transport>::SetParam(unsigned short addr, unsigned short val)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = MB.GetClock().Now();
 #endif // NDEBUG
-	if (!MB.WriteSingleRegister(addr, val))
+	ModbusResult result = MB.WriteSingleRegister(addr, val);
+	if (!result)
 	{
-		assert(("VFD::SetParam() Set parameter error", 0));
-		return false;
+#ifndef NDEBUG
+		printf("VFD::SetParam() Set parameter error: %s\n", result.Describe());
+#endif // NDEBUG
+		return result;
 	}
 #ifndef NDEBUG
-	printf("VFD::SetParam() Parameter 0x%04X: 0x%04X set in %ldms\n",
-		addr, val, (clock() - start_time));
+	printf("VFD::SetParam() Parameter 0x%04X: 0x%04X set in %gms\n",
+		addr, val, (MB.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
+}
+
+template <class Transport>
+ModbusShadowStats_t VFD<Transport>::GetShadowStats()
+{
+	return MB.GetShadowStats();
 }
+
+template <class Transport>
+Clock& VFD<Transport>::GetClock()
+{
+	return MB.GetClock();
+}
+
+// Transports used by this program
+template class VFD<COMPort>;
+template class VFD<COMPortFake>;
@@ -13,7 +13,33 @@
 #ifndef VFD_H
 #define VFD_H
 
-#include "ModbusRTUClient.h"
+#include "ModbusRTUclient.h"
+
+// Ramp time parameters used by frequency change (can be combined)
+const unsigned char VFD_RAMP_NONE = 0x00;			// frequency remains the same
+const unsigned char VFD_RAMP_ACCELERATION = 0x01;	// 01-09 acceleration time
+const unsigned char VFD_RAMP_DECELERATION = 0x02;	// 01-10 deceleration time
+
+// Frequency change is never more than one ramp time write and one command write
+const unsigned char VFD_MAX_TRANSITION_WRITES = 2;
+
+// Weight of the last write in round trip time estimate (exponential average)
+const double VFD_WRITE_TIME_SMOOTHING = 0.25;
+
+// Register write planned by VFD::PlanTransition()
+typedef struct {
+	unsigned short	address;	// first register
+	unsigned char	count;		// number of registers (1 - 0x06 request, 2 - 0x10 request)
+	unsigned short	values[2];	// register values
+} VFD_write_t;
+
+// Register values the client knows the drive holds
+typedef struct {
+	bool			accKnown;		// 01-09 value is known
+	unsigned short	acc;			// 01-09 acceleration time
+	bool			decKnown;		// 01-10 value is known
+	unsigned short	dec;			// 01-10 deceleration time
+} VFD_drive_state_t;
 
 // Stores VFD status from 0x2101 register
 typedef struct VFD_status {
@@ -47,18 +73,93 @@ typedef struct VFD_param {
 	double MotorSpeed;		// 0x210C
 } VFD_param_t;
 
+/**
+ * @brief Delta VFD-B drive on top of ModbusRTUClient.
+ * Instantiated for COMPort and COMPortFake in VFD.cpp.
+ *
+ * @tparam Transport	- port class of ModbusRTUClient (COMPort, COMPortFake)
+ */
+template <class Transport>
 class VFD
 {
 private:
-	ModbusRTUClient MB;             // Instance of ModbusRTUClient class
+	ModbusRTUClient<Transport> MB;  // Instance of ModbusRTUClient class
     double          maxFrequency;   // Maximum output motor frequency (01-00 value, default 50Hz)
+	double			writeTime[2];	// Round trip time estimate of 0x06 and 0x10 writes in seconds (0 - not measured)
+
+	/**
+	 * @brief Create run command for 0x2000 register
+	 *
+	 * @param direction[in]		- 0 - no change, 1 - forward, 2 - reverse, 3 - change
+	 * @return unsigned short	- register value
+	 */
+	static unsigned short RunCommand(unsigned short direction);
+
+	/**
+	 * @brief Fill drive state from shadow register file
+	 *
+	 * @param state[out]	- pointer to structure where state will be stored
+	 */
+	void ReadDriveState(VFD_drive_state_t* state);
+
+	/**
+	 * @brief Send planned writes in their order
+	 *
+	 * @param writes[in]	- writes planned by PlanTransition()
+	 * @param nWrites[in]	- number of writes
+	 * @return ModbusResult - all writes success, otherwise failure of the first failed one
+	 */
+	ModbusResult ExecuteWrites(const VFD_write_t* writes, unsigned char nWrites);
+
+	/**
+	 * @brief Add round trip time of successful write into estimate
+	 *
+	 * @param count[in]	- number of written registers (1 - 0x06 request, 2 - 0x10 request)
+	 * @param time[in]	- time from request start to response end in seconds
+	 */
+	void UpdateWriteTime(unsigned char count, double time);
+
+	/**
+	 * @brief Create stop command for 0x2000 register
+	 *
+	 * @return unsigned short	- register value
+	 */
+	static unsigned short StopCommand();
+
+	/**
+	 * @brief Convert frequency into 0x2001 register value (restricted by maxFrequency)
+	 *
+	 * @param freq[in]			- frequency in Hz
+	 * @return unsigned short	- register value
+	 */
+	unsigned short FrequencyRegister(double freq);
+
+	/**
+	 * @brief Convert acceleration or deceleration time into 01-09 or 01-10 parameter value
+	 *
+	 * @param time[in]			- time in seconds
+	 * @return unsigned short	- register value
+	 */
+	static unsigned short RampTimeRegister(double time);
+
+	/**
+	 * @brief Fill status and parameters structures from values of registers 0x2101-0x210C
+	 *
+	 * @param regArray[in]	- values of 12 registers starting from 0x2101
+	 * @param status[out]	- pointer to structure where status will be stored
+	 * @param param[out]	- pointer to structure where parameters will be stored
+	 */
+	static void DecodeParameterRegisters(
+		const unsigned short* regArray,
+		VFD_status_t* status,
+		VFD_param_t* param);
 public:
 	/**
 	 * @brief Construct a new VFD object. Set device communication parameters
 	 *
 	 * @param mb[in] - ModbusRTUClient class instance with its parameters
 	 */
-	VFD(ModbusRTUClient mb = { 1, {"COM3", 9600, 8, 'E', 1} });
+	VFD(ModbusRTUClient<Transport> mb = { 1, {"COM3", 9600, 8, 'E', 1} });
 
 	/**
 	 * @brief Destroy the VFD object
@@ -72,18 +173,26 @@ public:
 	 * 0 - no change, 1 - forward, 2 - reverse, 3 - change
      * 
      * @param direction[in]	- Set rotation direction (default: 0 - no change)
-     * @return true         - Run success
-     * @return false        - Run fail
+     * @return ModbusResult - Run success, otherwise failure class and exception code
      */
-	bool Run(unsigned short direction = 0);
+	ModbusResult Run(unsigned short direction = 0);
+
+    /**
+     * @brief Set the frequency and run motor with one request
+	 * (0x2000 and 0x2001 registers are written together)
+     * 
+     * @param freq[in]		- Frequency command to set
+     * @param direction[in]	- Set rotation direction (0 - no change, 1 - forward, 2 - reverse, 3 - change)
+     * @return ModbusResult - Run success, otherwise failure class and exception code
+     */
+	ModbusResult RunWithFrequency(double freq, unsigned short direction = 0);
 
     /**
      * @brief Stop motor with specified deceleration
      * 
-     * @return true     - Stop success
-     * @return false    - Stop fail
+     * @return ModbusResult - Stop success, otherwise failure class and exception code
      */
-	bool Stop();
+	ModbusResult Stop();
 
     /**
      * @brief Run motor to specified frequency with specified
@@ -96,42 +205,143 @@ public:
      * @param newFreq[in]       - New motor frequency
      * @param changeTime[in]	- Acceleration or deceleraiton time for which the
 	 * specified frequency will be reached
-     * @return true				- Set new frequency and time success
-     * @return false			- Set new frequency and time fail
+     * @return ModbusResult - Set new frequency and time success, otherwise failure class and exception code
      */
-	bool ChangeFrequency(
+	ModbusResult ChangeFrequency(
 		double curFreq = 0,
 		double newFreq = 50,
 		double changeTime = 1);
 
+	/**
+	 * @brief Write only the ramp time of frequency change (see PlanTransition()).
+	 * Ramp time written in advance is not written again by ChangeFrequency()
+	 * with the same arguments (01-09 and 01-10 are shadowed), so the change
+	 * costs only the frequency write. The drive uses the ramp time at once, so
+	 * call it only when the ramp which is in progress uses other parameter
+	 * (see RampParameters()) or when the ramp in progress has to be corrected
+	 *
+	 * @param curFreq[in]		- Motor frequency at the beginning of change
+	 * @param newFreq[in]		- New motor frequency
+	 * @param changeTime[in]	- Time for which the new frequency will be reached
+	 * @param written[out]		- set to true if ramp time was sent (optional)
+	 * @return ModbusResult - Set time success, otherwise failure class and exception code
+	 */
+	ModbusResult PrepareFrequencyChange(
+		double curFreq,
+		double newFreq,
+		double changeTime,
+		bool* written = nullptr);
+
+	/**
+	 * @brief Get ramp time parameters which ChangeFrequency() writes
+	 *
+	 * @param curFreq[in]		- Current motor frequency
+	 * @param newFreq[in]		- New motor frequency
+	 * @return unsigned char	- VFD_RAMP_ACCELERATION and/or VFD_RAMP_DECELERATION (VFD_RAMP_NONE - no change)
+	 */
+	static unsigned char RampParameters(double curFreq, double newFreq);
+
+	/**
+	 * @brief Plan register writes of frequency change (pure function, nothing is sent).
+	 * Ramp time is written first and only if the drive doesn't hold it already
+	 * (01-09 and 01-10 are written with one 0x10 request when both are needed),
+	 * then run command and frequency are written with one 0x10 request when motor
+	 * starts or changes direction (direction is given explicitly, so a repeated
+	 * request is harmless), otherwise only the frequency is written.
+	 *
+	 * @param state[in]			- register values the drive holds
+	 * @param maxFreq[in]		- maximum output frequency (01-00)
+	 * @param curFreq[in]		- current motor frequency
+	 * @param newFreq[in]		- new motor frequency
+	 * @param changeTime[in]	- time for which the new frequency will be reached
+	 * @param writes[out]		- array of VFD_MAX_TRANSITION_WRITES writes in order of sending
+	 * @return unsigned char	- number of writes (0 - nothing to change)
+	 */
+	static unsigned char PlanTransition(
+		const VFD_drive_state_t* state,
+		double maxFreq,
+		double curFreq,
+		double newFreq,
+		double changeTime,
+		VFD_write_t* writes);
+
+	/**
+	 * @brief Get live round trip time estimate of register write on this drive
+	 * (exponential average of writes of ChangeFrequency(), PrepareFrequencyChange()
+	 * and SetWatchdog()). Estimate of the other request is used while this one is not measured
+	 *
+	 * @param count[in]	- number of written registers (1 - 0x06 request, 2 - 0x10 request)
+	 * @return double	- time from request start to response end in seconds (0 - nothing is measured)
+	 */
+	double WriteTime(unsigned char count);
+
+	/**
+	 * @brief Get transmission time of register write request and its response
+	 * at the current baudrate: the lower bound of WriteTime()
+	 *
+	 * @param count[in]	- number of written registers (1 - 0x06 request, 2 - 0x10 request)
+	 * @return double	- time in seconds
+	 */
+	double WriteAirTime(unsigned char count);
+
+	/**
+	 * @brief Predict time from ChangeFrequency() call to the moment new frequency
+	 * command is in force: round trips of all writes it plans now (see PlanTransition())
+	 *
+	 * @param curFreq[in]		- Current motor frequency
+	 * @param newFreq[in]		- New motor frequency
+	 * @param changeTime[in]	- Time for which the new frequency will be reached
+	 * @return double			- time in seconds (0 - nothing to write or nothing is measured)
+	 */
+	double TransitionDelay(double curFreq, double newFreq, double changeTime);
+
     /**
      * @brief Read motor current status and parameters from registers 0x2101-0x210C
 	 * and store them into structures
      * 
      * @param status[out]   - pointer to structure where status will be stored
      * @param param[out]    - pointer to structure where parameters will be stored
-     * @return true         - Read success
-     * @return false        - Read fail
+     * @return ModbusResult - Read success, otherwise failure class and exception code
      */
-	bool ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param);
+	ModbusResult ReadParameterRegisters(VFD_status_t* status, VFD_param_t* param);
+
+    /**
+     * @brief Read status and parameters (0x2101-0x210C) together with optional
+	 * power (0x210F), heatsink temperature (0x2206) and any other register.
+	 * Registers are read with the minimal number of requests
+	 * (see ModbusRTUClient::PlanReadFrames())
+     * 
+     * @param status[out]       - pointer to structure where status will be stored
+     * @param param[out]        - pointer to structure where parameters will be stored
+     * @param power[out]        - [optional] pointer to variable where power will be stored
+     * @param temp[out]         - [optional] pointer to variable where temperature will be stored
+     * @param regAddress[in]    - [optional] address of additional register
+     * @param regValue[out]     - [optional] pointer to variable where additional register value will be stored
+     * @return ModbusResult - Read success, otherwise failure class and exception code
+     */
+	ModbusResult ReadParameters(
+		VFD_status_t* status,
+		VFD_param_t* param,
+		double* power = nullptr,
+		double* temp = nullptr,
+		unsigned short regAddress = 0,
+		unsigned short* regValue = nullptr);
 
 	/**
 	 * @brief Get the power provided to motor (0x210F VFD parameter)
 	 *
 	 * @param power[out]	- Pointer to variable where power will be stored
-	 * @return true			- Read power success
-	 * @return false		- Read power fail
+	 * @return ModbusResult - Read power success, otherwise failure class and exception code
 	 */
-	bool GetOutPower(double* power);
+	ModbusResult GetOutPower(double* power);
 
     /**
      * @brief Get the temperature of VFD heatsink (0x2206 VFD parameter)
      * 
      * @param temp[out] - Pointer to variable where temperature will be stored
-     * @return true     - Read temperature success
-     * @return false    - Read temperature fail
+     * @return ModbusResult - Read temperature success, otherwise failure class and exception code
      */
-	bool GetVFDTemperature(double* temp);
+	ModbusResult GetVFDTemperature(double* temp);
 
     /**
      * @brief Get the maximum output frequency of motor (0x0100 VFD parameter)
@@ -140,37 +350,42 @@ public:
      * pointer to variable as an argument
      * 
      * @param maxFreq[out]  - [optional] Pointer to variable where max frequency will be stored
-     * @return true         - Read maximum output frequency success
-     * @return false        - Read maximum output frequency fail
+     * @return ModbusResult - Read maximum output frequency success, otherwise failure class and exception code
      */
-	bool ReadMaxFrequency(double* maxFreq = nullptr);
+	ModbusResult ReadMaxFrequency(double* maxFreq = nullptr);
 
     /**
      * @brief Set the Frequency of motor
      * 
      * @param freq[in]	- Frequency command to set
-     * @return true     - Set frequency success
-     * @return false    - Set frequency fail
+     * @return ModbusResult - Set frequency success, otherwise failure class and exception code
      */
-	bool SetFrequency(double freq);
+	ModbusResult SetFrequency(double freq);
 
     /**
      * @brief Set the Acceleration Time of motor
      * 
      * @param time[in]	- Time to set
-     * @return true     - Set time success
-     * @return false    - Set time fail
+     * @return ModbusResult - Set time success, otherwise failure class and exception code
      */
-	bool SetAccelerationTime(double time);
+	ModbusResult SetAccelerationTime(double time);
 
     /**
      * @brief Set the Deceleration Time of motor
      * 
      * @param time[in]	- Time to set
-     * @return true     - Set time success
-     * @return false    - Set time fail
+     * @return ModbusResult - Set time success, otherwise failure class and exception code
      */
-	bool SetDecelerationTime(double time);
+	ModbusResult SetDecelerationTime(double time);
+
+    /**
+     * @brief Set the same Acceleration and Deceleration Time of motor with one request
+	 * (01-09 and 01-10 parameters are written together)
+     * 
+     * @param time[in]	- Time to set
+     * @return ModbusResult - Set time success, otherwise failure class and exception code
+     */
+	ModbusResult SetAccDecTime(double time);
 
     /**
      * @brief Set the Watchdog timer for Modbus communication.
@@ -180,21 +395,34 @@ public:
      * Set 0 to switch off watchdog timer
      * 
      * @param time[in]	- Watchdog time to set
-     * @return true     - Set watchdog success
-     * @return false    - Set time fail
+     * @return ModbusResult - Set watchdog success, otherwise failure class and exception code
      */
-	bool SetWatchdog(double time = 0);
+	ModbusResult SetWatchdog(double time = 0);
 
     /**
      * @brief Allows to Get and Set VFD parameters directly
      * 
      * @param addr      - parameter address
      * @param val       - pointer to value where parameter will be stored or value to write into VFD
-     * @return true     - if success
-     * @return false    - if fail
+     * @return ModbusResult - Access success, otherwise failure class and exception code
+     */
+	ModbusResult GetParam(unsigned short addr, unsigned short* val);
+	ModbusResult SetParam(unsigned short addr, unsigned short val);
+
+    /**
+     * @brief Get counters of shadow register file, which removes redundant
+	 * configuration reads and writes (see VFD constructor for cached registers)
+     * 
+     * @return ModbusShadowStats_t	- hits, misses and skipped writes
+     */
+	ModbusShadowStats_t GetShadowStats();
+
+    /**
+     * @brief Get the clock of the port (real time or virtual time of simulator)
+     * 
+     * @return Clock&	- time source which programs controlling this VFD should use
      */
-	bool GetParam(unsigned short addr, unsigned short* val);
-	bool SetParam(unsigned short addr, unsigned short val);
+	Clock& GetClock();
 };
 
 #endif // VFD_H
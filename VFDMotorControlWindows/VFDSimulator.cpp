@@ -0,0 +1,316 @@
+#include "VFDSimulator.h"
+#include <cmath> // for motor model
+
+// Motor on the VFD output (4 poles, 2.2kW, 380V, 50Hz, fan load) ////////////
+const double ratedFrequency = 50.0;		// Hz
+const double ratedVoltage = 380.0;		// V
+const double ratedCurrent = 5.0;		// A
+const double ratedTorque = 14.6;		// Nm (2.2kW at 1440rpm)
+const double ratedSlip = 60.0;			// rpm at rated torque
+const double magnetizingCurrent = 1.8;	// A at rated voltage
+const double frictionTorque = 0.05;		// fraction of rated torque while rotating
+const double fanTorque = 0.6;			// fraction of rated torque at rated frequency
+const double inertia = 0.05;			// kg*m^2 (motor and load)
+const double polePairs = 2;
+const double pi = 3.14159265358979;
+const double busVoltage = 537.0;		// V (rectified 380V)
+const double regenBusRise = 60.0;		// V of DC bus rise while braking at full torque
+// Heatsink
+const double ambientTemperature = 25.0;	// degC
+const double ratedTemperatureRise = 35.0;	// degC at rated current
+const double thermalTimeConstant = 300.0;	// s
+// 0x2100 error code reported after communication timeout (CE10)
+const unsigned short communicationTimeoutError = 54;
+
+VFDSimulator::VFDSimulator(unsigned char address /* = 1 */) :
+	address(address),
+	time(0),
+	lastRequest(0),
+	maxFrequency(5000),
+	accTime(100),
+	decTime(100),
+	watchdogMode(3),
+	watchdogTime(0),
+	frequencyCommand(0),
+	running(false),
+	reverse(false),
+	errorCode(0),
+	outFrequency(0),
+	acceleration(0),
+	temperature(ambientTemperature)
+{
+}
+
+void VFDSimulator::Advance(double seconds)
+{
+	if (seconds <= 0) return;
+	// Communication timeout happens inside this step: integrate up to it and react
+	double timeout = watchdogTime / 10.0;
+	if (running && (timeout > 0) && (watchdogMode == 1 || watchdogMode == 2) &&
+		((time + seconds - lastRequest) > timeout))
+	{
+		double before = lastRequest + timeout - time;
+		if (before > 0)
+		{
+			Advance(before);
+			seconds -= before;
+		}
+		running = false;
+		errorCode = communicationTimeoutError;
+		if (watchdogMode == 2) outFrequency = 0; // coast to stop: output is off at once
+	}
+	double startFrequency = outFrequency;
+	Integrate(seconds);
+	acceleration = (fabs(outFrequency) - fabs(startFrequency)) / seconds;
+	// Heatsink follows losses with first order lag
+	double torque, power, voltage, current;
+	Load(&torque, &power, &voltage, &current);
+	double target = ambientTemperature +
+		ratedTemperatureRise * (current / ratedCurrent) * (current / ratedCurrent);
+	temperature += (target - temperature) * (1 - exp(-seconds / thermalTimeConstant));
+	time += seconds;
+}
+
+void VFDSimulator::Integrate(double seconds)
+{
+	double command = frequencyCommand / 100.0;
+	if (command > maxFrequency / 100.0) command = maxFrequency / 100.0;
+	double target = running ? (reverse ? -command : command) : 0;
+	// 01-09 and 01-10 are times of change between 0 and 01-00
+	double accRate = (maxFrequency / 100.0) / (accTime / 10.0);
+	double decRate = (maxFrequency / 100.0) / (decTime / 10.0);
+	// Every pass reaches target, zero crossing or end of step
+	while ((seconds > 0) && (outFrequency != target))
+	{
+		bool sameSide = (outFrequency == 0) || ((outFrequency > 0) == (target > 0));
+		double step;
+		double next;
+		if (sameSide && (fabs(target) > fabs(outFrequency)))
+		{
+			// Accelerate away from zero
+			step = fabs(target - outFrequency) / accRate;
+			if (step > seconds)
+			{
+				step = seconds;
+				next = outFrequency + ((target > 0) ? accRate : -accRate) * step;
+			}
+			else next = target;
+		}
+		else
+		{
+			// Decelerate to target or to zero before direction change
+			double stop = sameSide ? target : 0;
+			step = fabs(outFrequency - stop) / decRate;
+			if (step > seconds)
+			{
+				step = seconds;
+				next = outFrequency + ((outFrequency > 0) ? -decRate : decRate) * step;
+			}
+			else next = stop;
+		}
+		outFrequency = next;
+		seconds -= step;
+	}
+}
+
+void VFDSimulator::Load(double* torque, double* power, double* voltage, double* current)
+{
+	double f = fabs(outFrequency);
+	if ((f == 0) && !running)
+	{
+		*torque = *power = *voltage = *current = 0;
+		return;
+	}
+	// Fan load, friction and torque to change speed of the inertia
+	double load = ratedTorque * (fanTorque * (f / ratedFrequency) * (f / ratedFrequency) +
+		((f > 0) ? frictionTorque : 0));
+	*torque = load + inertia * 2 * pi * acceleration / polePairs;
+	double omega = 2 * pi * f / polePairs;
+	*power = (*torque > 0) ? (*torque * omega / 1000.0) : 0;
+	// V/f characteristic with low frequency boost
+	*voltage = ratedVoltage * f / ratedFrequency;
+	if (*voltage < 0.05 * ratedVoltage) *voltage = 0.05 * ratedVoltage;
+	if (*voltage > ratedVoltage) *voltage = ratedVoltage;
+	double activeCurrent = *power * 1000.0 / (sqrt(3.0) * *voltage);
+	double reactiveCurrent = magnetizingCurrent * *voltage / ratedVoltage;
+	*current = sqrt(activeCurrent * activeCurrent + reactiveCurrent * reactiveCurrent);
+}
+
+bool VFDSimulator::ReadRegister(unsigned short reg, unsigned short* value)
+{
+	double torque, power, voltage, current;
+	Load(&torque, &power, &voltage, &current);
+	double f = fabs(outFrequency);
+	switch (reg)
+	{
+	case 0x0100: *value = maxFrequency; return true;
+	case 0x0109: *value = accTime; return true;
+	case 0x010A: *value = decTime; return true;
+	case 0x0902: *value = watchdogMode; return true;
+	case 0x0903: *value = watchdogTime; return true;
+	case 0x2001: *value = frequencyCommand; return true;
+	case 0x2100: *value = errorCode; return true;
+	case 0x2101:
+	{
+		bool active = running || (f > 0);
+		bool rev = (outFrequency < 0) || ((outFrequency == 0) && reverse);
+		*value = (active ? 1 << 0 : 1 << 1) |		// RUN or STOP LED
+			(rev ? 1 << 4 : 1 << 3) |				// REV or FWD LED
+			(1 << 8) | (1 << 10) |					// frequency and operation from serial interface
+			(active ? 1 << 12 : 0);					// VFD works
+		return true;
+	}
+	case 0x2102:
+		*value = (frequencyCommand > maxFrequency) ? maxFrequency : frequencyCommand;
+		return true;
+	case 0x2103: *value = (unsigned short)round(f * 100); return true;
+	case 0x2104: *value = (unsigned short)round(current * 10); return true;
+	case 0x2105:
+	{
+		// Braking energy returns into DC bus
+		double bus = busVoltage;
+		if (torque < 0) bus += regenBusRise * (-torque / ratedTorque);
+		*value = (unsigned short)round(bus * 10);
+		return true;
+	}
+	case 0x2106: *value = (unsigned short)round(voltage * 10); return true;
+	case 0x2107: // multi-step speed, PLC and counter are not used
+	case 0x2108:
+	case 0x2109:
+	case 0x210D:
+	case 0x210E:
+		*value = 0;
+		return true;
+	case 0x210A:
+	{
+		double pf = (current > 0) ? (power * 1000.0 / (sqrt(3.0) * voltage * current)) : 0;
+		*value = (unsigned short)round(pf * 100);
+		return true;
+	}
+	case 0x210B: *value = (unsigned short)round(((torque > 0) ? torque : 0) * 10); return true;
+	case 0x210C:
+	{
+		double rpm = 60.0 * f / polePairs - ratedSlip * torque / ratedTorque;
+		*value = (unsigned short)round((rpm > 0) ? rpm : 0);
+		return true;
+	}
+	case 0x210F: *value = (unsigned short)round(power * 10); return true;
+	case 0x2206: *value = (unsigned short)round(temperature); return true;
+	default: return false;
+	}
+}
+
+unsigned char VFDSimulator::WriteRegister(unsigned short reg, unsigned short value)
+{
+	switch (reg)
+	{
+	case 0x0100: // 50.00 - 400.00Hz
+		if ((value < 5000) || (value > 40000)) return 0x03;
+		maxFrequency = value;
+		return 0;
+	case 0x0109: // 0.1 - 3600.0s
+	case 0x010A:
+		if ((value < 1) || (value > 36000)) return 0x03;
+		if (reg == 0x0109) accTime = value;
+		else decTime = value;
+		return 0;
+	case 0x0902:
+		if (value > 3) return 0x03;
+		watchdogMode = value;
+		return 0;
+	case 0x0903: // 0 - 60.0s
+		if (value > 600) return 0x03;
+		watchdogTime = value;
+		return 0;
+	case 0x2000:
+		// Bits 0-1: 01 - stop, 10 - run, 11 - jog run
+		if ((value & 0x3) == 0x1) running = false;
+		else if ((value & 0x3) != 0) running = true;
+		// Bits 4-5: 01 - forward, 10 - reverse, 11 - change direction
+		if (((value >> 4) & 0x3) == 0x1) reverse = false;
+		else if (((value >> 4) & 0x3) == 0x2) reverse = true;
+		else if (((value >> 4) & 0x3) == 0x3) reverse = !reverse;
+		if (running) errorCode = 0;
+		return 0;
+	case 0x2001:
+		if (value > maxFrequency) return 0x03;
+		frequencyCommand = value;
+		return 0;
+	default:
+		return 0x02;
+	}
+}
+
+double VFDSimulator::Time()
+{
+	return time;
+}
+
+double VFDSimulator::OutFrequency()
+{
+	return outFrequency;
+}
+
+unsigned char VFDSimulator::Process(const unsigned char* request, unsigned char length, unsigned char* response)
+{
+	if ((length < 2) || ((request[0] != address) && (request[0] != 0))) return 0;
+	lastRequest = time; // any request to this server feeds the watchdog
+	unsigned short start = (length >= 6) ? ((request[2] << 8) | request[3]) : 0;
+	unsigned short value = (length >= 6) ? ((request[4] << 8) | request[5]) : 0;
+	unsigned char exception = 0;
+	unsigned char rLength = 0;
+	response[0] = address;
+	response[1] = request[1];
+	switch (request[1])
+	{
+	case 0x03: // Read Holding Registers
+		if ((length != 6) || (value < 1) || (value > 125))
+		{
+			exception = 0x03;
+			break;
+		}
+		response[2] = (unsigned char)(value * 2);
+		for (unsigned short i = 0; (i < value) && !exception; i++)
+		{
+			unsigned short reg;
+			if (!ReadRegister(start + i, &reg)) exception = 0x02;
+			response[3 + i * 2] = reg >> 8;
+			response[4 + i * 2] = reg & 0xFF;
+		}
+		rLength = (unsigned char)(3 + value * 2);
+		break;
+	case 0x06: // Write Single Register
+		if (length != 6)
+		{
+			exception = 0x03;
+			break;
+		}
+		exception = WriteRegister(start, value);
+		for (unsigned char i = 2; i < 6; i++) response[i] = request[i];
+		rLength = 6;
+		break;
+	case 0x10: // Write Multiple Registers
+		if ((length < 7) || (value < 1) || (value > 123) ||
+			(request[6] != value * 2) || (length != 7 + value * 2))
+		{
+			exception = 0x03;
+			break;
+		}
+		for (unsigned short i = 0; (i < value) && !exception; i++)
+			exception = WriteRegister(start + i, (request[7 + i * 2] << 8) | request[8 + i * 2]);
+		for (unsigned char i = 2; i < 6; i++) response[i] = request[i];
+		rLength = 6;
+		break;
+	default:
+		exception = 0x01;
+		break;
+	}
+	if (request[0] == 0) return 0; // broadcast is not answered
+	if (exception)
+	{
+		response[1] = request[1] | 0x80;
+		response[2] = exception;
+		return 3;
+	}
+	return rLength;
+}
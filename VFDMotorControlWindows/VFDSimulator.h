@@ -0,0 +1,116 @@
+/**
+ * @file VFDSimulator.h
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Model of Delta VFD-B with a motor on its output behind COMPortFake.
+ * Serves Modbus requests like VFD does (VFD-B_manual_rus.pdf) and integrates
+ * output frequency on a virtual clock, so long diagrams can be checked offline
+ * much faster than in real time.
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#ifndef VFDSIMULATOR_H
+#define VFDSIMULATOR_H
+
+class VFDSimulator
+{
+private:
+	unsigned char	address;		// Modbus server address
+	double			time;			// Virtual time in seconds
+	double			lastRequest;	// Virtual time of the last request (watchdog)
+	// Parameters
+	unsigned short	maxFrequency;	// 01-00 max output frequency (0.01Hz)
+	unsigned short	accTime;		// 01-09 acceleration time from 0 to 01-00 (0.1s)
+	unsigned short	decTime;		// 01-10 deceleration time from 01-00 to 0 (0.1s)
+	unsigned short	watchdogMode;	// 09-02 reaction on communication timeout
+	unsigned short	watchdogTime;	// 09-03 communication timeout (0.1s, 0 - disabled)
+	// Commands
+	unsigned short	frequencyCommand;	// 0x2001 frequency command (0.01Hz)
+	bool			running;		// RUN is commanded
+	bool			reverse;		// REV is commanded
+	unsigned short	errorCode;		// 0x2100 error code
+	// State
+	double			outFrequency;	// Output frequency in Hz (negative - reverse)
+	double			acceleration;	// Output frequency change rate in the last step (Hz/s)
+	double			temperature;	// Heatsink temperature in degC
+
+	/**
+	 * @brief Move output frequency towards the frequency command with
+	 * acceleration and deceleration rates set by 01-09 and 01-10
+	 *
+	 * @param seconds[in]	- time step
+	 */
+	void Integrate(double seconds);
+
+	/**
+	 * @brief Calculate motor load and electrical values at the current output frequency
+	 *
+	 * @param torque[out]	- shaft torque in Nm
+	 * @param power[out]	- output power in kW
+	 * @param voltage[out]	- output voltage in V
+	 * @param current[out]	- output current in A
+	 */
+	void Load(double* torque, double* power, double* voltage, double* current);
+
+	/**
+	 * @brief Get value of register as VFD reports it
+	 *
+	 * @param reg[in]		- register address
+	 * @param value[out]	- register value
+	 * @return true			- if register exists
+	 * @return false		- if register doesn't exist (ILLEGAL DATA ADDRESS)
+	 */
+	bool ReadRegister(unsigned short reg, unsigned short* value);
+
+	/**
+	 * @brief Write register as VFD does
+	 *
+	 * @param reg[in]			- register address
+	 * @param value[in]			- register value
+	 * @return unsigned char	- 0 if written, otherwise Modbus exception code
+	 */
+	unsigned char WriteRegister(unsigned short reg, unsigned short value);
+public:
+	/**
+	 * @brief Construct a new VFDSimulator object: stopped VFD with factory parameters
+	 *
+	 * @param address[in]	- Modbus server address
+	 */
+	VFDSimulator(unsigned char address = 1);
+
+	/**
+	 * @brief Advance virtual clock (the only way the model time goes)
+	 *
+	 * @param seconds[in]	- time step
+	 */
+	void Advance(double seconds);
+
+	/**
+	 * @brief Get virtual time
+	 *
+	 * @return double	- seconds from the model start
+	 */
+	double Time();
+
+	/**
+	 * @brief Get output frequency
+	 *
+	 * @return double	- output frequency in Hz (negative - reverse)
+	 */
+	double OutFrequency();
+
+	/**
+	 * @brief Serve one request (functions 0x03, 0x06 and 0x10)
+	 *
+	 * @param request[in]		- request ADU without CRC
+	 * @param length[in]		- request ADU length without CRC
+	 * @param response[out]		- response ADU without CRC (256 bytes buffer)
+	 * @return unsigned char	- response length without CRC (0 - no response)
+	 */
+	unsigned char Process(const unsigned char* request, unsigned char length, unsigned char* response);
+};
+
+#endif // VFDSIMULATOR_H
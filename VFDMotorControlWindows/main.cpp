@@ -8,7 +8,8 @@ Help
 This program can control Delta VFD-B.
 Input commandline arguments:
 -h | --help         Display this help message
---port <COMx>       Specify serial port (COM3 default) (--port COM3)
+--port <COMx>       Specify serial port (COM3 default) (--port COM3 or --port /dev/ttyUSB0)
+--fake              Use fake port with predefined responses instead of VFD (for testing)
 --file <text_file>	Read a file with frequency and time parameters table. (--file coords.txt)
 					And run motor according to the table.
 Text file should contain table with times and frequencies and should look like this:
@@ -40,6 +41,31 @@ specified in the first column.)
 					<0x(parameter address)> (--set 0x2001 0x1388)
 --run <n|f|r|c>     Run motor with direction set (no change, forvard, reverse, change) (--run r)
 --stop              Stop motor
+--compile <text_file> <binary_file> [max_frequency]  Check and convert diagram into binary file
+					which is mapped into memory by --file without parsing, for VFD with
+					01-00 max_frequency (50Hz default) (--compile coords.txt coords.vfdd 60)
+--tolerance <Hz>    Drop diagram points which a straight ramp follows within the tolerance
+					to save bus writes (with --file or --compile) (--tolerance 0.5)
+--prestage          Write ramp time of the next diagram segment during the current one
+					when the drive allows it, so the boundary costs only setpoint write
+--compensate        Start frequency changes earlier by measured write round trip time,
+					so they are in force at diagram time (predicted and effective times are printed)
+--trim <Hz>         Correct measured lag behind diagram up to this frequency: ramp time of
+					the ramp in progress is rewritten (setpoint is trimmed with --setpoints)
+--setpoints <Hz>    Keep short fixed ramps and write frequency interpolated from diagram
+					at this rate (limited by bus capacity) instead of programming ramps
+--stream <seconds>  Read diagram file while the motor runs, keeping this part of diagram ahead
+					(for files too long to be loaded into memory) (--stream 10)
+--realtime [cpu]    Run diagram loop pinned to CPU (the last one by default) under SCHED_FIFO
+					with locked memory (Linux, needs root or rtprio and memlock limits)
+--bench <name>      Run microbenchmark without VFD connection (--bench crc)
+					<crc> - compare CRC16 implementations
+					<latency> - measure scheduling latency (with --realtime too)
+					<transitions> - count request frames of frequency changes over
+					diagram (--file or coords.txt)
+					<setpoints> - run diagram (--file or coords.txt) on simulator in ramp
+					mode and in --setpoints mode (5Hz by default), compare tracking
+					error and bus load
 
  *
  * @version 0.2
@@ -63,9 +89,23 @@ struct {
 	bool set;
 	bool run;
 	bool stop;
+	bool bench;
+	bool fake;
+	bool compile;
 } CMD;
-char portName[9] = "COM3";			// port name from command line
+char portName[32] = "COM3";			// port name from command line (or device path on POSIX)
 char* diagramFileName = nullptr;	// file name with diagram
+char* benchName = nullptr;			// benchmark name from command line
+char* compileFileName = nullptr;	// binary diagram file of --compile
+double compileMaxFrequency = 50;	// 01-00 the diagram is compiled for
+int realtimeCPU = -1;				// CPU of --realtime mode (-1 if mode is off)
+double streamLookahead = 0;			// queue of --stream mode in seconds (0 - diagram is loaded)
+bool prestageRamps = false;			// ramp times of --prestage mode are written before segment boundaries
+bool compensateLatency = false;		// writes of --compensate mode start earlier by their round trip time
+double trimLimit = 0;				// correction limit of --trim mode in Hz (0 - no correction)
+double setpointRate = 0;			// setpoints per second of --setpoints mode (0 - ramps are programmed)
+double diagramTolerance = 0;		// frequency tolerance of diagram simplification in Hz (0 - off)
+RunStats_t runStats = { 0 };		// statistics of the last diagram run
 // Get parameters flags
 struct {
 	bool FrequencyCommand;
@@ -124,7 +164,17 @@ void PrintHelp();
  * @return true		- if all motor parameters have set successfully
  * @return false	- if some error occured
  */
-bool SetMotorParameters(VFD& motor);
+template <class Transport>
+bool SetMotorParameters(VFD<Transport>& motor);
+
+/**
+ * @brief Execute commands given in CLI arguments on the connected VFD
+ *
+ * @param motor[in]	- reference to VFD class instance
+ * @return int		- 0 if all commands have finished successfully, -1 otherwise
+ */
+template <class Transport>
+int ExecuteCommands(VFD<Transport>& motor);
 
 /* Main function *************************************************************/
 /**
@@ -161,8 +211,36 @@ int main(int argc, char* argv[])
 	}
 	// Print help text ////////////////////////////////////////////////////////
 	if (CMD.help) PrintHelp();
+	// Benchmarks don't need VFD connection ///////////////////////////////////
+	if (CMD.bench) return RunBenchmark(benchName) ? 0 : -1;
+	// Diagram compiler doesn't need VFD connection too ///////////////////////
+	if (CMD.compile) return CompileDiagram(diagramFileName, compileFileName, compileMaxFrequency, diagramTolerance) ? 0 : -1;
+
+	try
+	{
+		// Transport is chosen here once, calls to it are resolved at compile time
+		if (CMD.fake)
+		{
+			VFD<COMPortFake> motor({ 1, { portName, 9600, 8, 'E', 1 } }); // VFD class instance
+			return ExecuteCommands(motor);
+		}
+		VFD<COMPort> motor({ 1, { portName, 9600, 8, 'E', 1 } }); // VFD class instance
+		return ExecuteCommands(motor);
+	}
+	catch (const ModbusError& e)
+	{
+		printf("Modbus error: %s (%s)\n", e.what(), e.Result().Describe());
+	}
+	catch (const char* e)
+	{
+		printf("Port error: %s\n", e);
+	}
+	return -1;
+}
 
-	VFD motor({ 1, { portName, 9600, 8, 'E', 1 } }); // VFD class instance
+template <class Transport>
+int ExecuteCommands(VFD<Transport>& motor)
+{
 
 	// File handling //////////////////////////////////////////////////////////
 	if (CMD.file)
@@ -187,30 +265,32 @@ int main(int argc, char* argv[])
 	if (CMD.run)
 	{
 #ifndef NDEBUG
-		clock_t start_time = clock();
+		double start_time = motor.GetClock().Now();
 #endif // NDEBUG
-		if (!motor.Run(runMode))
+		ModbusResult result = motor.Run(runMode);
+		if (!result)
 		{
-			assert(("main: Run error", 0));
+			printf("main: Run error: %s\n", result.Describe());
 			return -1;
 		}
 #ifndef NDEBUG
-		printf("main: Motor started in %ldms\n", (clock() - start_time));
+		printf("main: Motor started in %gms\n", (motor.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
 	}
 	// Stop handling //////////////////////////////////////////////////////////
 	if (CMD.stop)
 	{
 #ifndef NDEBUG
-		clock_t start_time = clock();
+		double start_time = motor.GetClock().Now();
 #endif // NDEBUG
-		if (!motor.Stop())
+		ModbusResult result = motor.Stop();
+		if (!result)
 		{
-			assert(("main: Stop error", 0));
+			printf("main: Stop error: %s\n", result.Describe());
 			return -1;
 		}
 #ifndef NDEBUG
-		printf("main: Motor stopped in %ldms\n", (clock() - start_time));
+		printf("main: Motor stopped in %gms\n", (motor.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
 	}
 	return 0;
@@ -236,12 +316,17 @@ void HandleCLIArguments(int argc, char* argv[])
 			if (argv[i + 1] != nullptr)
 			{
 				size_t len;
-				if (strlen(argv[i + 1]) < 9) len = strlen(argv[i + 1]);
-				else len = 8;
+				if (strlen(argv[i + 1]) < sizeof(portName)) len = strlen(argv[i + 1]);
+				else len = sizeof(portName) - 1;
 				// Copy port name
 				strcpy_s(portName, len + 1, argv[i + 1]);
 			}
 		}
+		// Handle --fake argument
+		else if (!strcmp(argv[i], "--fake"))
+		{
+			CMD.fake = true;
+		}
 		// Handle --file argument
 		else if (!strcmp(argv[i], "--file"))
 		{
@@ -346,6 +431,64 @@ void HandleCLIArguments(int argc, char* argv[])
 		{
 			CMD.stop = true;
 		}
+		// Handle --compile argument (max frequency is optional)
+		else if (!strcmp(argv[i], "--compile"))
+		{
+			if ((argv[i + 1] != nullptr) && (argv[i + 2] != nullptr))
+			{
+				CMD.compile = true;
+				diagramFileName = argv[i + 1];
+				compileFileName = argv[i + 2];
+				if ((argv[i + 3] != nullptr) && (argv[i + 3][0] >= '0') && (argv[i + 3][0] <= '9'))
+					compileMaxFrequency = atof(argv[i + 3]);
+			}
+		}
+		// Handle --tolerance argument
+		else if (!strcmp(argv[i], "--tolerance"))
+		{
+			if (argv[i + 1] != nullptr) diagramTolerance = atof(argv[i + 1]);
+		}
+		// Handle --prestage argument
+		else if (!strcmp(argv[i], "--prestage"))
+		{
+			prestageRamps = true;
+		}
+		// Handle --compensate argument
+		else if (!strcmp(argv[i], "--compensate"))
+		{
+			compensateLatency = true;
+		}
+		// Handle --trim argument
+		else if (!strcmp(argv[i], "--trim"))
+		{
+			if (argv[i + 1] != nullptr) trimLimit = atof(argv[i + 1]);
+		}
+		// Handle --setpoints argument
+		else if (!strcmp(argv[i], "--setpoints"))
+		{
+			if (argv[i + 1] != nullptr) setpointRate = atof(argv[i + 1]);
+		}
+		// Handle --stream argument
+		else if (!strcmp(argv[i], "--stream"))
+		{
+			if (argv[i + 1] != nullptr) streamLookahead = atof(argv[i + 1]);
+		}
+		// Handle --realtime argument (CPU number is optional)
+		else if (!strcmp(argv[i], "--realtime"))
+		{
+			if ((argv[i + 1] != nullptr) && (argv[i + 1][0] >= '0') && (argv[i + 1][0] <= '9'))
+				realtimeCPU = atoi(argv[i + 1]);
+			else realtimeCPU = DefaultRealTimeCPU();
+		}
+		// Handle --bench argument
+		else if (!strcmp(argv[i], "--bench"))
+		{
+			if (argv[i + 1] != nullptr)
+			{
+				CMD.bench = true;
+				benchName = argv[i + 1];
+			}
+		}
 	}
 	return;
 }
@@ -356,7 +499,8 @@ void PrintHelp()
 	printf("This program can control Delta VFD-B.\n");
 	printf("Input commandline arguments:\n");
 	printf("-h | --help\t\t\tDisplay this help message\n");
-	printf("--port <COMx>\t\t\tSpecify serial port (COM3 default) (--port COM3)\n");
+	printf("--port <COMx>\t\t\tSpecify serial port (COM3 default) (--port COM3 or --port /dev/ttyUSB0)\n");
+	printf("--fake\t\t\t\tUse fake port with predefined responses instead of VFD (for testing)\n");
 	printf("--file <text_file>\t\tRead a file with frequency and time parameters table. (--file coords.txt)\n");
 	printf("\t\t\t\tAnd run motor according to the table.\n");
 	printf("Text file should contain table with times and frequencies and should look like this:\n");
@@ -387,49 +531,56 @@ void PrintHelp()
 	printf("\t\t\t\t<DecelerationTime>\n");
 	printf("\t\t\t\t<0x(parameter address)> (--set 0x2001 0x1388)\n");
 	printf("--run <n|f|r|c>\t\t\tRun motor with direction set (no change, forvard, reverse, change) (--run r)\n");
-	printf("--stop\t\t\t\tStop motor\n\n");
+	printf("--stop\t\t\t\tStop motor\n");
+	printf("--compile <text_file> <binary_file> [max_frequency]\n");
+	printf("\t\t\t\tCheck and convert diagram into binary file which is mapped into memory\n");
+	printf("\t\t\t\tby --file without parsing, for VFD with 01-00 max_frequency (50Hz default)\n");
+	printf("\t\t\t\t(--compile coords.txt coords.vfdd 60)\n");
+	printf("--tolerance <Hz>\t\tDrop diagram points which a straight ramp follows within the tolerance\n");
+	printf("\t\t\t\tto save bus writes (with --file or --compile) (--tolerance 0.5)\n");
+	printf("--prestage\t\t\tWrite ramp time of the next diagram segment during the current one\n");
+	printf("\t\t\t\twhen the drive allows it, so the boundary costs only setpoint write\n");
+	printf("--compensate\t\t\tStart frequency changes earlier by measured write round trip time,\n");
+	printf("\t\t\t\tso they are in force at diagram time (predicted and effective times are printed)\n");
+	printf("--trim <Hz>\t\t\tCorrect measured lag behind diagram up to this frequency: ramp time of\n");
+	printf("\t\t\t\tthe ramp in progress is rewritten (setpoint is trimmed with --setpoints)\n");
+	printf("--setpoints <Hz>\t\tKeep short fixed ramps and write frequency interpolated from diagram\n");
+	printf("\t\t\t\tat this rate (limited by bus capacity) instead of programming ramps\n");
+	printf("--stream <seconds>\t\tRead diagram file while the motor runs, keeping this part of diagram ahead\n");
+	printf("\t\t\t\t(for files too long to be loaded into memory) (--stream 10)\n");
+	printf("--realtime [cpu]\t\tRun diagram loop pinned to CPU (the last one by default) under SCHED_FIFO\n");
+	printf("\t\t\t\twith locked memory (Linux, needs root or rtprio and memlock limits)\n");
+	printf("--bench <name>\t\t\tRun microbenchmark without VFD connection (--bench crc)\n");
+	printf("\t\t\t\t<crc> - compare CRC16 implementations\n");
+	printf("\t\t\t\t<latency> - measure scheduling latency (with --realtime too)\n");
+	printf("\t\t\t\t<transitions> - count request frames of frequency changes over\n");
+	printf("\t\t\t\tdiagram (--file or coords.txt)\n");
+	printf("\t\t\t\t<setpoints> - run diagram (--file or coords.txt) on simulator in ramp\n");
+	printf("\t\t\t\tmode and in --setpoints mode (5Hz by default), compare tracking\n");
+	printf("\t\t\t\terror and bus load\n\n");
 }
 
-bool GetMotorParameters(VFD& motor)
+template <class Transport>
+ModbusResult GetMotorParameters(VFD<Transport>& motor)
 {
 #ifndef NDEBUG
-	clock_t start_time = clock();
+	double start_time = motor.GetClock().Now();
 #endif // NDEBUG
-	if (!motor.ReadParameterRegisters(&motorStatus, &motorParams))
+	// All requested registers are read together with the minimal number of requests
+	ModbusResult result = motor.ReadParameters(&motorStatus, &motorParams,
+		getParam.OutPower ? &OutPower : nullptr,
+		getParam.VFDTemperature ? &VFDtemperature : nullptr,
+		getReg_a, getParam.reg ? &getReg_v : nullptr);
+	if (!result)
 	{
-		assert(("main::GetMotorParameters() Read parameters error", 0));
-		return false;
-	}
-	// Read OutPower parameter
-	if (getParam.OutPower)
-	{
-		if (!motor.GetOutPower(&OutPower))
-		{
-			assert(("main::GetMotorParameters() Read power error", 0));
-			return false;
-		}
-	}
-	// Read VFDTemperature parameter
-	if (getParam.VFDTemperature)
-	{
-		if (!motor.GetVFDTemperature(&VFDtemperature))
-		{
-			assert(("main::GetMotorParameters() Read temperature error", 0));
-			return false;
-		}
-	}
-	if (getParam.reg)
-	{
-		if (!motor.GetParam(getReg_a, &getReg_v))
-		{
-			assert(("main::GetMotorParameters() Get parameter error", 0));
-			return false;
-		}
+		printf("main::GetMotorParameters() Read parameters error: %s\n", result.Describe());
+		return result;
 	}
 #ifndef NDEBUG
-	printf("main::GetMotorParameters() Read param time: %ld\n", clock() - start_time);
+	printf("main::GetMotorParameters() Read param time: %gms\n",
+		(motor.GetClock().Now() - start_time) * 1000);
 #endif // NDEBUG
-	return true;
+	return result;
 }
 
 void PrintParametersHeader(bool Time /* = false */, FILE* printStream /* = stdout */)
@@ -588,14 +739,16 @@ void PrintParameters(double Time /* = -1 */, FILE* printStream /* = stdout */)
 	fprintf(printStream, "\n");
 }
 
-bool SetMotorParameters(VFD& motor)
+template <class Transport>
+bool SetMotorParameters(VFD<Transport>& motor)
 {
 	// Set frequency
 	if (setParam.Frequency_f)
 	{
-		if (!motor.SetFrequency(setParam.Frequency_v))
+		ModbusResult result = motor.SetFrequency(setParam.Frequency_v);
+		if (!result)
 		{
-			assert(("main::SetMotorParameters() Set frequency error", 0));
+			printf("main::SetMotorParameters() Set frequency error: %s\n", result.Describe());
 			return false;
 		}
 #ifndef NDEBUG
@@ -605,9 +758,10 @@ bool SetMotorParameters(VFD& motor)
 	// Set acceleration time
 	if (setParam.AccelerationTime_f)
 	{
-		if (!motor.SetAccelerationTime(setParam.AccelerationTime_v))
+		ModbusResult result = motor.SetAccelerationTime(setParam.AccelerationTime_v);
+		if (!result)
 		{
-			assert(("main::SetMotorParameters() Set acceleration time error", 0));
+			printf("main::SetMotorParameters() Set acceleration time error: %s\n", result.Describe());
 			return false;
 		}
 #ifndef NDEBUG
@@ -617,9 +771,10 @@ bool SetMotorParameters(VFD& motor)
 	// Set deceleration time
 	if (setParam.DecelerationTime_f)
 	{
-		if (!motor.SetDecelerationTime(setParam.DecelerationTime_v))
+		ModbusResult result = motor.SetDecelerationTime(setParam.DecelerationTime_v);
+		if (!result)
 		{
-			assert(("main::SetMotorParameters() Set deceleration time error", 0));
+			printf("main::SetMotorParameters() Set deceleration time error: %s\n", result.Describe());
 			return false;
 		}
 #ifndef NDEBUG
@@ -629,9 +784,10 @@ bool SetMotorParameters(VFD& motor)
 	// Set any param
 	if (setParam.reg_f)
 	{
-		if (!motor.SetParam(setParam.reg_a, setParam.reg_v))
+		ModbusResult result = motor.SetParam(setParam.reg_a, setParam.reg_v);
+		if (!result)
 		{
-			assert(("main::SetMotorParameters() Set parameter error", 0));
+			printf("main::SetMotorParameters() Set parameter error: %s\n", result.Describe());
 			return false;
 		}
 #ifndef NDEBUG
@@ -640,3 +796,7 @@ bool SetMotorParameters(VFD& motor)
 	}
 	return true;
 }
+
+// GetMotorParameters() is used by RunDiagramFromFile() in FileHandle.cpp
+template ModbusResult GetMotorParameters(VFD<COMPort>& motor);
+template ModbusResult GetMotorParameters(VFD<COMPortFake>& motor);
@@ -24,34 +24,85 @@
 #include <cassert>	// for debug printing
 
 #include "VFD.h"	// for motor control
+#include "RealTime.h"	// for --realtime mode and deadline statistics
+#include "Diagram.h"	// for diagram file reading
+#include "Portable.h"	// for MSVC functions on POSIX hosts
 
 using namespace std;
 
+// Statistics of the last diagram run (printed at its end, compared by --bench setpoints)
+typedef struct {
+	unsigned long	samples;		// tracking error measurements
+	double			trackingRms;	// RMS of measured frequency against diagram in Hz
+	double			trackingMax;	// maximal deviation in Hz
+	double			writeLoad;		// part of run time the bus was busy with writes
+	double			readLoad;		// part of run time the bus was busy with reads
+} RunStats_t;
+
 // Global variables ///////////////////////////////////////////////////////////
 
 extern char*		diagramFileName;	// file name with diagram
 extern VFD_status_t	motorStatus;		// Stores motor status
 extern VFD_param_t	motorParams;		// Stores motor parameters
+extern double		OutPower;			// Stores power provided to motor
+extern double		VFDtemperature;		// Stores temperature of VFD heatsink
+extern unsigned short getReg_v;			// stores register value from VFD
+extern int			realtimeCPU;		// CPU of --realtime mode (-1 if mode is off)
+extern double		streamLookahead;	// queue of --stream mode in seconds (0 - diagram is loaded)
+extern bool			prestageRamps;		// ramp times of --prestage mode are written before segment boundaries
+extern bool			compensateLatency;	// writes of --compensate mode start earlier by their round trip time
+extern double		trimLimit;			// correction limit of --trim mode in Hz (0 - no correction)
+extern double		setpointRate;		// setpoints per second of --setpoints mode (0 - ramps are programmed)
+extern double		diagramTolerance;	// frequency tolerance of diagram simplification in Hz (0 - off)
+extern RunStats_t	runStats;			// statistics of the last diagram run
 
 // Global function prototypes /////////////////////////////////////////////////
 /**
  * @brief Run motor according to the file with input coordinats.
+ * The whole file is loaded and checked before the motor starts (see LoadDiagram()),
+ * with --stream CLI argument it is read while the motor runs (see DiagramStream).
+ * Binary diagram (--compile CLI argument) is mapped into memory (see MapDiagram()).
+ * With --tolerance CLI argument loaded diagram is simplified (see SimplifyDiagram()).
+ * With --prestage CLI argument ramp time of the next segment is written during
+ * the current one where the drive allows it (see VFD::PrepareFrequencyChange()),
+ * time from boundary to the end of setpoint write is printed at the end.
+ * With --setpoints CLI argument ramps are fixed and interpolated frequency is
+ * written at a fixed rate instead. Tracking error and bus load are printed at the end.
+ * With --compensate CLI argument writes start earlier by their measured round trip
+ * time, so frequency command is in force at diagram time. Predicted and effective
+ * times of every frequency change are printed.
+ * With --trim CLI argument measured lag behind diagram is corrected within
+ * the limit: by ramp time of the ramp in progress or by setpoint with --setpoints.
  * Also measure motor parameters specified by -- get CLI argument.
+ * Segment changes and reads are done at absolute deadlines from the diagram
+ * start, lateness percentiles and missed deadlines are printed at the end.
+ * With --realtime CLI argument the loop runs in real-time mode (see EnterRealTime()).
  *
  * @param motor[in] - reference to VFD class instance
  * @return true     - if motor have run according to the file
  * @return false    - if some error occured
  */
-bool RunDiagramFromFile(VFD& motor);
+template <class Transport>
+bool RunDiagramFromFile(VFD<Transport>& motor);
 
 /**
  * @brief Get the Motor Parameters requested by user and print them
  *
  * @param motor[in] - reference to VFD class instance
- * @return true     - if all motor parameters have read successfully
- * @return false    - if some error occured
+ * @return ModbusResult - if all motor parameters have read successfully,
+ * otherwise failure class which tells whether the read is worth retrying
+ */
+template <class Transport>
+ModbusResult GetMotorParameters(VFD<Transport>& motor);
+
+/**
+ * @brief Run microbenchmark specified by --bench CLI argument
+ *
+ * @param name[in]	- benchmark name
+ * @return true		- if benchmark finished successfully
+ * @return false	- if benchmark is unknown or its self check fails
  */
-bool GetMotorParameters(VFD& motor);
+bool RunBenchmark(const char* name);
 
 /**
  * @brief Print table header for parameters, specified in input arguments
@@ -0,0 +1,133 @@
+/**
+ * @file COMPortPtyTest.cpp
+ * @author TAN4UK (tan4ukmak7@gmail.com)
+ * @brief Test of POSIX COMPort backend over a pseudo-terminal pair (Linux).
+ * COMPort opens the slave side as a serial device, the test plays the VFD
+ * on the master side. Build and run from VFDMotorControlWindows directory:
+ * g++ -std=c++14 -DNDEBUG -I. tests/COMPortPtyTest.cpp COMPortPosix.cpp Clock.cpp -o ptytest -lpthread && ./ptytest
+ * @version 0.1
+ * @date 2023-03-10
+ *
+ * @copyright Copyright (c) 2023 TAN4UK
+ *
+ */
+
+#include "COMPort.h"
+#include <cstdio>	// for results printing
+#include <cstdlib>	// for 'posix_openpt'
+#include <cstring>	// for frames compare
+#include <fcntl.h>	// for O_RDWR
+#include <unistd.h>	// for master side 'read' and 'write'
+#include <thread>	// for delayed master side writes
+#include <chrono>	// for delays and time measure
+
+static unsigned long failures = 0;	// number of failed checks
+
+/**
+ * @brief Print result of one check
+ *
+ * @param name[in]		- what is checked
+ * @param success[in]	- check result
+ */
+static void Check(const char* name, bool success)
+{
+	printf("%s: %s\n", success ? "PASS" : "FAIL", name);
+	if (!success) failures++;
+}
+
+/**
+ * @brief Get time from the test start
+ *
+ * @return long	- time in milliseconds
+ */
+static long NowMs()
+{
+	static std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Write bytes into master side after a delay
+ *
+ * @param master[in]	- master side descriptor
+ * @param buf[in]		- bytes to write
+ * @param length[in]	- number of bytes
+ * @param delay[in]		- delay in milliseconds
+ * @return std::thread	- writer thread (join it)
+ */
+static std::thread WriteLater(int master, const unsigned char* buf, size_t length, long delay)
+{
+	return std::thread([=]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+		if (write(master, buf, length) != (ssize_t)length) printf("Master write error\n");
+	});
+}
+
+int main()
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0))
+	{
+		printf("Pseudo-terminal is not available\n");
+		return 1;
+	}
+	COMPort port(ptsname(master), 9600, 8, 'E', 1);
+	Check("Open slave side", port.Open());
+
+	// 1) Request reaches master side unchanged
+	unsigned char request[8] = { 0x01, 0x03, 0x21, 0x01, 0x00, 0x0C, 0x9E, 0x33 };
+	Check("Write returns frame length", port.Write(request, sizeof(request)) == sizeof(request));
+	unsigned char received[16];
+	ssize_t n = read(master, received, sizeof(received));
+	Check("Master receives the same frame", (n == sizeof(request)) && !memcmp(received, request, sizeof(request)));
+
+	// 2) Response within total timeout is read in full
+	unsigned char response[5] = { 0x01, 0x83, 0x02, 0xC0, 0xF1 };
+	unsigned char buf[64];
+	port.SetReadTimeouts(0, 0, 500);
+	std::thread writer = WriteLater(master, response, sizeof(response), 30);
+	long start = NowMs();
+	long nRead = port.Read(buf, sizeof(response));
+	long time = NowMs() - start;
+	writer.join();
+	Check("Total timeout: delayed response is read in full",
+		(nRead == sizeof(response)) && !memcmp(buf, response, sizeof(response)) && (time < 500));
+
+	// 3) Silence ends read at total timeout
+	port.SetReadTimeouts(0, 0, 100);
+	start = NowMs();
+	nRead = port.Read(buf, sizeof(response));
+	time = NowMs() - start;
+	Check("Total timeout: silence returns 0 bytes after the timeout", (nRead == 0) && (time >= 95) && (time < 300));
+
+	// 4) Interval timeout only: the first byte is waited without limit
+	port.SetReadTimeouts(5, 0, 0);
+	writer = WriteLater(master, response, sizeof(response), 100);
+	start = NowMs();
+	nRead = port.Read(buf, sizeof(response));
+	time = NowMs() - start;
+	writer.join();
+	Check("Interval timeout only: read waits for the first byte",
+		(nRead == sizeof(response)) && (time >= 95));
+
+	// 5) Gap longer than interval ends the frame
+	port.SetReadTimeouts(5, 0, 1000);
+	writer = WriteLater(master, response, 2, 10);
+	std::thread tail = WriteLater(master, response + 2, 3, 200);
+	start = NowMs();
+	nRead = port.Read(buf, sizeof(response));
+	time = NowMs() - start;
+	writer.join();
+	tail.join();
+	Check("Interval timeout: gap ends read with received bytes", (nRead == 2) && (time < 150));
+	Check("Clear read buffer", port.ClearReadBuffer());
+
+	// 6) Hung up line fails the write instead of waiting for it
+	close(master);
+	Check("Write to hung up line fails", port.Write(request, sizeof(request)) < 0);
+
+	port.Close();
+	printf("%lu failures\n", failures);
+	return (failures == 0) ? 0 : 1;
+}
@@ -5,25 +5,49 @@
 //#define NDEBUG
 #include <assert.h>
 
+// CRC16 of every byte value (polynomial A001H), replaces 8 shifts per byte
+// with one lookup. 512 bytes of constant data.
+static const unsigned int crcTable[256] = {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
 unsigned int ModbusRTUClient::CRC16(unsigned char* data, unsigned char length)
 {
-	int i = 0;
 	unsigned int CRC16 = 0xFFFF;
-	while (length > i)
+	while (length--)
 	{
-		CRC16 = CRC16 ^ data[i];
-		for (char j = 0; j < 8; j++)
-		{
-			if (CRC16 & 0x01)
-			{
-				CRC16 = (CRC16 >> 1) ^ 0xA001;
-			}
-			else
-			{
-				CRC16 = CRC16 >> 1;
-			}
-		}
-		i = i + 1;
+		CRC16 = (CRC16 >> 8) ^ crcTable[(CRC16 ^ *data++) & 0xFF];
 	}
 	return CRC16;
 }
@@ -37,42 +61,58 @@ char ModbusRTUClient::responseCRCCheck(unsigned char pduBytes)
 	return rCRC == rCalcCRC;
 }
 
-char ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
+char ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes,
+	const ModbusPinnedFrame_t* frame /* = 0 */)
 {
 #ifndef NDEBUG
 	unsigned long start_time = GetTimeTicks();
 #endif // NDEBUG
-	// Fill request ADU
-	wBuf[0] = devAddress;				// Server device address
-	// Calculate CRC
-	unsigned short wCRC = CRC16(wBuf, (wPDUBytes + 1));
-	wBuf[wPDUBytes + 1] = wCRC & 0xFF;	// CRC Lo
-	wBuf[wPDUBytes + 2] = wCRC >> 8;	// CRC Hi
+	unsigned char* request = wBuf;	// request ADU to write
+	if (frame != 0)
+	{
+		// Pre-encoded request already has server address and CRC
+		request = (unsigned char*)frame->request;
+	}
+	else
+	{
+		// Fill request ADU
+		wBuf[0] = devAddress;				// Server device address
+		// Calculate CRC
+		unsigned short wCRC = CRC16(wBuf, (wPDUBytes + 1));
+		wBuf[wPDUBytes + 1] = wCRC & 0xFF;	// CRC Lo
+		wBuf[wPDUBytes + 2] = wCRC >> 8;	// CRC Hi
+	}
 	// Transfer frame
+	staleBytes = 0;
 	for (unsigned char attempt = 1; attempt <= transmitAttempts; attempt++)
 	{
-		// Write buffer to port
-		long bytesWritten = COM.Write(wBuf, (wPDUBytes + 3));
-		if (bytesWritten != (wPDUBytes + 3))
+		// Bytes received before the request is sent can't be its response
+		if (resync)
 		{
+			if (COM.ClearReadBuffer() == 0)
+			{
 #ifndef NDEBUG
-			Print("ModbusRTUClient::Transfer() Attempt %u: Request write failed\n", attempt);
+				Print("ModbusRTUClient::Transfer() Attempt %u: Clear buffer failed\n", attempt);
 #endif // NDEBUG
-			continue;
+				continue;
+			}
+			resync = 0;
 		}
-		// Clear buffer
-		if (COM.ClearReadBuffer() == 0)
+		// Write buffer to port
+		long bytesWritten = COM.Write(request, (wPDUBytes + 3));
+		if (bytesWritten != (wPDUBytes + 3))
 		{
 #ifndef NDEBUG
-			Print("ModbusRTUClient::Transfer() Attempt %u: Clear buffer failed\n", attempt);
+			Print("ModbusRTUClient::Transfer() Attempt %u: Request write failed\n", attempt);
 #endif // NDEBUG
 			continue;
 		}
 
-		long bytesRead = COM.Read(rBuf, (rPDUBytes + 3));
+		long bytesRead = ReceiveResponse(request, (rPDUBytes + 3));
 		// Check receive errors
 		if (bytesRead == -1)
 		{
+			resync = 1;
 #ifndef NDEBUG
 			Print("ModbusRTUClient::Transfer() Attempt %u: Response read failed\n", attempt);
 #endif // NDEBUG
@@ -80,6 +120,7 @@ char ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
 		}
 		if (bytesRead == 0)
 		{
+			resync = 1;
 			assert(("ModbusRTUClient::Transfer() Transfer timeout", 0));
 			return 0;
 		}
@@ -94,22 +135,38 @@ char ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
 #ifndef NDEBUG
 			Print("ModbusRTUClient::Transfer() Attempt %u: Bytes count mismatch\n", attempt);
 #endif // NDEBUG
+			resync = 1;
 			// Increase timeout if the server is too slow
 			COM.SetReadTimeouts((attempt * 2), 0, 1000);
 			continue;
 		}
+		// Whole expected response is known: comparison replaces CRC calculation
+		if ((frame != 0) && (frame->responseLength == bytesRead) &&
+			(memcmp(rBuf, frame->response, frame->responseLength) == 0))
+		{
+#ifndef NDEBUG
+			Print("ModbusRTUClient::Transfer() Transfer success (pinned frame). Attempt: %u, time: %ldms, stale bytes: %u\n",
+				attempt, (GetTimeTicks() - start_time), staleBytes);
+#endif // NDEBUG
+			return 1;
+		}
 		if (!responseCRCCheck(rPDUBytes))
 		{
 #ifndef NDEBUG
 			Print("ModbusRTUClient::Transfer() Attempt %u: Frame CRC check error\n", attempt);
 #endif // NDEBUG
+			resync = 1;
 			continue;
 		}
-		if (rBuf[0] == wBuf[0]) // Success transfer
+		// Check server address (and the whole header of pinned read response)
+		char headerMatch = (rBuf[0] == request[0]);
+		if ((frame != 0) && (frame->responseLength < bytesRead))
+			headerMatch = (memcmp(rBuf, frame->response, frame->responseLength) == 0);
+		if (headerMatch) // Success transfer
 		{
 #ifndef NDEBUG
-			Print("ModbusRTUClient::Transfer() Transfer success. Attempt: %u, time: %ldms\n",
-				attempt, (GetTimeTicks() - start_time));
+			Print("ModbusRTUClient::Transfer() Transfer success. Attempt: %u, time: %ldms, stale bytes: %u\n",
+				attempt, (GetTimeTicks() - start_time), staleBytes);
 #endif // NDEBUG
 			return 1;
 		}
@@ -118,6 +175,7 @@ char ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
 #ifndef NDEBUG
 			Print("ModbusRTUClient::Transfer() Attempt %u: Incorrect server address in response\n", attempt);
 #endif // NDEBUG
+			resync = 1;
 			continue;
 		}
 	}
@@ -126,6 +184,53 @@ char ModbusRTUClient::Transfer(unsigned char wPDUBytes, unsigned char rPDUBytes)
 	return 0;
 }
 
+long ModbusRTUClient::ReceiveResponse(const unsigned char* request, unsigned char expectedBytes)
+{
+	long received = 0;	// bytes of the frame candidate in rBuf
+	while (1)
+	{
+		// Every response is at least 5 bytes long, 3 of them are enough to know its length
+		if (received < 3)
+		{
+			long header = COM.Read(&rBuf[received], (unsigned char)(3 - received));
+			if (header < 0) return -1;
+			received += header;
+			if (received < 3) return received;
+		}
+		// Response starts with server address and function code of the request
+		// (function code with 0x80 bit in exception response)
+		if ((rBuf[0] != request[0]) || ((rBuf[1] & 0x7F) != request[1]))
+		{
+			// Rest of an old frame or line noise: shift by one byte
+			memmove(rBuf, &rBuf[1], (unsigned int)(--received));
+			staleBytes++;
+			// Line is flooded: let Transfer() fail this attempt
+			if (staleBytes >= sizeof(rBuf)) return received;
+			continue;
+		}
+		// Exception response: address, function + 0x80, exception code, CRC
+		unsigned char aduLength = expectedBytes;
+		if (rBuf[1] & 0x80) aduLength = 5;
+		else if ((rBuf[1] == 0x03) && (rBuf[2] <= 250)) aduLength = (unsigned char)(rBuf[2] + 5); // 3 + 250 + 2 = 255 fits
+		// Read exactly the rest of the frame
+		long rest = COM.Read(&rBuf[received], (unsigned char)(aduLength - received));
+		if (rest < 0) return -1;
+		received += rest;
+		if (received < aduLength) return received;
+		// Whole frame with correct CRC which is not the answer to this request
+		// is a late response to the previous one: drop it and wait for the next
+		char answer = (aduLength == expectedBytes) || (rBuf[1] & 0x80);
+		if (answer && (rBuf[1] == 0x06))
+			answer = (memcmp(rBuf, request, 6) == 0); // write response echoes the request
+		if (answer || !responseCRCCheck((unsigned char)(aduLength - 3))) return received;
+		staleBytes += aduLength;
+#ifndef NDEBUG
+		Print("ModbusRTUClient::ReceiveResponse() Late response of %u bytes dropped\n", aduLength);
+#endif // NDEBUG
+		received = 0;
+	}
+}
+
 void ModbusRTUClient::PrintException(unsigned char attempt)
 {
 	unsigned char excepCode = rBuf[2];
@@ -144,7 +249,10 @@ void ModbusRTUClient::PrintException(unsigned char attempt)
 
 ModbusRTUClient::ModbusRTUClient(unsigned char devAddress, COMPort com) :
 	COM(com),
-	transmitAttempts(5)
+	transmitAttempts(5),
+	nPinned(0),
+	resync(0),
+	staleBytes(0)
 {
 	memset(wBuf, 0, 256);
 	memset(rBuf, 0, 256);
@@ -175,10 +283,14 @@ ModbusRTUClient::ModbusRTUClient(unsigned char devAddress, COMPort com) :
 ModbusRTUClient::ModbusRTUClient(ModbusRTUClient& other) :
 	COM(other.COM),
 	devAddress(other.devAddress),
-	transmitAttempts(other.transmitAttempts)
+	transmitAttempts(other.transmitAttempts),
+	nPinned(other.nPinned),
+	resync(other.resync),
+	staleBytes(other.staleBytes)
 {
 	memcpy(wBuf, other.wBuf, 256);
 	memcpy(rBuf, other.rBuf, 256);
+	memcpy(pinned, other.pinned, sizeof(pinned));
 }
 
 ModbusRTUClient::~ModbusRTUClient()
@@ -208,15 +320,19 @@ char ModbusRTUClient::ReadHoldingRegisters(
 		assert(("ModbusRTUClient::ReadHoldingRegisters() Address range exceeded", 0));
 		return 0;
 	}
-	// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.3)
-	wBuf[1] = 0x03;					// Function code
-	wBuf[2] = startAddress >> 8;	// Starting Address Hi
-	wBuf[3] = startAddress & 0xFF;	// Starting Address Lo
-	wBuf[4] = 0x00;					// N of Registers Hi
-	wBuf[5] = nRegisters;			// N of Registers Lo
+	const ModbusPinnedFrame_t* frame = FindPinnedFrame(0x03, startAddress, nRegisters);
+	if (frame == 0)
+	{
+		// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.3)
+		wBuf[1] = 0x03;					// Function code
+		wBuf[2] = startAddress >> 8;	// Starting Address Hi
+		wBuf[3] = startAddress & 0xFF;	// Starting Address Lo
+		wBuf[4] = 0x00;					// N of Registers Hi
+		wBuf[5] = nRegisters;			// N of Registers Lo
+	}
 
 	// (Number of PDU bytes to read) = (Function code) + (Byte count) + 2 * (Quantity of Registers)
-	if (!Transfer(5, (1 + 1 + 2 * nRegisters))) return 0;
+	if (!Transfer(5, (1 + 1 + 2 * nRegisters), frame)) return 0;
 
 	// Check byte count
 	if (rBuf[2] != (2 * nRegisters))
@@ -250,18 +366,23 @@ char ModbusRTUClient::WriteSingleRegister(
 	Print("ModbusRTUClient::WriteSingleRegister() Write value 0x%04X into address 0x%04X\n",
 		regValue, regAddress);
 #endif // NDEBUG
-	// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.6)
-	wBuf[1] = 0x06;				// Function code
-	wBuf[2] = regAddress >> 8;	// Register Address Hi
-	wBuf[3] = regAddress & 0xFF;// Register Address Lo
-	wBuf[4] = regValue >> 8;	// Register Value Hi
-	wBuf[5] = regValue & 0xFF;	// Register Value Lo
+	const ModbusPinnedFrame_t* frame = FindPinnedFrame(0x06, regAddress, regValue);
+	if (frame == 0)
+	{
+		// Create PDU frame // Modbus_Application_Protocol_V1_1b3.pdf (chapter 6.6)
+		wBuf[1] = 0x06;				// Function code
+		wBuf[2] = regAddress >> 8;	// Register Address Hi
+		wBuf[3] = regAddress & 0xFF;// Register Address Lo
+		wBuf[4] = regValue >> 8;	// Register Value Hi
+		wBuf[5] = regValue & 0xFF;	// Register Value Lo
+	}
 
 	// Write and read PDU size is the same
-	if (!Transfer(5, 5)) return 0;
+	if (!Transfer(5, 5, frame)) return 0;
 
 	// The normal response is an echo of the request. Check it
-	if (memcmp(&(wBuf[1]), &(rBuf[1]), 5) != 0)
+	const unsigned char* request = (frame != 0) ? frame->request : wBuf;
+	if (memcmp(&(request[1]), &(rBuf[1]), 5) != 0)
 	{
 		assert(("ModbusRTUClient::WriteSingleRegister() Response check mismatch", 0));
 		return 0;
@@ -272,6 +393,74 @@ char ModbusRTUClient::WriteSingleRegister(
 	return 1;
 }
 
+const ModbusPinnedFrame_t* ModbusRTUClient::FindPinnedFrame(
+	unsigned char function,
+	unsigned short address,
+	unsigned short value)
+{
+	for (unsigned char i = 0; i < nPinned; i++)
+	{
+		const ModbusPinnedFrame_t* frame = &pinned[i];
+		if ((frame->function == function) && (frame->address == address) &&
+			(frame->value == value) && (frame->request[0] == devAddress))
+			return frame;
+	}
+	return 0;
+}
+
+char ModbusRTUClient::PinFrame(
+	unsigned char function,
+	unsigned short address,
+	unsigned short value)
+{
+	if (FindPinnedFrame(function, address, value) != 0) return 1; // already pinned
+	if (nPinned >= sizeof(pinned) / sizeof(pinned[0]))
+	{
+		assert(("ModbusRTUClient::PinFrame() Frame cache is full", 0));
+		return 0;
+	}
+	if ((function == 0x03) && ((value < 1) || (value > 125)))
+	{
+		assert(("ModbusRTUClient::PinFrame() Incorrect quantity of registers", 0));
+		return 0;
+	}
+	if ((function != 0x03) && (function != 0x06))
+	{
+		assert(("ModbusRTUClient::PinFrame() Function is not supported", 0));
+		return 0;
+	}
+	ModbusPinnedFrame_t* frame = &pinned[nPinned];
+	frame->function = function;
+	frame->address = address;
+	frame->value = value;
+	// Request ADU: address, function, address (quantity or value) and CRC
+	frame->request[0] = devAddress;
+	frame->request[1] = function;
+	frame->request[2] = address >> 8;
+	frame->request[3] = address & 0xFF;
+	frame->request[4] = value >> 8;
+	frame->request[5] = value & 0xFF;
+	unsigned short crc = CRC16(frame->request, 6);
+	frame->request[6] = crc & 0xFF;	// CRC Lo
+	frame->request[7] = crc >> 8;	// CRC Hi
+	if (function == 0x06)
+	{
+		// The normal response is an echo of the request
+		memcpy(frame->response, frame->request, 8);
+		frame->responseLength = 8;
+	}
+	else
+	{
+		// Only header is known: address, function and byte count
+		frame->response[0] = devAddress;
+		frame->response[1] = function;
+		frame->response[2] = (unsigned char)(2 * value);
+		frame->responseLength = 3;
+	}
+	nPinned++;
+	return 1;
+}
+
 void ModbusRTUClient::SetNumberOfTransmitAttempts(unsigned char attempts /* = 1 */)
 {
 	if (attempts == 0) attempts = 1;
@@ -280,3 +469,8 @@ void ModbusRTUClient::SetNumberOfTransmitAttempts(unsigned char attempts /* = 1
 	Print("ModbusRTUClient::SetNumberOfTransmitAttempts() Set %u transmit attempts\n", attempts);
 #endif // NDEBUG
 }
+
+unsigned int ModbusRTUClient::GetStaleBytes(void)
+{
+	return staleBytes;
+}
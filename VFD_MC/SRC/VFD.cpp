@@ -9,6 +9,12 @@ VFD::VFD(ModbusRTUClient mb) :
 	MB(mb),
 	maxFrequency(50.0)
 {
+	// Hot fixed commands are encoded once: run in every direction (start bit
+	// and direction bits), stop and status read used by ReadParameterRegisters()
+	for (unsigned short direction = 0; direction <= 3; direction++)
+		MB.PinFrame(0x06, 0x2000, (1 << 1) | (direction << 4));
+	MB.PinFrame(0x06, 0x2000, 1 << 0);
+	MB.PinFrame(0x03, 0x2101, 12);
 #ifndef NDEBUG
 	Print("VFD::Constructor() Created instance 0x%p with params:\n", this);
 	Print("- MB: 0x%p\n", &(this->MB));